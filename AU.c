@@ -1,3 +1,9 @@
+#ifdef __linux__
+// For MAP_ANONYMOUS and MADV_HUGEPAGE.
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#endif
+
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
@@ -46,6 +52,77 @@ maxsz(size_t a, size_t b) {
   return a < b ? b : a;
 }
 
+////////////////////
+//// Statistics ////
+////////////////////
+
+#ifdef AU_STATS
+
+static struct AU_Stats stats[AU_NUM_KINDS];
+
+static inline void
+AU_StatMax(size_t *m, size_t v) {
+  size_t old = __atomic_load_n(m, __ATOMIC_RELAXED);
+  while (old < v &&
+         !__atomic_compare_exchange_n(m, &old, v, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED));
+}
+
+static inline void
+AU_StatLive(int kind, size_t add, size_t sub) {
+  size_t live = __atomic_add_fetch(&stats[kind].bytes_live, add - sub,
+                                   __ATOMIC_RELAXED);
+  AU_StatMax(&stats[kind].bytes_peak, live);
+}
+
+#define STAT_INC(kind, field) \
+  __atomic_add_fetch(&stats[kind].field, 1, __ATOMIC_RELAXED)
+#define STAT_MAX_CAP(kind, cap) AU_StatMax(&stats[kind].max_cap, (cap))
+#define STAT_LIVE_ADD(kind, n) AU_StatLive((kind), (n), 0)
+#define STAT_LIVE_SUB(kind, n) AU_StatLive((kind), 0, (n))
+
+#else
+
+#define STAT_INC(kind, field) ((void) 0)
+#define STAT_MAX_CAP(kind, cap) ((void) 0)
+#define STAT_LIVE_ADD(kind, n) ((void) 0)
+#define STAT_LIVE_SUB(kind, n) ((void) 0)
+
+#endif
+
+int
+AU_GetStats(struct AU_Stats *out) {
+#ifdef AU_STATS
+  for (int i = 0; i < AU_NUM_KINDS; i++) {
+    __atomic_load(&stats[i].setups, &out[i].setups, __ATOMIC_RELAXED);
+    __atomic_load(&stats[i].grows, &out[i].grows, __ATOMIC_RELAXED);
+    __atomic_load(&stats[i].allocs, &out[i].allocs, __ATOMIC_RELAXED);
+    __atomic_load(&stats[i].frees, &out[i].frees, __ATOMIC_RELAXED);
+    __atomic_load(&stats[i].max_cap, &out[i].max_cap, __ATOMIC_RELAXED);
+    __atomic_load(&stats[i].bytes_live, &out[i].bytes_live,
+                  __ATOMIC_RELAXED);
+    __atomic_load(&stats[i].bytes_peak, &out[i].bytes_peak,
+                  __ATOMIC_RELAXED);
+  }
+  return 0;
+#else
+  (void) out;
+  return AU_ERR_NO_STATS;
+#endif
+}
+
+const char *
+AU_KindName(int kind) {
+  static const char *names[AU_NUM_KINDS] = {
+    [AU_KIND_B1] = "ByteBuilder",
+    [AU_KIND_FSB] = "FixedSizeBuilder",
+    [AU_KIND_VSB] = "VarSizeBuilder",
+    [AU_KIND_FSA] = "FixedSizeAllocator",
+    [AU_KIND_ARENA] = "Arena"
+  };
+  return kind >= 0 && kind < AU_NUM_KINDS ? names[kind] : 0;
+}
+
 //////////////////////
 //// BYTE Builder ////
 //////////////////////
@@ -66,21 +143,29 @@ maxsz(size_t a, size_t b) {
 
 #endif
 
-int
-AU_B1_Setup(AU_ByteBuilder *b1, size_t cap) {
+static int
+AU_B1_SetupKind(AU_ByteBuilder *b1, size_t cap, int kind) {
   assert(cap > 0);
 
   b1->cap = cap;
   b1->used = 0;
+  b1->kind = kind;
   b1->mem = xmalloc(cap);
   if (!b1->mem) {
     ISSUE_ERROR(AU_ERR_XMALLOC);
     return AU_ERR_XMALLOC;
   }
+  STAT_INC(kind, setups);
+  STAT_MAX_CAP(kind, cap);
   ASSERT_VALID_B1(b1);
   return 0;
 }
 
+int
+AU_B1_Setup(AU_ByteBuilder *b1, size_t cap) {
+  return AU_B1_SetupKind(b1, cap, AU_KIND_B1);
+}
+
 int
 AU_B1_Append(AU_ByteBuilder *b1, const void *mem, size_t size) {
   ASSERT_VALID_B1(b1);
@@ -118,6 +203,8 @@ AU_B1_AppendForSetup(AU_ByteBuilder *b1, size_t size) {
     }
     b1->mem = p;
     b1->cap = new_cap;
+    STAT_INC(b1->kind, grows);
+    STAT_MAX_CAP(b1->kind, new_cap);
   }
   void *out_addr = (char*)b1->mem + b1->used;
   b1->used += size;
@@ -177,7 +264,7 @@ AU_FSB_Setup(AU_FixedSizeBuilder *fsb, size_t elt_size, size_t cap) {
   assert(elt_size > 0);
   assert(cap <= SIZE_MAX/elt_size);
 
-  int b1_res = AU_B1_Setup(&fsb->b1, elt_size*cap);
+  int b1_res = AU_B1_SetupKind(&fsb->b1, elt_size*cap, AU_KIND_FSB);
   if (b1_res < 0) {
     return b1_res;
   }
@@ -255,7 +342,7 @@ AU_FSB_GetUsedCount(AU_FixedSizeBuilder *fsb) {
 int
 AU_VSB_Setup(AU_VarSizeBuilder *vsb, size_t cap, size_t align) {
   vsb->align = align == AU_ALIGN_CONSERVATIVE ? ALIGNMENT_BOUNDARY : align;
-  return AU_B1_Setup(&vsb->b1, AlignSize(cap, vsb->align));
+  return AU_B1_SetupKind(&vsb->b1, AlignSize(cap, vsb->align), AU_KIND_VSB);
 }
 
 int
@@ -283,6 +370,143 @@ AU_VSB_GetUsedCount(AU_VarSizeBuilder *vsb) {
   return AU_B1_GetUsedCount(&vsb->b1);
 }
 
+///////////////
+//// Arena ////
+///////////////
+
+struct ArenaBlock {
+  struct ArenaBlock *prev;
+  size_t size;
+  int mapped;
+};
+
+enum {
+  ARENA_HUGE_PAGE_SIZE = 2 << 20
+};
+
+#define ARENA_HEADER_SIZE \
+  AlignSize(sizeof (struct ArenaBlock), ALIGNMENT_BOUNDARY)
+
+static struct ArenaBlock *
+AU_AR_NewBlock(size_t size, unsigned flags) {
+#ifdef __linux__
+  if ((flags & AU_ARENA_HUGE_PAGES) && size >= ARENA_HUGE_PAGE_SIZE &&
+      size <= SIZE_MAX - ARENA_HUGE_PAGE_SIZE)
+  {
+    size = AlignSize(size, ARENA_HUGE_PAGE_SIZE);
+    void *mem = mmap(0, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+      madvise(mem, size, MADV_HUGEPAGE);
+      struct ArenaBlock *block = mem;
+      block->size = size;
+      block->mapped = 1;
+      STAT_LIVE_ADD(AU_KIND_ARENA, size);
+      STAT_MAX_CAP(AU_KIND_ARENA, size);
+      return block;
+    }
+  }
+#else
+  (void) flags;
+#endif
+  struct ArenaBlock *block = xmalloc(size);
+  if (!block) {
+    ISSUE_ERROR(AU_ERR_XMALLOC);
+    return 0;
+  }
+  block->size = size;
+  block->mapped = 0;
+  STAT_LIVE_ADD(AU_KIND_ARENA, size);
+  STAT_MAX_CAP(AU_KIND_ARENA, size);
+  return block;
+}
+
+static int
+AU_AR_Expand(AU_Arena *ar, size_t size) {
+  size_t block_size = ar->next_size;
+  if (block_size - ARENA_HEADER_SIZE < size) {
+    if (size > SIZE_MAX - ARENA_HEADER_SIZE) {
+      ISSUE_ERROR(AU_ERR_OVERFLOW);
+      return AU_ERR_OVERFLOW;
+    }
+    block_size = size + ARENA_HEADER_SIZE;
+  }
+
+  struct ArenaBlock *block = AU_AR_NewBlock(block_size, ar->flags);
+  if (!block) {
+    return AU_ERR_XMALLOC;
+  }
+  if (ar->last_block) {
+    STAT_INC(AU_KIND_ARENA, grows);
+  }
+  block->prev = ar->last_block;
+  ar->last_block = block;
+  ar->cur = (char*)block + ARENA_HEADER_SIZE;
+  ar->end = (char*)block + block->size;
+  if (ar->next_size <= SIZE_MAX/2) {
+    ar->next_size *= 2;
+  }
+  return 0;
+}
+
+int
+AU_AR_Setup(AU_Arena *ar, size_t block_size, unsigned flags) {
+  assert(ar);
+  assert(block_size > 0);
+
+  ar->cur = 0;
+  ar->end = 0;
+  ar->last_block = 0;
+  ar->flags = flags;
+  STAT_INC(AU_KIND_ARENA, setups);
+  ar->next_size = block_size > SIZE_MAX - ARENA_HEADER_SIZE
+                  ? SIZE_MAX
+                  : block_size + ARENA_HEADER_SIZE;
+  return AU_AR_Expand(ar, block_size);
+}
+
+void *
+AU_AR_Alloc(AU_Arena *ar, size_t size) {
+  assert(ar);
+  assert(ar->next_size > 0);
+
+  if (size > SIZE_MAX - ALIGNMENT_BOUNDARY) {
+    ISSUE_ERROR(AU_ERR_OVERFLOW);
+    return 0;
+  }
+  size = AlignSize(size ? size : 1, ALIGNMENT_BOUNDARY);
+  if ((size_t) (ar->end - ar->cur) < size && AU_AR_Expand(ar, size) < 0) {
+    return 0;
+  }
+  void *out = ar->cur;
+  ar->cur += size;
+  STAT_INC(AU_KIND_ARENA, allocs);
+  return out;
+}
+
+void
+AU_AR_Destroy(AU_Arena *ar) {
+  assert(ar);
+
+  struct ArenaBlock *block = ar->last_block;
+  while (block) {
+    struct ArenaBlock *prev = block->prev;
+    STAT_LIVE_SUB(AU_KIND_ARENA, block->size);
+#ifdef __linux__
+    if (block->mapped) {
+      munmap(block, block->size);
+      block = prev;
+      continue;
+    }
+#endif
+    xfree(block);
+    block = prev;
+  }
+  ar->cur = 0;
+  ar->end = 0;
+  ar->last_block = 0;
+}
+
 //////////////////////////////
 //// Fixed Size Allocator ////
 //////////////////////////////
@@ -294,7 +518,7 @@ enum {
 
 /*
  * The idea here is to allocate blocks of about N = sizeof (void*) + elt_size
- * bytes. When capacity limit is reached, total_cap + <some_delta> blocks of N
+ * bytes. When capacity limit is reached, <some_delta> more blocks of N
  * bytes are allocated, and the pointer to its first byte is appended to
  * fsb_base_ptrs so we know where they are in order to free them later.
  *
@@ -317,48 +541,62 @@ AU_FSA_NewCap(size_t cap) {
   return cap > SIZE_MAX - delta ? SIZE_MAX : cap + delta;
 }
 
+static size_t
+AU_FSA_NodeSize(const AU_FixedSizeAllocator *fsa) {
+  return PTR_SIZE_ALIGN + AlignSize(fsa->elt_size, ALIGNMENT_BOUNDARY);
+}
+
 static int
 AU_FSA_Expand(AU_FixedSizeAllocator *fsa, size_t new_cap) {
   assert(new_cap > fsa->total_cap);
 
-  size_t elt_alsize = AlignSize(fsa->elt_size, ALIGNMENT_BOUNDARY);
-  size_t node_alsize = PTR_SIZE_ALIGN + elt_alsize;
+  size_t node_alsize = AU_FSA_NodeSize(fsa);
+  size_t num_nodes = new_cap - fsa->total_cap;
 
-  if (node_alsize > SIZE_MAX/new_cap) {
+  if (node_alsize > SIZE_MAX/num_nodes) {
     ISSUE_ERROR(AU_ERR_OVERFLOW);
     return AU_ERR_OVERFLOW;
   }
 
-  char *mem = xmalloc(node_alsize*new_cap);
-  if (!mem) {
-    ISSUE_ERROR(AU_ERR_XMALLOC);
-    return AU_ERR_XMALLOC;
+  char *mem;
+  if (fsa->arena) {
+    mem = AU_AR_Alloc(fsa->arena, node_alsize*num_nodes);
+    if (!mem) {
+      return AU_ERR_XMALLOC;
+    }
   }
+  else {
+    mem = xmalloc(node_alsize*num_nodes);
+    if (!mem) {
+      ISSUE_ERROR(AU_ERR_XMALLOC);
+      return AU_ERR_XMALLOC;
+    }
 
-  // Appending the pointer into fsb_base_ptrs so we remember it later when
-  // we need to destroy this allocator.
-  int res = AU_FSB_Append(&fsa->fsb_base_ptrs, &mem, 1);
-  if (res < 0) {
-    xfree(mem);
-    return res;
+    // Appending the pointer into fsb_base_ptrs so we remember it later when
+    // we need to destroy this allocator.
+    int res = AU_FSB_Append(&fsa->fsb_base_ptrs, &mem, 1);
+    if (res < 0) {
+      xfree(mem);
+      return res;
+    }
+    STAT_LIVE_ADD(AU_KIND_FSA, node_alsize*num_nodes);
   }
+  STAT_MAX_CAP(AU_KIND_FSA, node_alsize*num_nodes);
 
-  // Set up the free list. Make each node point to the next. Last node will
-  // point to the old head.
-  void *old_head = fsa->free_head;
-  fsa->free_head = mem;
-  assert(new_cap > 0);
-  for (size_t i = 0; i < new_cap-1; i++) {
-    *(void**)mem = mem + node_alsize;
-    mem += node_alsize;
-  }
-  *(void**)mem = old_head; // Set up last node.
+  // The new nodes are handed out from bump to bump_end, so they don't have
+  // to be threaded into the free list (and touched) up front.
+  fsa->bump = mem;
+  fsa->bump_end = mem + node_alsize*num_nodes;
   fsa->total_cap = new_cap;
   return 0;
 }
 
 int
-AU_FSA_Setup(AU_FixedSizeAllocator *fsa, size_t elt_size, size_t cap) {
+AU_FSA_SetupInArena(AU_FixedSizeAllocator *fsa,
+                    size_t elt_size,
+                    size_t cap,
+                    AU_Arena *arena)
+{
   assert(cap > 0);
   assert(elt_size > 0);
   assert(cap <= SIZE_MAX/elt_size);
@@ -367,20 +605,37 @@ AU_FSA_Setup(AU_FixedSizeAllocator *fsa, size_t elt_size, size_t cap) {
   fsa->total_cap = 0;
   fsa->elt_size = elt_size;
   fsa->free_head = 0;
-
-  int res = AU_FSB_Setup(&fsa->fsb_base_ptrs,
-                         sizeof (void*),
-                         FSA_INITIAL_NUM_PTRS);
-  if (res < 0) {
-    return res;
+  fsa->bump = 0;
+  fsa->bump_end = 0;
+  fsa->arena = arena;
+  STAT_INC(AU_KIND_FSA, setups);
+
+  if (!arena) {
+    int res = AU_FSB_Setup(&fsa->fsb_base_ptrs,
+                           sizeof (void*),
+                           FSA_INITIAL_NUM_PTRS);
+    if (res < 0) {
+      return res;
+    }
   }
 
   return AU_FSA_Expand(fsa, cap);
 }
 
+int
+AU_FSA_Setup(AU_FixedSizeAllocator *fsa, size_t elt_size, size_t cap) {
+  return AU_FSA_SetupInArena(fsa, elt_size, cap, 0);
+}
+
 void *
 AU_FSA_Alloc(AU_FixedSizeAllocator *fsa) {
-  if (!fsa->free_head) {
+  char *node = fsa->free_head;
+  if (node) {
+    fsa->free_head = *(void**)node;
+    STAT_INC(AU_KIND_FSA, allocs);
+    return node + PTR_SIZE_ALIGN;
+  }
+  if (fsa->bump == fsa->bump_end) {
     if (fsa->total_cap == SIZE_MAX) {
       // Seriously?
       ISSUE_ERROR(AU_ERR_OVERFLOW);
@@ -389,12 +644,12 @@ AU_FSA_Alloc(AU_FixedSizeAllocator *fsa) {
     if (AU_FSA_Expand(fsa, AU_FSA_NewCap(fsa->total_cap)) < 0) {
       return 0;
     }
+    STAT_INC(AU_KIND_FSA, grows);
   }
-  char *free_head = fsa->free_head;
-  void *new_free_head = *(void**)free_head;
-  void *out = free_head + PTR_SIZE_ALIGN;
-  fsa->free_head = new_free_head;
-  return out;
+  STAT_INC(AU_KIND_FSA, allocs);
+  node = fsa->bump;
+  fsa->bump += AU_FSA_NodeSize(fsa);
+  return node + PTR_SIZE_ALIGN;
 }
 
 void
@@ -402,10 +657,15 @@ AU_FSA_Free(AU_FixedSizeAllocator *fsa, void *mem) {
   void *node = (char*)mem - PTR_SIZE_ALIGN;
   *(void**)node = fsa->free_head;
   fsa->free_head = node;
+  STAT_INC(AU_KIND_FSA, frees);
 }
 
 void
 AU_FSA_Destroy(AU_FixedSizeAllocator *fsa) {
+  if (fsa->arena) {
+    return;
+  }
+  STAT_LIVE_SUB(AU_KIND_FSA, AU_FSA_NodeSize(fsa)*fsa->total_cap);
   void **regions = AU_FSB_GetMemory(&fsa->fsb_base_ptrs);
   size_t used = AU_FSB_GetUsedCount(&fsa->fsb_base_ptrs);
   for (size_t i = 0; i < used; i++) {
@@ -20,7 +20,8 @@ enum {
   AU_ERR_XMALLOC = INT_MIN,
   AU_ERR_XREALLOC,
   AU_ERR_XCALLOC,
-  AU_ERR_OVERFLOW
+  AU_ERR_OVERFLOW,
+  AU_ERR_NO_STATS
 };
 
 enum {
@@ -34,6 +35,10 @@ enum {
 struct AU_ByteBuilder {
   void *mem;
   size_t used, cap;
+
+  // The AU_KIND_* the statistics count it under. Always there, so the layout
+  // doesn't depend on AU_STATS.
+  int kind;
 };
 
 typedef struct AU_ByteBuilder AU_ByteBuilder;
@@ -143,6 +148,55 @@ AU_VSB_DiscardAppends(AU_VarSizeBuilder *vsb);
 size_t
 AU_VSB_GetUsedCount(AU_VarSizeBuilder *vsa);
 
+///////////////
+//// Arena ////
+///////////////
+
+struct AU_Arena {
+  // The unused part of the newest block.
+  char *cur, *end;
+
+  // The newest block. Each block points to the one before it.
+  void *last_block;
+
+  // Size for the next block.
+  size_t next_size;
+
+  unsigned flags;
+};
+
+enum {
+  // Back blocks of at least a huge page with huge pages, when the system
+  // supports it. Ignored otherwise.
+  AU_ARENA_HUGE_PAGES = 1 << 0
+};
+
+/**
+ * As with all other other builder/allocator types, the representation of an
+ * AU_Arena shouldn't be relied upon (check the other comment in the
+ * beginning of this file).
+ *
+ * An arena hands out memory by bumping a pointer through blocks of growing
+ * size. Nothing is freed individually: everything goes at once on
+ * AU_AR_Destroy, at the cost of one free per block.
+ *
+ * A zero initialized AU_Arena can be destroyed, so a static one can be
+ * destroyed even if its setup never ran.
+ */
+typedef struct AU_Arena AU_Arena;
+
+int
+AU_AR_Setup(AU_Arena *ar, size_t block_size, unsigned flags);
+
+/**
+ * Returns size bytes aligned to a conservative boundary.
+ */
+void *
+AU_AR_Alloc(AU_Arena *ar, size_t size);
+
+void
+AU_AR_Destroy(AU_Arena *ar);
+
 //////////////////////////////
 //// Fixed Size Allocator ////
 //////////////////////////////
@@ -161,6 +215,13 @@ struct AU_FixedSizeAllocator {
   // Total capacity. Used to know how much to allocate on the next round as
   // soon as free_head becomes null.
   size_t total_cap;
+
+  // The never allocated part of the newest region. Nodes are only threaded
+  // into the free list once freed.
+  char *bump, *bump_end;
+
+  // Where regions come from, if not from xmalloc.
+  AU_Arena *arena;
 };
 
 /**
@@ -176,6 +237,16 @@ typedef struct AU_FixedSizeAllocator AU_FixedSizeAllocator;
 int
 AU_FSA_Setup(AU_FixedSizeAllocator *fsa, size_t elt_size, size_t cap);
 
+/**
+ * Same as AU_FSA_Setup, but the memory comes from the arena, and goes with
+ * it. AU_FSA_Destroy doesn't need to be called.
+ */
+int
+AU_FSA_SetupInArena(AU_FixedSizeAllocator *fsa,
+                    size_t elt_size,
+                    size_t cap,
+                    AU_Arena *arena);
+
 void*
 AU_FSA_Alloc(AU_FixedSizeAllocator *fsa);
 
@@ -185,4 +256,56 @@ AU_FSA_Free(AU_FixedSizeAllocator *fsa, void *mem);
 void
 AU_FSA_Destroy(AU_FixedSizeAllocator *fsa);
 
+////////////////////
+//// Statistics ////
+////////////////////
+
+/**
+ * The builder and allocator types, as far as statistics go. Builders behind
+ * allocators (like the one keeping an AU_FixedSizeAllocator's regions) count
+ * as builders of their own type.
+ */
+enum {
+  AU_KIND_B1,
+  AU_KIND_FSB,
+  AU_KIND_VSB,
+  AU_KIND_FSA,
+  AU_KIND_ARENA,
+  AU_NUM_KINDS
+};
+
+struct AU_Stats {
+  // Instances set up.
+  unsigned long setups;
+
+  // Reallocations of builders, and regions or blocks allocators add beyond
+  // the ones made at setup.
+  unsigned long grows;
+
+  // Elements (or arena allocations) handed out and given back. Builders
+  // don't count these.
+  unsigned long allocs, frees;
+
+  // The largest capacity (or region, or block) a single instance reached.
+  size_t max_cap;
+
+  // Bytes held by allocators, now and at most. Builders' memory is freed by
+  // their users, so it isn't tracked.
+  size_t bytes_live, bytes_peak;
+};
+
+/**
+ * Copies the statistics for every kind into stats, which must have room for
+ * AU_NUM_KINDS entries.
+ *
+ * Statistics are only gathered when AU.c is compiled with AU_STATS defined
+ * (the counters are atomic, which costs on the hot paths). Otherwise, this
+ * returns AU_ERR_NO_STATS.
+ */
+int
+AU_GetStats(struct AU_Stats *stats);
+
+const char *
+AU_KindName(int kind);
+
 #endif
@@ -0,0 +1,374 @@
+#ifdef __linux__
+// For MAP_ANONYMOUS and fallocate.
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "XFlow.h"
+#include "Atlas.h"
+
+/*
+ * Bytes of the image surfaces held in memory (see atlas_hold), and how many
+ * there can be before they go to the scratch file. Held surfaces point their
+ * userdata at held_bytes.
+ */
+static size_t held_bytes;
+static size_t held_budget = SIZE_MAX;
+
+#ifdef __linux__
+// Anonymous pixel bytes live, and how many there can be before atlases go
+// to the scratch file.
+static size_t anon_bytes;
+static size_t budget = SIZE_MAX;
+
+/*
+ * The scratch file ends at scratch_end, and holes lists the free extents
+ * before that, sorted by offset and never adjacent. Extents are whole pages.
+ * Surfaces in the file point their userdata at a struct Scratch.
+ */
+struct Extent {
+  off_t offset;
+  off_t size;
+};
+
+struct Scratch {
+  off_t offset;
+};
+
+static int scratch_fd = -1;
+static off_t scratch_end;
+static struct Extent *holes;
+static int num_holes, holes_cap;
+#endif
+
+static size_t
+atlas_size(const SDL_Surface *atlas) {
+  return (size_t) atlas->h*atlas->pitch;
+}
+
+#ifdef __linux__
+static off_t
+page_up(size_t size) {
+  long page = sysconf(_SC_PAGESIZE);
+  return ((off_t) size + page - 1)/page*page;
+}
+
+/**
+ * Gives the extent back to the file: its pages are freed on disk right
+ * away, and it's either cut off the end or kept for reuse.
+ */
+static void
+free_extent(off_t offset, off_t size) {
+  // Fails with EOPNOTSUPP on tmpfs and older file systems. That's harmless:
+  // the pages just stay allocated until the extent is reused or truncated.
+  fallocate(scratch_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+            size);
+  int h = 0;
+  while (h < num_holes && holes[h].offset < offset) {
+    h++;
+  }
+  struct Extent ext = {offset, size};
+  if (h > 0 && holes[h-1].offset + holes[h-1].size == offset) {
+    ext.offset = holes[--h].offset;
+    ext.size += holes[h].size;
+    memmove(holes + h, holes + h + 1, (num_holes - h - 1)*sizeof *holes);
+    num_holes--;
+  }
+  if (h < num_holes && ext.offset + ext.size == holes[h].offset) {
+    ext.size += holes[h].size;
+    memmove(holes + h, holes + h + 1, (num_holes - h - 1)*sizeof *holes);
+    num_holes--;
+  }
+  // If the file can't shrink, the extent is kept as a hole instead.
+  if (ext.offset + ext.size == scratch_end &&
+      ftruncate(scratch_fd, ext.offset) == 0) {
+    scratch_end = ext.offset;
+    return;
+  }
+  if (num_holes == holes_cap) {
+    int cap = holes_cap ? holes_cap*2 : 16;
+    struct Extent *more = realloc(holes, cap*sizeof *holes);
+    if (!more) {
+      // Only its reuse is lost.
+      return;
+    }
+    holes = more;
+    holes_cap = cap;
+  }
+  memmove(holes + h + 1, holes + h, (num_holes - h)*sizeof *holes);
+  holes[h] = ext;
+  num_holes++;
+}
+
+/**
+ * Maps size bytes of the scratch file, from the first hole large enough or
+ * else from its end. Returns the pixels, and the surface's struct Scratch in
+ * scratch.
+ */
+static void *
+map_scratch(size_t size, struct Scratch **scratch) {
+  off_t ext_size = page_up(size);
+  off_t offset = scratch_end;
+  int h = 0;
+  while (h < num_holes && holes[h].size < ext_size) {
+    h++;
+  }
+  *scratch = malloc(sizeof **scratch);
+  return_if(!*scratch, 0);
+  if (h < num_holes) {
+    offset = holes[h].offset;
+    holes[h].offset += ext_size;
+    holes[h].size -= ext_size;
+    if (holes[h].size == 0) {
+      memmove(holes + h, holes + h + 1, (num_holes - h - 1)*sizeof *holes);
+      num_holes--;
+    }
+  }
+  else if (ftruncate(scratch_fd, offset + ext_size) < 0) {
+    free(*scratch);
+    return 0;
+  }
+  else {
+    scratch_end = offset + ext_size;
+  }
+  void *pixels = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      scratch_fd, offset);
+  if (pixels == MAP_FAILED) {
+    int err = errno;
+    free_extent(offset, ext_size);
+    free(*scratch);
+    errno = err;
+    return 0;
+  }
+  (**scratch).offset = offset;
+  return pixels;
+}
+
+/**
+ * Unmaps the pixels of a surface in the scratch file, giving them back to
+ * the file.
+ */
+static void
+unmap_scratch(SDL_Surface *surf) {
+  struct Scratch *scratch = surf->userdata;
+  munmap(surf->pixels, atlas_size(surf));
+  free_extent(scratch->offset, page_up(atlas_size(surf)));
+  free(scratch);
+}
+#endif
+
+SDL_Surface *
+atlas_create(int w, int h) {
+  assert(w > 0);
+  assert(h > 0);
+
+  if (w > ATLAS_MAX_DIM || (size_t) h > SIZE_MAX/4/w) {
+    SDL_SetError("Atlas too large: %dx%d", w, h);
+    return 0;
+  }
+  int pitch = w*4;
+  size_t size = (size_t) h*pitch;
+  // Set for atlases in the scratch file.
+  void *in_file = 0;
+#ifdef __linux__
+  void *pixels;
+  if (scratch_fd >= 0 && (anon_bytes > budget || size > budget - anon_bytes)) {
+    struct Scratch *scratch;
+    pixels = map_scratch(size, &scratch);
+    in_file = scratch;
+  }
+  else {
+    pixels = mmap(0, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pixels == MAP_FAILED) {
+      pixels = 0;
+    }
+  }
+#else
+  void *pixels = calloc(size, 1);
+#endif
+  if (!pixels) {
+    SDL_SetError("Out of memory for a %dx%d atlas", w, h);
+    return 0;
+  }
+
+  SDL_Surface *atlas = SDL_CreateRGBSurfaceWithFormatFrom(
+    pixels, w, h, 32, pitch, SDL_PIXELFORMAT_RGBA32);
+  if (!atlas) {
+#ifdef __linux__
+    munmap(pixels, size);
+    if (in_file) {
+      free_extent(((struct Scratch*) in_file)->offset, page_up(size));
+      free(in_file);
+    }
+#else
+    free(pixels);
+#endif
+    return 0;
+  }
+  atlas->userdata = in_file;
+#ifdef __linux__
+  if (!in_file) {
+    anon_bytes += size;
+  }
+#endif
+  return atlas;
+}
+
+void
+atlas_free(SDL_Surface *atlas) {
+  if (!atlas) {
+    return;
+  }
+  // The surface doesn't own its pixels, so freeing it leaves them alone.
+#ifdef __linux__
+  if (atlas->userdata) {
+    unmap_scratch(atlas);
+  }
+  else {
+    munmap(atlas->pixels, atlas_size(atlas));
+    anon_bytes -= atlas_size(atlas);
+  }
+#else
+  free(atlas->pixels);
+#endif
+  SDL_FreeSurface(atlas);
+}
+
+int
+atlas_blit(SDL_Surface *src, SDL_Surface *atlas, const SDL_Rect *rect) {
+  assert(src);
+  assert(atlas);
+  assert(rect);
+  assert(rect->x >= 0 && rect->y >= 0);
+  assert(rect->x <= atlas->w - src->w && rect->y <= atlas->h - src->h);
+
+  SDL_Surface *conv = 0;
+  if (src->format->format != atlas->format->format) {
+    conv = SDL_ConvertSurfaceFormat(src, atlas->format->format, 0);
+    return_if(!conv, -1);
+    src = conv;
+  }
+  char *dst = (char*) atlas->pixels + (size_t) rect->y*atlas->pitch +
+              (size_t) rect->x*4;
+  for (int y = 0; y < src->h; y++) {
+    memcpy(dst + (size_t) y*atlas->pitch,
+           (const char*) src->pixels + (size_t) y*src->pitch,
+           (size_t) src->w*4);
+  }
+  SDL_FreeSurface(conv);
+  return 0;
+}
+
+int
+atlas_set_budget(size_t atlases, size_t images) {
+#ifdef __linux__
+  if (scratch_fd < 0) {
+    const char *dir = getenv("TMPDIR");
+    dir = dir && *dir ? dir : "/tmp";
+    char *path = malloc(strlen(dir) + sizeof "/imgpacker.XXXXXX");
+    return_if(!path, ATLAS_FAIL_LIBC);
+    sprintf(path, "%s/imgpacker.XXXXXX", dir);
+    scratch_fd = mkstemp(path);
+    if (scratch_fd >= 0) {
+      unlink(path);
+    }
+    free(path);
+    return_if(scratch_fd < 0, ATLAS_FAIL_LIBC);
+  }
+  budget = atlases;
+  held_budget = images;
+  return ATLAS_OK;
+#else
+  (void) atlases;
+  (void) images;
+  return ATLAS_FAIL_UNSUPPORTED;
+#endif
+}
+
+/**
+ * Moves surf's pixels to the scratch file, as 32 bits RGBA. Returns the new
+ * surface, after freeing surf, or null (and surf untouched) on failure.
+ */
+static SDL_Surface *
+spill(SDL_Surface *surf) {
+#ifdef __linux__
+  assert(scratch_fd >= 0);
+
+  size_t size = (size_t) surf->h*surf->w*4;
+  struct Scratch *scratch;
+  void *pixels = map_scratch(size, &scratch);
+  if (!pixels) {
+    SDL_SetError("Scratch file: %s", strerror(errno));
+    return 0;
+  }
+  SDL_Surface *spilled = SDL_CreateRGBSurfaceWithFormatFrom(
+    pixels, surf->w, surf->h, 32, surf->w*4, SDL_PIXELFORMAT_RGBA32);
+  SDL_Rect rect = {0, 0, surf->w, surf->h};
+  if (!spilled || atlas_blit(surf, spilled, &rect) < 0) {
+    SDL_FreeSurface(spilled);
+    munmap(pixels, size);
+    free_extent(scratch->offset, page_up(size));
+    free(scratch);
+    return 0;
+  }
+  spilled->userdata = scratch;
+  SDL_FreeSurface(surf);
+  return spilled;
+#else
+  (void) surf;
+  SDL_SetError("No scratch file");
+  return 0;
+#endif
+}
+
+SDL_Surface *
+atlas_hold(SDL_Surface *surf, int *spilled) {
+  assert(surf);
+  assert(!surf->userdata);
+
+  size_t size = atlas_size(surf);
+  *spilled = held_bytes > held_budget || size > held_budget - held_bytes;
+  if (*spilled) {
+    return spill(surf);
+  }
+  held_bytes += size;
+  surf->userdata = &held_bytes;
+  return surf;
+}
+
+void
+atlas_release(SDL_Surface *surf) {
+  if (!surf) {
+    return;
+  }
+  if (surf->userdata == &held_bytes) {
+    held_bytes -= atlas_size(surf);
+  }
+#ifdef __linux__
+  else if (surf->userdata) {
+    unmap_scratch(surf);
+  }
+#endif
+  SDL_FreeSurface(surf);
+}
+
+const char *
+atlas_strerror(int code) {
+  switch (code) {
+    case ATLAS_FAIL_LIBC:
+      return strerror(errno);
+    case ATLAS_FAIL_UNSUPPORTED:
+      return "Only supported on Linux";
+  }
+  return 0;
+}
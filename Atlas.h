@@ -0,0 +1,83 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <limits.h>
+#include <stddef.h>
+
+#include <SDL2/SDL.h>
+
+enum {
+  ATLAS_OK = 0,
+  ATLAS_FAIL_LIBC = -1,
+  ATLAS_FAIL_UNSUPPORTED = -2
+};
+
+enum {
+  // The pitch of an atlas, in bytes, must fit an int.
+  ATLAS_MAX_DIM = INT_MAX/4
+};
+
+/**
+ * Atlas surfaces: 32 bits RGBA (bytes in R, G, B, A order), zeroed, with
+ * their pixels allocated apart from SDL so they can go past SDL's size limits
+ * and only take memory where they're drawn.
+ *
+ * On Linux, the pixels are an anonymous mapping: a page of the atlas only
+ * gets memory when it's first written, so the empty parts of a sparse atlas
+ * cost nothing, and reading them (to write the outputs) doesn't change that.
+ *
+ * Rows are addressed with size_t offsets everywhere, so an atlas can hold
+ * more than 2 GiB of pixels.
+ */
+SDL_Surface *
+atlas_create(int w, int h);
+
+/**
+ * Frees an atlas made by atlas_create, which can be null.
+ */
+void
+atlas_free(SDL_Surface *atlas);
+
+/**
+ * Copies src, as it is (no blending), into the atlas at rect's position.
+ * Surfaces in other formats than the atlas's are converted first. rect must
+ * be inside the atlas, and as large as src.
+ */
+int
+atlas_blit(SDL_Surface *src, SDL_Surface *atlas, const SDL_Rect *rect);
+
+/**
+ * Caps the anonymous memory taken by atlas pixels at atlases bytes, and the
+ * one taken by image surfaces held with atlas_hold at images bytes (Linux
+ * only). Past those, the pixels go to a scratch file instead, made and
+ * unlinked right away in $TMPDIR (or /tmp). The kernel can then write those
+ * pages out and drop them under memory pressure, rather than the process
+ * running out of memory. The file's pages are given back as surfaces are
+ * freed, and reused.
+ */
+int
+atlas_set_budget(size_t atlases, size_t images);
+
+/**
+ * Counts surf, an image surface made by SDL, against the budget of images
+ * (see atlas_set_budget). If it doesn't fit, its pixels are moved to the
+ * scratch file as 32 bits RGBA, surf is freed, and spilled is set. Returns
+ * the surface to use, or null (and surf untouched) on failure.
+ *
+ * Either way, the surface must be freed with atlas_release.
+ */
+SDL_Surface *
+atlas_hold(SDL_Surface *surf, int *spilled);
+
+/**
+ * Frees a surface returned by atlas_hold, giving its bytes back to the
+ * budget or its pages back to the scratch file, or any other surface made by
+ * SDL. Atlases go to atlas_free instead. surf can be null.
+ */
+void
+atlas_release(SDL_Surface *surf);
+
+const char *
+atlas_strerror(int code);
+
+#endif
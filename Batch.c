@@ -0,0 +1,175 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "XFlow.h"
+#include "Batch.h"
+#include "AU.h"
+
+enum {
+  EXPECTED_ARGS = 256,
+  EXPECTED_BLOCKS = 16
+};
+
+struct Block {
+  size_t first;
+  int argc;
+  int line;
+};
+
+static char *
+read_text(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  return_if(!fp, 0);
+  char *text = 0;
+  long size;
+  goto_if(fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0, end);
+  rewind(fp);
+  text = malloc(size + 1);
+  goto_if(!text, end);
+  if (fread(text, 1, size, fp) != (size_t) size) {
+    free(text);
+    text = 0;
+    goto end;
+  }
+  text[size] = 0;
+end:
+  fclose(fp);
+  return text;
+}
+
+static int
+append_arg(AU_FixedSizeBuilder *args, char *arg) {
+  return_if(AU_FSB_Append(args, &arg, 1) < 0, BATCH_FAIL_NO_MEM);
+  return BATCH_OK;
+}
+
+/**
+ * Splits the lines of a block in place, appending its arguments (and a
+ * terminating null) to args. Returns the line after the block.
+ */
+static char *
+split_block(char *line, char *filename, AU_FixedSizeBuilder *args,
+            struct Block *block, int *line_no, int *res)
+{
+  *res = append_arg(args, filename);
+  int first = 1;
+  while (*line && *res == BATCH_OK) {
+    // The empty line ending the block is left to batch_read.
+    break_if(*line == '\n' || (*line == '\r' && line[1] == '\n'));
+    char *nl = strchr(line, '\n');
+    char *next = nl ? nl + 1 : line + strlen(line);
+    if (nl) {
+      *nl = 0;
+    }
+    if (nl > line && nl[-1] == '\r') {
+      nl[-1] = 0;
+    }
+    ++*line_no;
+
+    if (*line == '#') {
+      line = next;
+      continue;
+    }
+    if (first && *line == '-') {
+      for (char *tok = strtok(line, " \t"); tok && *res == BATCH_OK;
+           tok = strtok(0, " \t"))
+      {
+        *res = append_arg(args, tok);
+      }
+    }
+    else {
+      *res = append_arg(args, line);
+    }
+    first = 0;
+    line = next;
+  }
+  block->argc = AU_FSB_GetUsedCount(args) - block->first;
+  if (*res == BATCH_OK) {
+    *res = append_arg(args, 0);
+  }
+  return line;
+}
+
+int
+batch_read(struct Batch *batch, const char *filename) {
+  assert(batch);
+  assert(filename);
+
+  memset(batch, 0, sizeof *batch);
+  batch->text = read_text(filename);
+  return_if(!batch->text, errno == ENOMEM ? BATCH_FAIL_NO_MEM
+                                          : BATCH_FAIL_LIBC);
+
+  AU_FixedSizeBuilder args, blocks;
+  return_if(AU_FSB_Setup(&args, sizeof (char*), EXPECTED_ARGS) < 0,
+            BATCH_FAIL_NO_MEM);
+  if (AU_FSB_Setup(&blocks, sizeof (struct Block), EXPECTED_BLOCKS) < 0) {
+    free(AU_FSB_GetMemory(&args));
+    return BATCH_FAIL_NO_MEM;
+  }
+
+  int res = BATCH_OK;
+  int line_no = 1;
+  for (char *line = batch->text; *line && res == BATCH_OK;) {
+    // Empty lines between blocks.
+    if (*line == '\n' || (*line == '\r' && line[1] == '\n')) {
+      line += *line == '\r' ? 2 : 1;
+      line_no++;
+      continue;
+    }
+    struct Block block = {AU_FSB_GetUsedCount(&args), 0, line_no};
+    line = split_block(line, (char*) filename, &args, &block, &line_no,
+                       &res);
+    // A block of comments only.
+    continue_if(block.argc <= 1);
+    if (res == BATCH_OK && AU_FSB_Append(&blocks, &block, 1) < 0) {
+      res = BATCH_FAIL_NO_MEM;
+    }
+  }
+
+  batch->args = AU_FSB_GetMemory(&args);
+  const struct Block *found = AU_FSB_GetMemory(&blocks);
+  batch->num_blocks = AU_FSB_GetUsedCount(&blocks);
+  if (res == BATCH_OK && batch->num_blocks == 0) {
+    res = BATCH_FAIL_EMPTY;
+  }
+  if (res == BATCH_OK) {
+    batch->blocks = malloc(batch->num_blocks * sizeof *batch->blocks);
+    res = batch->blocks ? BATCH_OK : BATCH_FAIL_NO_MEM;
+  }
+  for (int i = 0; res == BATCH_OK && i < batch->num_blocks; i++) {
+    batch->blocks[i] = (struct BatchBlock) {
+      batch->args + found[i].first, found[i].argc, found[i].line
+    };
+  }
+  free(AU_FSB_GetMemory(&blocks));
+  if (res < 0) {
+    batch_free(batch);
+  }
+  return res;
+}
+
+void
+batch_free(struct Batch *batch) {
+  assert(batch);
+  free(batch->blocks);
+  free(batch->args);
+  free(batch->text);
+  memset(batch, 0, sizeof *batch);
+}
+
+const char *
+batch_strerror(int code) {
+  switch (code) {
+    case BATCH_FAIL_LIBC:
+      return strerror(errno);
+    case BATCH_FAIL_NO_MEM:
+      return "Out of memory";
+    case BATCH_FAIL_EMPTY:
+      return "No atlas in the manifest";
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+enum {
+  BATCH_OK = 0,
+  BATCH_FAIL_LIBC = -1,
+  BATCH_FAIL_NO_MEM = -2,
+  BATCH_FAIL_EMPTY = -3
+};
+
+/**
+ * One atlas of a batch manifest, as a command line: argv[0] is the manifest
+ * name (standing for the program name), followed by the options and then the
+ * input files. argv[argc] is null.
+ */
+struct BatchBlock {
+  char **argv;
+  int argc;
+
+  // Where the block starts in the manifest, for error messages.
+  int line;
+};
+
+/**
+ * A batch manifest describes several atlases, in blocks separated by empty
+ * lines. A block's first line has the options for its atlas, separated by
+ * spaces or tabs (there's no quoting), if it starts with '-'. Every other
+ * line is an input file. Lines starting with '#' are comments.
+ *
+ *   -w 512 -o ui.png -c ui.csv
+ *   ui/button.png
+ *   ui/panel.png
+ *
+ *   -o fx.ktx2 -t bc3 -d fx
+ */
+struct Batch {
+  struct BatchBlock *blocks;
+  int num_blocks;
+
+  char *text;
+  char **args;
+};
+
+int
+batch_read(struct Batch *batch, const char *filename);
+
+void
+batch_free(struct Batch *batch);
+
+const char *
+batch_strerror(int code);
+
+#endif
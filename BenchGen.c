@@ -0,0 +1,379 @@
+/*
+ * benchgen DIR [COUNT [SEED]]
+ *
+ * Writes the synthetic corpus bench_e2e.sh runs imgpacker over: COUNT images
+ * (2000 by default) in DIR, and their list in DIR/list.txt. The same COUNT
+ * and SEED always give the same images, whatever the platform, so runs can
+ * be compared across builds.
+ *
+ * Sizes, alpha and content are drawn from fixed distributions, so the
+ * corpus exercises every path of a real one:
+ *
+ * - 60% of the images are small (8 to 64 pixels a side), 35% medium (64 to
+ *   256) and 5% large (256 to 512);
+ * - a third are opaque, a third have a cut out shape (alpha 0 or 255) and a
+ *   third a soft alpha falloff;
+ * - a third are flat rectangles (compressing very well), a third gradients
+ *   and a third noise (compressing poorly);
+ * - 70% are PNG files, 20% JPEG (always opaque) and 10% uncompressed TIFF
+ *   (loaded by SDL2_image).
+ */
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <jpeglib.h>
+#include <SDL2/SDL.h>
+
+#include "XFlow.h"
+#include "xPNG.h"
+
+enum {
+  DEFAULT_COUNT = 2000,
+  DEFAULT_SEED = 1,
+  JPEG_QUALITY = 90
+};
+
+enum {
+  FORMAT_PNG,
+  FORMAT_JPEG,
+  FORMAT_TIFF
+};
+
+enum {
+  ALPHA_OPAQUE,
+  ALPHA_CUTOUT,
+  ALPHA_SOFT
+};
+
+enum {
+  CONTENT_FLAT,
+  CONTENT_GRADIENT,
+  CONTENT_NOISE
+};
+
+static const char *format_exts[] = {"png", "jpg", "tif"};
+
+/**
+ * splitmix64: tiny, and the same sequence everywhere, unlike rand().
+ */
+static uint64_t
+rng_next(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Uniform in [lo, hi].
+ */
+static int
+rng_range(uint64_t *state, int lo, int hi) {
+  assert(lo <= hi);
+  return lo + (int) (rng_next(state) % (uint64_t) (hi - lo + 1));
+}
+
+static int
+clamp_byte(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static void
+set_rgb(unsigned char *p, uint64_t color) {
+  p[0] = color;
+  p[1] = color >> 8;
+  p[2] = color >> 16;
+}
+
+static void
+fill_flat(unsigned char *px, int w, int h, uint64_t *rng) {
+  uint64_t bg = rng_next(rng);
+  for (int i = 0; i < w*h; i++) {
+    set_rgb(px + (size_t) i*4, bg);
+  }
+  int rects = rng_range(rng, 2, 6);
+  for (int r = 0; r < rects; r++) {
+    int x0 = rng_range(rng, 0, w - 1);
+    int y0 = rng_range(rng, 0, h - 1);
+    int x1 = rng_range(rng, x0, w - 1);
+    int y1 = rng_range(rng, y0, h - 1);
+    uint64_t color = rng_next(rng);
+    for (int y = y0; y <= y1; y++) {
+      for (int x = x0; x <= x1; x++) {
+        set_rgb(px + ((size_t) y*w + x)*4, color);
+      }
+    }
+  }
+}
+
+static void
+fill_gradient(unsigned char *px, int w, int h, uint64_t *rng) {
+  int from[3], to[3];
+  for (int c = 0; c < 3; c++) {
+    from[c] = rng_range(rng, 0, 255);
+    to[c] = rng_range(rng, 0, 255);
+  }
+  int span = w + h - 2 > 0 ? w + h - 2 : 1;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      unsigned char *p = px + ((size_t) y*w + x)*4;
+      for (int c = 0; c < 3; c++) {
+        p[c] = from[c] + (to[c] - from[c])*(x + y)/span;
+      }
+    }
+  }
+}
+
+static void
+fill_noise(unsigned char *px, int w, int h, uint64_t *rng) {
+  int base[3];
+  for (int c = 0; c < 3; c++) {
+    base[c] = rng_range(rng, 0, 255);
+  }
+  int amp = rng_range(rng, 8, 128);
+  for (int i = 0; i < w*h; i++) {
+    uint64_t bits = rng_next(rng);
+    for (int c = 0; c < 3; c++) {
+      int noise = (int) ((bits >> (16*c)) % (uint64_t) (2*amp + 1)) - amp;
+      px[(size_t) i*4 + c] = clamp_byte(base[c] + noise);
+    }
+  }
+}
+
+static void
+fill_alpha(unsigned char *px, int w, int h, int kind) {
+  // Squared distances from the center, in units where the ellipse inscribed
+  // in the image is at 1 << 16.
+  long long rx = w/2 > 0 ? w/2 : 1;
+  long long ry = h/2 > 0 ? h/2 : 1;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      long long dx = x - w/2, dy = y - h/2;
+      long long d = (dx*dx*ry*ry + dy*dy*rx*rx)*65536/(rx*rx*ry*ry);
+      int a = 255;
+      if (kind == ALPHA_CUTOUT) {
+        a = d <= 65536 ? 255 : 0;
+      }
+      else if (kind == ALPHA_SOFT) {
+        a = clamp_byte((int) (255 - d*255/65536));
+      }
+      px[((size_t) y*w + x)*4 + 3] = a;
+    }
+  }
+}
+
+static int
+save_png(const char *path, unsigned char *px, int w, int h) {
+  SDL_Surface *surf = SDL_CreateRGBSurfaceWithFormatFrom(
+    px, w, h, 32, w*4, SDL_PIXELFORMAT_RGBA32);
+  return_if(!surf, -1);
+  int res = xpng_save_surface(path, surf);
+  SDL_FreeSurface(surf);
+  return res < 0 ? -1 : 0;
+}
+
+static int
+save_jpeg(const char *path, const unsigned char *px, int w, int h) {
+  FILE *fp = fopen(path, "wb");
+  return_if(!fp, -1);
+  unsigned char *row = malloc((size_t) w*3);
+  if (!row) {
+    fclose(fp);
+    return -1;
+  }
+
+  // The default error handler exits, which is fine for a generator.
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, fp);
+  cinfo.image_width = w;
+  cinfo.image_height = h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, JPEG_QUALITY, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    const unsigned char *src = px + (size_t) cinfo.next_scanline*w*4;
+    for (int x = 0; x < w; x++) {
+      memcpy(row + x*3, src + x*4, 3);
+    }
+    JSAMPROW rows[1] = {row};
+    jpeg_write_scanlines(&cinfo, rows, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  free(row);
+  return fclose(fp) != 0 ? -1 : 0;
+}
+
+static void
+put_u16(unsigned char *p, unsigned v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void
+put_u32(unsigned char *p, uint32_t v) {
+  put_u16(p, v & 0xffff);
+  put_u16(p + 2, v >> 16);
+}
+
+/**
+ * A little endian, uncompressed RGBA TIFF file, in a single strip.
+ */
+static int
+save_tiff(const char *path, const unsigned char *px, int w, int h) {
+  enum {
+    NUM_TAGS = 11,
+    IFD_OFFSET = 8,
+    BITS_OFFSET = IFD_OFFSET + 2 + NUM_TAGS*12 + 4,
+    DATA_OFFSET = BITS_OFFSET + 8
+  };
+  // Tag, type (3 for 16 bits, 4 for 32 bits), count, value.
+  const uint32_t tags[NUM_TAGS][4] = {
+    {256, 4, 1, w},                          // ImageWidth
+    {257, 4, 1, h},                          // ImageLength
+    {258, 3, 4, BITS_OFFSET},                // BitsPerSample
+    {259, 3, 1, 1},                          // Compression: none
+    {262, 3, 1, 2},                          // PhotometricInterpretation: RGB
+    {273, 4, 1, DATA_OFFSET},                // StripOffsets
+    {277, 3, 1, 4},                          // SamplesPerPixel
+    {278, 4, 1, h},                          // RowsPerStrip
+    {279, 4, 1, (uint32_t) w*h*4},           // StripByteCounts
+    {284, 3, 1, 1},                          // PlanarConfiguration: chunky
+    {338, 3, 1, 2}                           // ExtraSamples: unassociated alpha
+  };
+  unsigned char head[DATA_OFFSET] = {'I', 'I', 42, 0};
+  put_u32(head + 4, IFD_OFFSET);
+  put_u16(head + IFD_OFFSET, NUM_TAGS);
+  for (int i = 0; i < NUM_TAGS; i++) {
+    unsigned char *e = head + IFD_OFFSET + 2 + i*12;
+    put_u16(e, tags[i][0]);
+    put_u16(e + 2, tags[i][1]);
+    put_u32(e + 4, tags[i][2]);
+    if (tags[i][1] == 3 && tags[i][2] == 1) {
+      put_u16(e + 8, tags[i][3]);
+    }
+    else {
+      put_u32(e + 8, tags[i][3]);
+    }
+  }
+  for (int c = 0; c < 4; c++) {
+    put_u16(head + BITS_OFFSET + c*2, 8);
+  }
+
+  FILE *fp = fopen(path, "wb");
+  return_if(!fp, -1);
+  int ok = fwrite(head, sizeof head, 1, fp) == 1 &&
+           fwrite(px, (size_t) w*h*4, 1, fp) == 1;
+  return fclose(fp) != 0 || !ok ? -1 : 0;
+}
+
+/**
+ * Picks an index from cumulative percentages.
+ */
+static int
+pick(uint64_t *rng, const int *cumulative) {
+  int p = rng_range(rng, 0, 99);
+  int i = 0;
+  while (p >= cumulative[i]) {
+    i++;
+  }
+  return i;
+}
+
+static int
+gen_image(const char *dir, int i, uint64_t *rng, FILE *list) {
+  static const int size_classes[] = {60, 95, 100};
+  static const int size_ranges[][2] = {{8, 64}, {64, 256}, {256, 512}};
+  static const int thirds[] = {33, 66, 100};
+  static const int formats[] = {70, 90, 100};
+
+  int sc = pick(rng, size_classes);
+  int w = rng_range(rng, size_ranges[sc][0], size_ranges[sc][1]);
+  int h = rng_range(rng, size_ranges[sc][0], size_ranges[sc][1]);
+  int content = pick(rng, thirds);
+  int alpha = pick(rng, thirds);
+  int format = pick(rng, formats);
+  if (format == FORMAT_JPEG) {
+    alpha = ALPHA_OPAQUE;
+  }
+
+  unsigned char *px = malloc((size_t) w*h*4);
+  return_if(!px, -1);
+  switch (content) {
+    case CONTENT_FLAT:
+      fill_flat(px, w, h, rng);
+      break;
+    case CONTENT_GRADIENT:
+      fill_gradient(px, w, h, rng);
+      break;
+    default:
+      fill_noise(px, w, h, rng);
+      break;
+  }
+  fill_alpha(px, w, h, alpha);
+
+  char path[4096];
+  snprintf(path, sizeof path, "%s/img%06d.%s", dir, i, format_exts[format]);
+  int res;
+  switch (format) {
+    case FORMAT_PNG:
+      res = save_png(path, px, w, h);
+      break;
+    case FORMAT_JPEG:
+      res = save_jpeg(path, px, w, h);
+      break;
+    default:
+      res = save_tiff(path, px, w, h);
+      break;
+  }
+  free(px);
+  if (res < 0) {
+    fprintf(stderr, "Error: Writing %s: %s.\n", path, strerror(errno));
+    return -1;
+  }
+  fprintf(list, "%s\n", path);
+  return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 4) {
+    fputs("Usage: benchgen DIR [COUNT [SEED]]\n", stderr);
+    return EXIT_FAILURE;
+  }
+  const char *dir = argv[1];
+  int count = argc > 2 ? atoi(argv[2]) : DEFAULT_COUNT;
+  uint64_t rng = argc > 3 ? strtoull(argv[3], 0, 10) : DEFAULT_SEED;
+  if (count <= 0) {
+    fputs("Error: Invalid count.\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof path, "%s/list.txt", dir);
+  FILE *list = fopen(path, "w");
+  if (!list) {
+    fprintf(stderr, "Error: %s: %s.\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < count; i++) {
+    if (gen_image(dir, i, &rng, list) < 0) {
+      fclose(list);
+      return EXIT_FAILURE;
+    }
+  }
+  if (fclose(list) != 0) {
+    fprintf(stderr, "Error: %s: %s.\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
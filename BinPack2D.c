@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include <SDL2/SDL.h>
 
@@ -10,6 +11,9 @@
 #include "RegionInfo.h"
 #include "BinPack2D.h"
 #include "AU.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Workers.h"
 
 /**
  * Leaf nodes have right == 0 and down == 0. Inner nodes have both not-null.
@@ -31,16 +35,45 @@ enum {
 #define assert_leaf_node(n) assert(is_leaf_node(n))
 #define assert_inner_node(n) assert(is_inner_node(n))
 
+enum {
+  NODES_ARENA_BLOCK_SIZE = 64 << 10
+};
+
 struct Context {
+  AU_Arena nodes;
   AU_FixedSizeAllocator fsa;
   struct BinPack2DOptions opts;
 };
 
+struct ShardJob {
+  struct NamedSurface *imgs;
+  int num_imgs;
+  int num_shards;
+  struct RegionInfo *regions;
+  struct BinPack2DOptions opts;
+
+  // For each shard, its result and the size of its root.
+  int *attempts;
+  SDL_Rect *roots;
+};
+
 static inline int
 imax(int a, int b) {
   return a > b ? a : b;
 }
 
+/**
+ * Image dimensions, rounded up to the alignment the regions must be placed
+ * at. Only the placement uses them; regions keep the images' real sizes.
+ */
+static inline int
+aligned_dim(int dim, const struct Context *cx) {
+  int align = cx->opts.align;
+  assert(align > 0);
+  assert(dim <= INT_MAX - (align - 1));
+  return (dim + align - 1)/align*align;
+}
+
 static inline int
 is_leaf_node(struct TNode *n) {
   return n && !n->right && !n->down;
@@ -58,8 +91,8 @@ maxside_named_surface_cmp(const void *a, const void *b) {
 
   const struct NamedSurface *ia = a;
   const struct NamedSurface *ib = b;
-  int max_side_a = imax(ia->surf->w, ia->surf->h);
-  int max_side_b = imax(ib->surf->w, ib->surf->h);
+  int max_side_a = imax(ia->w, ia->h);
+  int max_side_b = imax(ib->w, ib->h);
   return max_side_a < max_side_b ? 1 : (max_side_a == max_side_b ? 0 : -1);
 }
 
@@ -115,14 +148,16 @@ try_insert(struct TNode **head,
 {
   if (is_leaf_node(*head)) {
     SDL_Rect *leaf_rect = &(**head).rect;
-    int img_w = img->surf->w;
-    int img_h = img->surf->h;
+    int img_w = aligned_dim(img->w, cx);
+    int img_h = aligned_dim(img->h, cx);
 
     if (leaf_rect->w >= img_w && leaf_rect->h >= img_h) {
       return_if(split_leaf(*head, img_w, img_h, &cx->fsa) < 0,
                 ATTEMPT_NO_MEM);
       region->img = img;
-      region->rect = (SDL_Rect) {leaf_rect->x, leaf_rect->y, img_w, img_h};
+      region->rect = (SDL_Rect) {leaf_rect->x, leaf_rect->y,
+                                 img->w, img->h};
+      region->flip = REGION_FLIP_NONE;
       return ATTEMPT_OK;
     }
     else {
@@ -148,7 +183,7 @@ static int
 grow_right_insert(struct TNode **head,
                   struct RegionInfo *region,
                   struct NamedSurface *img,
-                  AU_FixedSizeAllocator *fsa)
+                  struct Context *cx)
 {
   assert_inner_node(*head);
 
@@ -157,9 +192,10 @@ grow_right_insert(struct TNode **head,
   int head_y = head_rect->y;
   int head_w = head_rect->w;
   int head_h = head_rect->h;
-  int img_w = img->surf->w;
-  int img_h = img->surf->h;
+  int img_w = aligned_dim(img->w, cx);
+  int img_h = aligned_dim(img->h, cx);
   int new_w = img_w + head_w;
+  AU_FixedSizeAllocator *fsa = &cx->fsa;
 
   struct TNode *new_head = AU_FSA_Alloc(fsa);
   return_if(!new_head, ATTEMPT_NO_MEM);
@@ -173,7 +209,9 @@ grow_right_insert(struct TNode **head,
     return ATTEMPT_NO_MEM;
   }
   region->img = img;
-  region->rect = (SDL_Rect) {head_x + head_w, head_y, img_w, img_h};
+  region->rect = (SDL_Rect) {head_x + head_w, head_y,
+                             img->w, img->h};
+  region->flip = REGION_FLIP_NONE;
   new_head->right = right;
   new_head->down = *head;
   new_head->rect = (SDL_Rect) {head_x, head_y, new_w, head_h};
@@ -185,7 +223,7 @@ static int
 grow_down_insert(struct TNode **head,
                  struct RegionInfo *region,
                  struct NamedSurface *img,
-                 AU_FixedSizeAllocator *fsa)
+                 struct Context *cx)
 {
   assert_inner_node(*head);
 
@@ -194,9 +232,10 @@ grow_down_insert(struct TNode **head,
   int head_y = head_rect->y;
   int head_w = head_rect->w;
   int head_h = head_rect->h;
-  int img_w = img->surf->w;
-  int img_h = img->surf->h;
+  int img_w = aligned_dim(img->w, cx);
+  int img_h = aligned_dim(img->h, cx);
   int new_h = img_h + head_h;
+  AU_FixedSizeAllocator *fsa = &cx->fsa;
 
   struct TNode *new_head = AU_FSA_Alloc(fsa);
   return_if(!new_head, ATTEMPT_NO_MEM);
@@ -210,7 +249,9 @@ grow_down_insert(struct TNode **head,
     return ATTEMPT_NO_MEM;
   }
   region->img = img;
-  region->rect = (SDL_Rect) {head_x, head_y + head_h, img_w, img_h};
+  region->rect = (SDL_Rect) {head_x, head_y + head_h,
+                             img->w, img->h};
+  region->flip = REGION_FLIP_NONE;
   new_head->right = *head;
   new_head->down = down;
   new_head->rect = (SDL_Rect) {head_x, head_y, head_w, new_h};
@@ -230,15 +271,15 @@ grow_insert(struct TNode **head,
   assert(cx->opts.h > 0);
   assert(*head);
 
-  int img_w = img->surf->w;
-  int img_h = img->surf->h;
+  int img_w = aligned_dim(img->w, cx);
+  int img_h = aligned_dim(img->h, cx);
   int root_w = (*head)->rect.w;
   int root_h = (*head)->rect.h;
 
-  int can_grow_down = root_w >= img_w;
-  int can_grow_right = root_h >= img_h;
+  int can_grow_down = root_w >= img_w && img_h <= ATLAS_MAX_DIM - root_h;
+  int can_grow_right = root_h >= img_h && img_w <= ATLAS_MAX_DIM - root_w;
 
-  assert(can_grow_down || can_grow_right);
+  return_if(!can_grow_down && !can_grow_right, ATTEMPT_TOO_LARGE);
 
   int should_grow_down = can_grow_down &&
     (cx->opts.w <= root_w + img_w || root_w > root_h) &&
@@ -247,12 +288,11 @@ grow_insert(struct TNode **head,
     (cx->opts.h <= root_h + img_h || root_h > root_w) &&
     root_w + img_w <= cx->opts.w;
 
-  AU_FixedSizeAllocator *fsa = &cx->fsa;
-  return_if(should_grow_right, grow_right_insert(head, region, img, fsa));
-  return_if(should_grow_down, grow_down_insert(head, region, img, fsa));
-  return_if(can_grow_down, grow_down_insert(head, region, img, fsa));
+  return_if(should_grow_right, grow_right_insert(head, region, img, cx));
+  return_if(should_grow_down, grow_down_insert(head, region, img, cx));
+  return_if(can_grow_down, grow_down_insert(head, region, img, cx));
   assert(can_grow_right);
-  return grow_right_insert(head, region, img, fsa);
+  return grow_right_insert(head, region, img, cx);
 }
 
 static int
@@ -262,11 +302,117 @@ insert(struct TNode **head,
        struct Context *cx)
 {
   int attempt = try_insert(head, region, img, cx);
-  return_if(attempt == ATTEMPT_OK || attempt == ATTEMPT_NO_MEM, attempt);
-  assert(attempt == ATTEMPT_UNFIT);
+  return_if(attempt != ATTEMPT_UNFIT, attempt);
   return grow_insert(head, region, img, cx);
 }
 
+/**
+ * Places imgs[first], imgs[first+step], and so on, into the regions of the
+ * same indices, from (0, 0). root gets the rectangle they fit in.
+ */
+static int
+pack_tree(struct NamedSurface *imgs,
+          int first,
+          int step,
+          int num_imgs,
+          struct RegionInfo *regions,
+          struct BinPack2DOptions opts,
+          SDL_Rect *root)
+{
+  assert(first < num_imgs);
+  assert(step > 0);
+
+  struct Context cx = {.opts = opts};
+  struct TNode *head;
+  int attempt = ATTEMPT_NO_MEM;
+
+  // Every node goes away at once with the arena. Each insert makes at most
+  // four of them.
+  size_t count = (num_imgs - first + step - 1)/step;
+  goto_if(AU_AR_Setup(&cx.nodes, NODES_ARENA_BLOCK_SIZE, 0) < 0, end);
+  goto_if(AU_FSA_SetupInArena(&cx.fsa, sizeof (struct TNode),
+                              count*2, &cx.nodes) < 0,
+          end);
+  head = leaf_node(0, 0,
+                   aligned_dim(imgs[first].w, &cx),
+                   aligned_dim(imgs[first].h, &cx),
+                   &cx.fsa);
+  goto_if(!head, end);
+
+  for (int i = first; i < num_imgs; i += step) {
+    attempt = insert(&head, regions + i, imgs + i, &cx);
+    goto_if(attempt < 0, end);
+  }
+  *root = head->rect;
+
+end:
+  AU_AR_Destroy(&cx.nodes);
+  return attempt;
+}
+
+static void
+pack_shards(void *ctx, size_t begin, size_t end) {
+  struct ShardJob *job = ctx;
+  for (size_t s = begin; s < end; s++) {
+    uint64_t t = trace_begin();
+    job->attempts[s] = pack_tree(job->imgs, s, job->num_shards, job->num_imgs,
+                                 job->regions, job->opts, job->roots + s);
+    trace_end("pack_shard", 0, t);
+  }
+}
+
+/**
+ * pack_tree for every image, in opts.shards trees built in parallel. Since
+ * the images are sorted by size, dealing them out gives every shard about
+ * the same mix of sizes, hence about the same shape. The shards are then
+ * packed as images of their own, and their regions moved along.
+ */
+static int
+pack_sharded(struct NamedSurface *imgs,
+             int num_imgs,
+             struct RegionInfo *regions,
+             struct BinPack2DOptions opts,
+             SDL_Rect *root)
+{
+  int k = opts.shards < num_imgs ? opts.shards : num_imgs;
+  int attempt = ATTEMPT_NO_MEM;
+  int *attempts = malloc(k * sizeof *attempts);
+  SDL_Rect *roots = malloc(k * sizeof *roots);
+  struct NamedSurface *boxes = malloc(k * sizeof *boxes);
+  struct RegionInfo *box_regions = malloc(k * sizeof *box_regions);
+  goto_if(!attempts || !roots || !boxes || !box_regions, end);
+
+  struct ShardJob job = {
+    imgs, num_imgs, k, regions, opts, attempts, roots
+  };
+  workers_parallel_for(k, 1, pack_shards, &job);
+  for (int s = 0; s < k; s++) {
+    attempt = attempts[s];
+    goto_if(attempt < 0, end);
+    boxes[s] = (struct NamedSurface) {
+      .w = roots[s].w, .h = roots[s].h, .index = s
+    };
+  }
+
+  qsort(boxes, k, sizeof *boxes, maxside_named_surface_cmp);
+  attempt = pack_tree(boxes, 0, 1, k, box_regions, opts, root);
+  goto_if(attempt < 0, end);
+  for (int b = 0; b < k; b++) {
+    roots[box_regions[b].img->index] = box_regions[b].rect;
+  }
+  for (int i = 0; i < num_imgs; i++) {
+    regions[i].rect.x += roots[i % k].x;
+    regions[i].rect.y += roots[i % k].y;
+  }
+
+end:
+  free(attempts);
+  free(roots);
+  free(boxes);
+  free(box_regions);
+  return attempt;
+}
+
 struct BinPack2DResult
 bin_pack_2d(struct NamedSurface *imgs,
             int num_imgs,
@@ -276,72 +422,72 @@ bin_pack_2d(struct NamedSurface *imgs,
   assert(imgs);
   assert(opts.w > 0);
   assert(opts.h > 0);
+  assert(opts.align > 0);
 
   struct BinPack2DResult result = {ATTEMPT_NO_MEM, 0, 0};
-  struct TNode *head = 0;
   struct Context cx = {.opts = opts};
+  SDL_Rect root;
 
-  goto_if(AU_FSA_Setup(&cx.fsa, sizeof (struct TNode), 1) < 0,
-          err);
+  // Past this, aligned sizes and the sums of two of them could overflow.
+  result.attempt = ATTEMPT_TOO_LARGE;
+  return_if(opts.align > ATLAS_MAX_DIM, result);
+  for (int i = 0; i < num_imgs; i++) {
+    return_if(imgs[i].w > ATLAS_MAX_DIM || imgs[i].h > ATLAS_MAX_DIM ||
+              aligned_dim(imgs[i].w, &cx) > ATLAS_MAX_DIM ||
+              aligned_dim(imgs[i].h, &cx) > ATLAS_MAX_DIM, result);
+  }
+  result.attempt = ATTEMPT_NO_MEM;
+  return_if((size_t) num_imgs > SIZE_MAX/sizeof (struct RegionInfo), result);
 
+  stats_begin(STATS_PHASE_PACK);
   qsort(imgs, num_imgs, sizeof (struct NamedSurface),
         maxside_named_surface_cmp);
 
   /*
    * Should the regions storage be a parameter?
    */
-  result.regions = malloc(num_imgs * sizeof (struct RegionInfo));
+  result.regions = opts.arena
+                   ? AU_AR_Alloc(opts.arena,
+                                 num_imgs * sizeof (struct RegionInfo))
+                   : malloc(num_imgs * sizeof (struct RegionInfo));
 
   goto_if(!result.regions, err);
-  head = leaf_node(0, 0, imgs[0].surf->w, imgs[0].surf->h, &cx.fsa);
-  goto_if(!head, err);
-
-  for (int i = 0; i < num_imgs; i++) {
-    result.attempt = insert(&head, result.regions+i, imgs+i, &cx);
-    goto_if(result.attempt < 0, err);
-  }
-
-  assert(head);
-
-  Uint32 rmask, gmask, bmask, amask;
-
-  /* This following code was copied/pasted from the SDL wiki docs. */
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-  rmask = 0xff000000;
-  gmask = 0x00ff0000;
-  bmask = 0x0000ff00;
-  amask = 0x000000ff;
-#else
-  rmask = 0x000000ff;
-  gmask = 0x0000ff00;
-  bmask = 0x00ff0000;
-  amask = 0xff000000;
-#endif
-
+  result.attempt = opts.shards > 1
+                   ? pack_sharded(imgs, num_imgs, result.regions, opts, &root)
+                   : pack_tree(imgs, 0, 1, num_imgs, result.regions, opts,
+                               &root);
+  goto_if(result.attempt < 0, err);
+  stats_end(STATS_PHASE_PACK);
+
+  stats_begin(STATS_PHASE_BLIT);
   result.attempt = ATTEMPT_NO_SURFACE;
-  result.img = SDL_CreateRGBSurface(0, head->rect.w, head->rect.h, 32,
-                                    rmask, gmask, bmask, amask);
+  result.img = atlas_create(root.w, root.h);
   goto_if(!result.img, err);
 
+  /*
+   * Regions never overlap, so pixels are copied as they are rather than
+   * blended over the (transparent black) atlas, like the images decoded
+   * straight into it.
+   */
   for (int i = 0; i < num_imgs; i++) {
     struct RegionInfo *reg = result.regions + i;
-    int blit = SDL_BlitSurface(reg->img->surf, 0, result.img, &reg->rect);
-    goto_if(blit < 0, err);
+    continue_if(!reg->img->surf);
+    uint64_t t = trace_begin();
+    goto_if(atlas_blit(reg->img->surf, result.img, &reg->rect) < 0, err);
+    trace_end("blit_image", reg->img->name, t);
+    stats_add_pixels(STATS_PHASE_BLIT, (uint64_t) reg->rect.w*reg->rect.h);
   }
+  stats_end(STATS_PHASE_BLIT);
 
   result.attempt = ATTEMPT_OK;
-  AU_FSA_Destroy(&cx.fsa);
   return result;
 
 err:
   assert(result.attempt < 0);
-  if (head) {
-    AU_FSA_Destroy(&cx.fsa);
-  }
-  if (result.img) {
-    SDL_FreeSurface(result.img);
+  atlas_free(result.img);
+  if (!opts.arena) {
+    free(result.regions);
   }
-  free(result.regions);
   return result;
 }
 
@@ -352,6 +498,8 @@ bp2d_strerror(int attempt) {
       return strerror(errno);
     case ATTEMPT_NO_SURFACE:
       return SDL_GetError();
+    case ATTEMPT_TOO_LARGE:
+      return "Images don't fit in the largest atlas";
   }
   return 0;
 }
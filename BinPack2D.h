@@ -2,11 +2,14 @@
 #define BinPack2D_H
 
 #include "RegionInfo.h"
+#include "Atlas.h"
+#include "AU.h"
 
 enum {
   ATTEMPT_OK = 0,
   ATTEMPT_NO_MEM = -1,
-  ATTEMPT_NO_SURFACE = -2
+  ATTEMPT_NO_SURFACE = -2,
+  ATTEMPT_TOO_LARGE = -3
 };
 
 struct BinPack2DResult {
@@ -17,8 +20,28 @@ struct BinPack2DResult {
 
 struct BinPack2DOptions {
   int w, h;
+
+  // Regions are placed at multiples of align (1 for no alignment).
+  int align;
+
+  // If not null, the regions are allocated from it instead of malloc'd.
+  AU_Arena *arena;
+
+  // With more than 1, the images are dealt (largest first) to that many
+  // shards, packed in parallel, and the shards are then packed together.
+  // Much faster for lots of images, at the cost of some occupancy.
+  int shards;
 };
 
+/**
+ * Places the images and draws them into a new atlas surface, to be freed with
+ * atlas_free. Images without a surface (see RegionInfo.h) are placed by their
+ * w and h, but drawing them is left to the caller.
+ *
+ * opts.w and opts.h are where the atlas stops growing in one direction if it
+ * can grow in the other. Neither side ever goes past ATLAS_MAX_DIM though:
+ * ATTEMPT_TOO_LARGE is returned if the images don't fit then.
+ */
 struct BinPack2DResult
 bin_pack_2d(struct NamedSurface *imgs,
             const int num_imgs,
@@ -0,0 +1,463 @@
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "XFlow.h"
+#include "BlockComp.h"
+#include "Workers.h"
+
+/*
+ * Blocks are loaded into structure of arrays form (one 16 lanes array per
+ * channel) and every per pixel loop below runs over exactly 16 lanes with no
+ * data dependent control flow, so the compiler can turn them into SIMD code.
+ */
+
+enum {
+  BLOCK_PIXELS = BC_BLOCK_DIM*BC_BLOCK_DIM,
+  BC1_BLOCK_SIZE = 8,
+  BC3_BLOCK_SIZE = 16,
+  PCA_ITERATIONS = 8,
+  REFINE_ITERATIONS = 4,
+  BC1_ALPHA_THRESHOLD = 128
+};
+
+struct Block {
+  int r[BLOCK_PIXELS], g[BLOCK_PIXELS], b[BLOCK_PIXELS], a[BLOCK_PIXELS];
+
+  // Which pixels take part in the color fit (0 or 1).
+  int use[BLOCK_PIXELS];
+};
+
+struct Color {
+  int r, g, b;
+};
+
+struct ColorFit {
+  unsigned c0, c1;
+  unsigned char idx[BLOCK_PIXELS];
+  long err;
+};
+
+struct EncodeJob {
+  int format, quality;
+  const unsigned char *pixels;
+  int w, h;
+  size_t pitch;
+  unsigned char *out;
+};
+
+static inline int
+imin(int a, int b) {
+  return a < b ? a : b;
+}
+
+static inline int
+imax(int a, int b) {
+  return a > b ? a : b;
+}
+
+static inline int
+clamp255(float v) {
+  return v < 0 ? 0 : (v > 255 ? 255 : (int) (v + 0.5f));
+}
+
+static inline unsigned
+pack_565(struct Color c) {
+  unsigned r = (c.r*31 + 127)/255;
+  unsigned g = (c.g*63 + 127)/255;
+  unsigned b = (c.b*31 + 127)/255;
+  return r << 11 | g << 5 | b;
+}
+
+static inline struct Color
+unpack_565(unsigned v) {
+  int r = (v >> 11) & 31;
+  int g = (v >> 5) & 63;
+  int b = v & 31;
+  return (struct Color) {r << 3 | r >> 2, g << 2 | g >> 4, b << 3 | b >> 2};
+}
+
+static inline void
+store_u16(unsigned char *p, unsigned v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+}
+
+static inline void
+store_u32(unsigned char *p, uint32_t v) {
+  store_u16(p, v & 0xFFFF);
+  store_u16(p+2, v >> 16);
+}
+
+static void
+load_block(struct Block *blk, const struct EncodeJob *job, int bx, int by) {
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    int x = imin(bx*BC_BLOCK_DIM + i%BC_BLOCK_DIM, job->w - 1);
+    int y = imin(by*BC_BLOCK_DIM + i/BC_BLOCK_DIM, job->h - 1);
+    const unsigned char *p = job->pixels + (size_t) y*job->pitch + x*4;
+    blk->r[i] = p[0];
+    blk->g[i] = p[1];
+    blk->b[i] = p[2];
+    blk->a[i] = p[3];
+  }
+}
+
+/**
+ * Picks the endpoints from the bounding box of the used pixels, inset by
+ * 1/16th of its extent so the interpolated colors land on the data.
+ */
+static void
+bbox_endpoints(const struct Block *blk, struct Color *e0, struct Color *e1) {
+  int lo[3] = {255, 255, 255};
+  int hi[3] = {0, 0, 0};
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    continue_if(!blk->use[i]);
+    lo[0] = imin(lo[0], blk->r[i]);
+    lo[1] = imin(lo[1], blk->g[i]);
+    lo[2] = imin(lo[2], blk->b[i]);
+    hi[0] = imax(hi[0], blk->r[i]);
+    hi[1] = imax(hi[1], blk->g[i]);
+    hi[2] = imax(hi[2], blk->b[i]);
+  }
+  for (int c = 0; c < 3; c++) {
+    int inset = (hi[c] - lo[c])/16;
+    lo[c] += inset;
+    hi[c] -= inset;
+  }
+  *e0 = (struct Color) {hi[0], hi[1], hi[2]};
+  *e1 = (struct Color) {lo[0], lo[1], lo[2]};
+}
+
+/**
+ * Picks the endpoints as the extreme projections of the used pixels on the
+ * principal axis of their colors (found through power iteration).
+ */
+static void
+pca_endpoints(const struct Block *blk, struct Color *e0, struct Color *e1) {
+  float n = 0, mean[3] = {0, 0, 0};
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    n += blk->use[i];
+    mean[0] += blk->use[i]*blk->r[i];
+    mean[1] += blk->use[i]*blk->g[i];
+    mean[2] += blk->use[i]*blk->b[i];
+  }
+  assert(n > 0);
+  for (int c = 0; c < 3; c++) {
+    mean[c] /= n;
+  }
+
+  float cov[6] = {0, 0, 0, 0, 0, 0};
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    float u = blk->use[i];
+    float r = blk->r[i] - mean[0];
+    float g = blk->g[i] - mean[1];
+    float b = blk->b[i] - mean[2];
+    cov[0] += u*r*r;
+    cov[1] += u*r*g;
+    cov[2] += u*r*b;
+    cov[3] += u*g*g;
+    cov[4] += u*g*b;
+    cov[5] += u*b*b;
+  }
+
+  float axis[3] = {1, 1, 1};
+  for (int it = 0; it < PCA_ITERATIONS; it++) {
+    float x = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+    float y = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+    float z = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+    float m = x*x > y*y ? (x*x > z*z ? x : z) : (y*y > z*z ? y : z);
+    if (m == 0) {
+      // Flat block: every used pixel is the mean color.
+      *e0 = *e1 = (struct Color) {clamp255(mean[0]), clamp255(mean[1]),
+                                  clamp255(mean[2])};
+      return;
+    }
+    axis[0] = x/m;
+    axis[1] = y/m;
+    axis[2] = z/m;
+  }
+
+  float lo = 0, hi = 0;
+  int first = 1;
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    continue_if(!blk->use[i]);
+    float t = (blk->r[i] - mean[0])*axis[0] +
+              (blk->g[i] - mean[1])*axis[1] +
+              (blk->b[i] - mean[2])*axis[2];
+    if (first || t < lo) {
+      lo = t;
+    }
+    if (first || t > hi) {
+      hi = t;
+    }
+    first = 0;
+  }
+
+  float len2 = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+  float inset = (hi - lo)/16;
+  lo = (lo + inset)/len2;
+  hi = (hi - inset)/len2;
+  *e0 = (struct Color) {clamp255(mean[0] + hi*axis[0]),
+                        clamp255(mean[1] + hi*axis[1]),
+                        clamp255(mean[2] + hi*axis[2])};
+  *e1 = (struct Color) {clamp255(mean[0] + lo*axis[0]),
+                        clamp255(mean[1] + lo*axis[1]),
+                        clamp255(mean[2] + lo*axis[2])};
+}
+
+/**
+ * Computes the indices and the squared error for the c0/c1 endpoints. In
+ * four colors mode c0 > c1 is required, in three colors mode c0 <= c1 is
+ * required. Pixels not used by the fit get index 3 (transparent black in the
+ * three colors mode).
+ */
+static void
+fit_indices(const struct Block *blk, int three_colors, struct ColorFit *fit) {
+  if (three_colors ? fit->c0 > fit->c1 : fit->c0 < fit->c1) {
+    unsigned tmp = fit->c0;
+    fit->c0 = fit->c1;
+    fit->c1 = tmp;
+  }
+
+  struct Color pal[4];
+  pal[0] = unpack_565(fit->c0);
+  pal[1] = unpack_565(fit->c1);
+  int num_colors;
+  if (fit->c0 == fit->c1) {
+    // Whatever the mode, only index 0 is meaningful here.
+    num_colors = 1;
+  }
+  else if (three_colors) {
+    pal[2] = (struct Color) {(pal[0].r + pal[1].r)/2,
+                             (pal[0].g + pal[1].g)/2,
+                             (pal[0].b + pal[1].b)/2};
+    num_colors = 3;
+  }
+  else {
+    pal[2] = (struct Color) {(2*pal[0].r + pal[1].r)/3,
+                             (2*pal[0].g + pal[1].g)/3,
+                             (2*pal[0].b + pal[1].b)/3};
+    pal[3] = (struct Color) {(pal[0].r + 2*pal[1].r)/3,
+                             (pal[0].g + 2*pal[1].g)/3,
+                             (pal[0].b + 2*pal[1].b)/3};
+    num_colors = 4;
+  }
+
+  int best_d[BLOCK_PIXELS];
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    best_d[i] = INT_MAX;
+    fit->idx[i] = 0;
+  }
+  for (int k = 0; k < num_colors; k++) {
+    for (int i = 0; i < BLOCK_PIXELS; i++) {
+      int dr = blk->r[i] - pal[k].r;
+      int dg = blk->g[i] - pal[k].g;
+      int db = blk->b[i] - pal[k].b;
+      int d = dr*dr + dg*dg + db*db;
+      int better = d < best_d[i];
+      best_d[i] = better ? d : best_d[i];
+      fit->idx[i] = better ? k : fit->idx[i];
+    }
+  }
+
+  fit->err = 0;
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    fit->err += blk->use[i]*best_d[i];
+    fit->idx[i] = blk->use[i] ? fit->idx[i] : 3;
+  }
+}
+
+/**
+ * Solves, per channel, the least squares problem for the endpoints given the
+ * current indices.
+ */
+static int
+refine_endpoints(const struct Block *blk, int three_colors,
+                 const struct ColorFit *fit,
+                 struct Color *e0, struct Color *e1)
+{
+  static const float w4[4] = {1.0f, 0.0f, 2.0f/3, 1.0f/3};
+  static const float w3[4] = {1.0f, 0.0f, 0.5f, 0.0f};
+  const float *w = three_colors ? w3 : w4;
+
+  float aa = 0, ab = 0, bb = 0;
+  float ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    float u = blk->use[i];
+    float wa = w[fit->idx[i]];
+    float wb = 1 - wa;
+    aa += u*wa*wa;
+    ab += u*wa*wb;
+    bb += u*wb*wb;
+    ax[0] += u*wa*blk->r[i];
+    ax[1] += u*wa*blk->g[i];
+    ax[2] += u*wa*blk->b[i];
+    bx[0] += u*wb*blk->r[i];
+    bx[1] += u*wb*blk->g[i];
+    bx[2] += u*wb*blk->b[i];
+  }
+
+  float det = aa*bb - ab*ab;
+  return_if(det > -1e-6f && det < 1e-6f, -1);
+  float v0[3], v1[3];
+  for (int c = 0; c < 3; c++) {
+    v0[c] = (ax[c]*bb - bx[c]*ab)/det;
+    v1[c] = (bx[c]*aa - ax[c]*ab)/det;
+  }
+  *e0 = (struct Color) {clamp255(v0[0]), clamp255(v0[1]), clamp255(v0[2])};
+  *e1 = (struct Color) {clamp255(v1[0]), clamp255(v1[1]), clamp255(v1[2])};
+  return 0;
+}
+
+static void
+encode_color(const struct Block *blk, int three_colors, int quality,
+             unsigned char *out)
+{
+  struct ColorFit best;
+  int any_used = 0;
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    any_used |= blk->use[i];
+  }
+
+  if (!any_used) {
+    best.c0 = best.c1 = 0;
+    fit_indices(blk, three_colors, &best);
+  }
+  else {
+    struct Color e0, e1;
+    if (quality == BC_QUALITY_FAST) {
+      bbox_endpoints(blk, &e0, &e1);
+    }
+    else {
+      pca_endpoints(blk, &e0, &e1);
+    }
+    best.c0 = pack_565(e0);
+    best.c1 = pack_565(e1);
+    fit_indices(blk, three_colors, &best);
+
+    for (int it = 0; quality == BC_QUALITY_HIGH && it < REFINE_ITERATIONS;
+         it++)
+    {
+      break_if(best.err == 0);
+      break_if(refine_endpoints(blk, three_colors, &best, &e0, &e1) < 0);
+      struct ColorFit cand = {pack_565(e0), pack_565(e1), {0}, 0};
+      fit_indices(blk, three_colors, &cand);
+      break_if(cand.err >= best.err);
+      best = cand;
+    }
+  }
+
+  uint32_t bits = 0;
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    bits |= (uint32_t) best.idx[i] << (2*i);
+  }
+  store_u16(out, best.c0);
+  store_u16(out+2, best.c1);
+  store_u32(out+4, bits);
+}
+
+static void
+encode_alpha(const struct Block *blk, unsigned char *out) {
+  int lo = 255, hi = 0;
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    lo = imin(lo, blk->a[i]);
+    hi = imax(hi, blk->a[i]);
+  }
+
+  int pal[8] = {hi, lo};
+  for (int k = 2; k < 8; k++) {
+    pal[k] = ((8 - k)*hi + (k - 1)*lo)/7;
+  }
+
+  int best_d[BLOCK_PIXELS];
+  unsigned char idx[BLOCK_PIXELS];
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    best_d[i] = INT_MAX;
+    idx[i] = 0;
+  }
+  for (int k = 0; k < (hi == lo ? 1 : 8); k++) {
+    for (int i = 0; i < BLOCK_PIXELS; i++) {
+      int d = blk->a[i] - pal[k];
+      d *= d;
+      int better = d < best_d[i];
+      best_d[i] = better ? d : best_d[i];
+      idx[i] = better ? k : idx[i];
+    }
+  }
+
+  uint64_t bits = 0;
+  for (int i = 0; i < BLOCK_PIXELS; i++) {
+    bits |= (uint64_t) idx[i] << (3*i);
+  }
+  out[0] = hi;
+  out[1] = lo;
+  for (int i = 0; i < 6; i++) {
+    out[2+i] = (bits >> (8*i)) & 0xFF;
+  }
+}
+
+static void
+encode_block_rows(void *ctx, size_t begin, size_t end) {
+  const struct EncodeJob *job = ctx;
+  const int blocks_x = (job->w + BC_BLOCK_DIM - 1)/BC_BLOCK_DIM;
+  const size_t block_size = bc_block_size(job->format);
+  const size_t row_size = bc_row_size(job->format, job->w);
+
+  for (size_t by = begin; by < end; by++) {
+    unsigned char *out = job->out + by*row_size;
+    for (int bx = 0; bx < blocks_x; bx++) {
+      struct Block blk;
+      load_block(&blk, job, bx, by);
+      if (job->format == BC_FORMAT_BC1) {
+        int has_alpha = 0;
+        for (int i = 0; i < BLOCK_PIXELS; i++) {
+          blk.use[i] = blk.a[i] >= BC1_ALPHA_THRESHOLD;
+          has_alpha |= !blk.use[i];
+        }
+        encode_color(&blk, has_alpha, job->quality, out);
+      }
+      else {
+        assert(job->format == BC_FORMAT_BC3);
+        for (int i = 0; i < BLOCK_PIXELS; i++) {
+          blk.use[i] = 1;
+        }
+        encode_alpha(&blk, out);
+        encode_color(&blk, 0, job->quality, out + 8);
+      }
+      out += block_size;
+    }
+  }
+}
+
+size_t
+bc_block_size(int format) {
+  assert(format == BC_FORMAT_BC1 || format == BC_FORMAT_BC3);
+  return format == BC_FORMAT_BC1 ? BC1_BLOCK_SIZE : BC3_BLOCK_SIZE;
+}
+
+size_t
+bc_row_size(int format, int w) {
+  assert(w > 0);
+  return (size_t) ((w + BC_BLOCK_DIM - 1)/BC_BLOCK_DIM) *
+         bc_block_size(format);
+}
+
+void
+bc_encode(int format,
+          int quality,
+          const void *pixels,
+          int w,
+          int h,
+          size_t pitch,
+          void *out)
+{
+  assert(pixels);
+  assert(out);
+  assert(w > 0);
+  assert(h > 0);
+
+  struct EncodeJob job = {format, quality, pixels, w, h, pitch, out};
+  size_t blocks_y = (h + BC_BLOCK_DIM - 1)/BC_BLOCK_DIM;
+  workers_parallel_for(blocks_y, 1, encode_block_rows, &job);
+}
@@ -0,0 +1,55 @@
+#ifndef BLOCK_COMP_H
+#define BLOCK_COMP_H
+
+#include <stddef.h>
+
+/*
+ * GPU block compression of 32 bits RGBA images (R, G, B, A byte order).
+ */
+
+enum {
+  BC_FORMAT_BC1 = 1,
+  BC_FORMAT_BC3 = 3
+};
+
+/**
+ * Encoding presets. BC_QUALITY_FAST fits the endpoints to the block's
+ * bounding box. BC_QUALITY_NORMAL fits them to the block's principal axis.
+ * BC_QUALITY_HIGH additionally refines the endpoints through least squares
+ * until the error stops improving.
+ */
+enum {
+  BC_QUALITY_FAST,
+  BC_QUALITY_NORMAL,
+  BC_QUALITY_HIGH
+};
+
+enum {
+  BC_BLOCK_DIM = 4
+};
+
+size_t
+bc_block_size(int format);
+
+/**
+ * Size in bytes of a row of blocks for an image w pixels wide.
+ */
+size_t
+bc_row_size(int format, int w);
+
+/**
+ * Encodes the w by h image at pixels, whose rows are pitch bytes apart, into
+ * out, which must have room for bc_row_size(format, w) * ceil(h/4) bytes.
+ * Blocks crossing the right or bottom edges are padded by repeating the last
+ * column or row. Rows of blocks are encoded in parallel (see Workers.h).
+ */
+void
+bc_encode(int format,
+          int quality,
+          const void *pixels,
+          int w,
+          int h,
+          size_t pitch,
+          void *out);
+
+#endif
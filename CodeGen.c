@@ -0,0 +1,401 @@
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "XFlow.h"
+#include "RegionInfo.h"
+#include "CodeGen.h"
+
+enum {
+  /**
+   * How many values per line in the generated integer tables.
+   */
+  INTS_PER_LINE = 8
+};
+
+struct PerfectHash {
+  // Indexed by bucket (first level hash). A positive value is the seed for
+  // the second level hash. A negative value v means slot -v-1 directly.
+  int *seeds;
+
+  // Indexed by slot. The region index.
+  int *slots;
+};
+
+static char dup_name[256];
+
+/*
+ * The hash is emitted verbatim into the generated source, so both must be
+ * kept in sync.
+ */
+static const char hash_source[] =
+  "static uint32_t\n"
+  "seeded_hash(uint32_t seed, const char *s) {\n"
+  "  uint32_t h = 2166136261u ^ seed;\n"
+  "  for (; *s; s++) {\n"
+  "    h ^= (unsigned char) *s;\n"
+  "    h *= 16777619u;\n"
+  "  }\n"
+  "  return h;\n"
+  "}\n";
+
+static uint32_t
+seeded_hash(uint32_t seed, const char *s) {
+  uint32_t h = 2166136261u ^ seed;
+  for (; *s; s++) {
+    h ^= (unsigned char) *s;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int
+cmp_names_nocase(const void *a, const void *b) {
+  const unsigned char *s1 = *(const unsigned char * const *) a;
+  const unsigned char *s2 = *(const unsigned char * const *) b;
+  while (*s1 && tolower(*s1) == tolower(*s2)) {
+    s1++;
+    s2++;
+  }
+  return tolower(*s1) - tolower(*s2);
+}
+
+/**
+ * Length of the longest common prefix of the names, cut right after its last
+ * '_'. Nothing is removed from a single name.
+ */
+static size_t
+common_prefix_len(const struct RegionInfo *regions, int num_regions) {
+  return_if(num_regions < 2, 0);
+
+  const char *first = regions[0].img->name;
+  size_t len = strlen(first);
+  for (int i = 1; i < num_regions; i++) {
+    const char *name = regions[i].img->name;
+    size_t j = 0;
+    while (j < len && name[j] == first[j]) {
+      j++;
+    }
+    len = j;
+  }
+  while (len > 0 && first[len-1] != '_') {
+    len--;
+  }
+  return len;
+}
+
+static int
+check_duplicates(const char **names, int num_names) {
+  const char **sorted = malloc(num_names * sizeof *sorted);
+  return_if(!sorted, CGEN_FAIL_NO_MEM);
+  memcpy(sorted, names, num_names * sizeof *sorted);
+  qsort(sorted, num_names, sizeof *sorted, cmp_names_nocase);
+
+  int res = CGEN_OK;
+  for (int i = 1; i < num_names; i++) {
+    if (cmp_names_nocase(sorted + i-1, sorted + i) == 0) {
+      snprintf(dup_name, sizeof dup_name, "%s", sorted[i]);
+      res = CGEN_FAIL_DUPLICATE;
+      break;
+    }
+  }
+  free(sorted);
+  return res;
+}
+
+/**
+ * Builds a minimal perfect hash (hash and displace) over the names: names are
+ * spread in buckets by a first hash and, from the largest bucket down, each
+ * bucket gets the first seed placing all of its names in free slots.
+ * Single name buckets take the remaining slots directly.
+ */
+static int
+build_perfect_hash(const char **names, int n, struct PerfectHash *ph) {
+  int res = CGEN_FAIL_NO_MEM;
+  int *bucket_start = calloc(n + 1, sizeof (int));
+  int *members = malloc(n * sizeof (int));
+  int *order = malloc(n * sizeof (int));
+  int *tried = malloc(n * sizeof (int));
+  ph->seeds = calloc(n, sizeof (int));
+  ph->slots = malloc(n * sizeof (int));
+  goto_if(!bucket_start || !members || !order || !tried, end);
+  goto_if(!ph->seeds || !ph->slots, end);
+
+  // Counting sort of the names by bucket.
+  for (int i = 0; i < n; i++) {
+    bucket_start[seeded_hash(0, names[i]) % n + 1]++;
+  }
+  for (int b = 0; b < n; b++) {
+    bucket_start[b+1] += bucket_start[b];
+  }
+  for (int i = 0; i < n; i++) {
+    order[i] = bucket_start[i];
+  }
+  for (int i = 0; i < n; i++) {
+    members[order[seeded_hash(0, names[i]) % n]++] = i;
+  }
+
+  // Buckets by decreasing size. Sizes are small, so a counting pass per size
+  // would do as well, but this is simpler.
+  int max_size = 0;
+  for (int b = 0; b < n; b++) {
+    int size = bucket_start[b+1] - bucket_start[b];
+    max_size = size > max_size ? size : max_size;
+  }
+  int num_ordered = 0;
+  for (int size = max_size; size > 0; size--) {
+    for (int b = 0; b < n; b++) {
+      if (bucket_start[b+1] - bucket_start[b] == size) {
+        order[num_ordered++] = b;
+      }
+    }
+  }
+
+  for (int s = 0; s < n; s++) {
+    ph->slots[s] = -1;
+  }
+
+  int next_free = 0;
+  for (int k = 0; k < num_ordered; k++) {
+    int b = order[k];
+    int first = bucket_start[b];
+    int size = bucket_start[b+1] - first;
+
+    if (size == 1) {
+      while (ph->slots[next_free] >= 0) {
+        next_free++;
+      }
+      ph->slots[next_free] = members[first];
+      ph->seeds[b] = -next_free - 1;
+      continue;
+    }
+
+    for (uint32_t seed = 1;; seed++) {
+      assert(seed <= INT32_MAX);
+      int j;
+      for (j = 0; j < size; j++) {
+        int slot = seeded_hash(seed, names[members[first + j]]) % n;
+        break_if(ph->slots[slot] >= 0);
+        int taken = 0;
+        for (int t = 0; t < j; t++) {
+          taken |= tried[t] == slot;
+        }
+        break_if(taken);
+        tried[j] = slot;
+      }
+      if (j == size) {
+        for (j = 0; j < size; j++) {
+          ph->slots[tried[j]] = members[first + j];
+        }
+        ph->seeds[b] = seed;
+        break;
+      }
+    }
+  }
+  res = CGEN_OK;
+
+end:
+  free(bucket_start);
+  free(members);
+  free(order);
+  free(tried);
+  if (res < 0) {
+    free(ph->seeds);
+    free(ph->slots);
+    ph->seeds = 0;
+    ph->slots = 0;
+  }
+  return res;
+}
+
+static void
+emit_upper(FILE *fp, const char *s) {
+  for (; *s; s++) {
+    putc(toupper((unsigned char) *s), fp);
+  }
+}
+
+static void
+emit_ints(FILE *fp, const int *values, int n) {
+  for (int i = 0; i < n; i++) {
+    fprintf(fp, "%s%d%s", i % INTS_PER_LINE == 0 ? "  " : " ", values[i],
+            i == n-1 ? "\n" : (i % INTS_PER_LINE == INTS_PER_LINE-1
+                               ? ",\n" : ","));
+  }
+}
+
+static int
+close_checked(FILE *fp) {
+  int failed = ferror(fp);
+  return_if(fclose(fp) != 0 || failed, CGEN_FAIL_LIBC);
+  return CGEN_OK;
+}
+
+static int
+emit_header(const char *filename,
+            const char *prefix,
+            const char **names,
+            int n)
+{
+  FILE *fp = fopen(filename, "w");
+  return_if(!fp, CGEN_FAIL_LIBC);
+
+  fputs("/* Generated by imgpacker. Do not edit. */\n\n#ifndef ", fp);
+  emit_upper(fp, prefix);
+  fputs("_SPRITE_SHEET_H\n#define ", fp);
+  emit_upper(fp, prefix);
+  fputs("_SPRITE_SHEET_H\n\n", fp);
+
+  fprintf(fp,
+          "struct %s_SpriteSheetPiece {\n"
+          "  int x, y, w, h;\n"
+          "  int id;\n"
+          "  const char *name;\n"
+          "};\n\n"
+          "enum {\n", prefix);
+  for (int i = 0; i < n; i++) {
+    fprintf(fp, "  %s_", prefix);
+    emit_upper(fp, names[i]);
+    fputs(",\n", fp);
+  }
+  fprintf(fp, "  %s_NUM_PIECES\n};\n\n", prefix);
+
+  fprintf(fp,
+          "extern const struct %s_SpriteSheetPiece\n"
+          "%s_SpriteSheetPieces[%s_NUM_PIECES];\n\n"
+          "const struct %s_SpriteSheetPiece *\n"
+          "%s_SpriteSheetData(int which);\n\n"
+          "/**\n"
+          " * Returns the id for the name, or -1 if there's no such piece.\n"
+          " */\n"
+          "int\n"
+          "%s_SpriteSheetLookup(const char *name);\n\n"
+          "#endif\n",
+          prefix, prefix, prefix, prefix, prefix, prefix);
+
+  return close_checked(fp);
+}
+
+static int
+emit_source(const char *filename,
+            const char *header_name,
+            const char *prefix,
+            const char **names,
+            const struct RegionInfo *regions,
+            int n,
+            const struct PerfectHash *ph)
+{
+  FILE *fp = fopen(filename, "w");
+  return_if(!fp, CGEN_FAIL_LIBC);
+
+  fprintf(fp,
+          "/* Generated by imgpacker. Do not edit. */\n\n"
+          "#include <stdint.h>\n"
+          "#include <string.h>\n\n"
+          "#include \"%s\"\n\n"
+          "const struct %s_SpriteSheetPiece\n"
+          "%s_SpriteSheetPieces[%s_NUM_PIECES] = {\n",
+          header_name, prefix, prefix, prefix);
+  for (int i = 0; i < n; i++) {
+    const SDL_Rect *r = &regions[i].rect;
+    fprintf(fp, "  {%d, %d, %d, %d, %s_", r->x, r->y, r->w, r->h, prefix);
+    emit_upper(fp, names[i]);
+    fprintf(fp, ", \"%s\"}%s\n", names[i], i == n-1 ? "" : ",");
+  }
+  fputs("};\n\n", fp);
+
+  fputs("static const int seeds[] = {\n", fp);
+  emit_ints(fp, ph->seeds, n);
+  fputs("};\n\nstatic const int slots[] = {\n", fp);
+  emit_ints(fp, ph->slots, n);
+  fputs("};\n\n", fp);
+
+  fputs(hash_source, fp);
+
+  fprintf(fp,
+          "\n"
+          "const struct %s_SpriteSheetPiece *\n"
+          "%s_SpriteSheetData(int which) {\n"
+          "  return %s_SpriteSheetPieces + which;\n"
+          "}\n\n"
+          "int\n"
+          "%s_SpriteSheetLookup(const char *name) {\n"
+          "  int seed = seeds[seeded_hash(0, name) %% %s_NUM_PIECES];\n"
+          "  int slot = seed < 0\n"
+          "             ? -seed - 1\n"
+          "             : (int) (seeded_hash(seed, name) %% %s_NUM_PIECES);\n"
+          "  int id = slots[slot];\n"
+          "  return strcmp(%s_SpriteSheetPieces[id].name, name) ? -1 : id;\n"
+          "}\n",
+          prefix, prefix, prefix, prefix, prefix, prefix, prefix);
+
+  return close_checked(fp);
+}
+
+int
+cgen_save(const char *basename,
+          const char *prefix,
+          const struct RegionInfo *regions,
+          int num_regions)
+{
+  assert(basename);
+  assert(*basename);
+  assert(prefix);
+  assert(*prefix);
+  assert(regions);
+  assert(num_regions > 0);
+
+  int res = CGEN_FAIL_NO_MEM;
+  struct PerfectHash ph = {0, 0};
+  size_t base_len = strlen(basename);
+  char *header_path = malloc(base_len + 3);
+  char *source_path = malloc(base_len + 3);
+  const char **names = malloc(num_regions * sizeof *names);
+  goto_if(!header_path || !source_path || !names, end);
+
+  sprintf(header_path, "%s.h", basename);
+  sprintf(source_path, "%s.c", basename);
+  const char *header_name = strrchr(header_path, '/');
+  header_name = header_name ? header_name + 1 : header_path;
+
+  size_t strip = common_prefix_len(regions, num_regions);
+  for (int i = 0; i < num_regions; i++) {
+    names[i] = regions[i].img->name + strip;
+  }
+
+  res = check_duplicates(names, num_regions);
+  goto_if(res < 0, end);
+  res = build_perfect_hash(names, num_regions, &ph);
+  goto_if(res < 0, end);
+  res = emit_header(header_path, prefix, names, num_regions);
+  goto_if(res < 0, end);
+  res = emit_source(source_path, header_name, prefix, names, regions,
+                    num_regions, &ph);
+
+end:
+  free(ph.seeds);
+  free(ph.slots);
+  free(header_path);
+  free(source_path);
+  free(names);
+  return res;
+}
+
+const char *
+cgen_strerror(int code) {
+  static char msg[sizeof dup_name + 64];
+  switch (code) {
+    case CGEN_FAIL_LIBC:
+      return strerror(errno);
+    case CGEN_FAIL_NO_MEM:
+      return "Out of memory";
+    case CGEN_FAIL_DUPLICATE:
+      snprintf(msg, sizeof msg, "Duplicated sprite name: %s", dup_name);
+      return msg;
+  }
+  return 0;
+}
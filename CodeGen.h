@@ -0,0 +1,41 @@
+#ifndef CODE_GEN_H
+#define CODE_GEN_H
+
+#include "RegionInfo.h"
+
+enum {
+  CGEN_OK = 0,
+  CGEN_FAIL_LIBC = -1,
+  CGEN_FAIL_NO_MEM = -2,
+  CGEN_FAIL_DUPLICATE = -3
+};
+
+/**
+ * Writes basename.h and basename.c, a C interface to the regions:
+ *
+ *   - struct PREFIX_SpriteSheetPiece {int x, y, w, h; int id;
+ *     const char *name;}
+ *   - an enum with one PREFIX_NAME id per region (in input order), followed
+ *     by PREFIX_NUM_PIECES
+ *   - PREFIX_SpriteSheetPieces, a const table indexed by those ids
+ *   - PREFIX_SpriteSheetData(id), returning a pointer to a table entry
+ *   - PREFIX_SpriteSheetLookup(name), returning the id for a name or -1,
+ *     through a minimal perfect hash computed here (one hash, one probe, one
+ *     strcmp)
+ *
+ * The longest common prefix of the names, up to and including its last '_',
+ * is removed (usually the directories the images came from).
+ *
+ * Names that only differ by case would produce the same enum identifier, so
+ * they are rejected with CGEN_FAIL_DUPLICATE, just like repeated names.
+ */
+int
+cgen_save(const char *basename,
+          const char *prefix,
+          const struct RegionInfo *regions,
+          int num_regions);
+
+const char *
+cgen_strerror(int code);
+
+#endif
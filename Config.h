@@ -2,6 +2,7 @@
 #define CONFIG_H
 
 #include <limits.h>
+#include <stddef.h>
 
 struct Config {
   int w, h;
@@ -9,16 +10,68 @@ struct Config {
   const char *png_out;
   const char *csv_out;
   const char *img_list_in;
+  const char *img_dir_in;
   char repl;
+  int align;
+  int threads;
+  int tex_format;
+  int tex_quality;
+  const char *bin_out;
+  const char *code_out;
+  const char *code_prefix;
+  const char *stats_out;
+  const char *trace_out;
+  const char *batch_in;
+
+  // 0 for no limit.
+  size_t max_memory;
+
+  // Bit s is set for an @sx output (see -s), none for a single one.
+  unsigned scales;
+
+  int shards;
 };
 
 static const char CONFIG_DEFAULT_PNG_OUT[] = "out.png";
 static const char CONFIG_DEFAULT_CSV_OUT[] = "out.csv";
 
 #define CONFIG_DEFAULT_IMG_LIST_IN ((char*)0)
+#define CONFIG_DEFAULT_IMG_DIR_IN ((char*)0)
+#define CONFIG_DEFAULT_BIN_OUT ((char*)0)
+#define CONFIG_DEFAULT_CODE_OUT ((char*)0)
+#define CONFIG_DEFAULT_STATS_OUT ((char*)0)
+#define CONFIG_DEFAULT_TRACE_OUT ((char*)0)
+#define CONFIG_DEFAULT_BATCH_IN ((char*)0)
+#define CONFIG_DEFAULT_MAX_MEMORY ((size_t) 0)
+#define CONFIG_DEFAULT_SCALES 0u
+
+static const char CONFIG_DEFAULT_CODE_PREFIX[] = "Atlas";
 
 enum {
   CONFIG_VERBOSE_FLAG = 1 << 0,
+  CONFIG_EMBED_REGIONS_FLAG = 1 << 1,
+  CONFIG_MIPMAPS_FLAG = 1 << 2,
+  CONFIG_WATCH_FLAG = 1 << 3,
+  CONFIG_DEDUP_FLAG = 1 << 4
+};
+
+/**
+ * Pixel formats for the container (KTX2) image output.
+ */
+enum {
+  CONFIG_TEX_RGBA8,
+  CONFIG_TEX_BC1,
+  CONFIG_TEX_BC3
+};
+
+enum {
+  CONFIG_MAX_SCALE = 31
+};
+
+enum {
+  CONFIG_TEX_QUALITY_FAST,
+  CONFIG_TEX_QUALITY_NORMAL,
+  CONFIG_TEX_QUALITY_HIGH
 };
 
 enum {
@@ -26,14 +79,38 @@ enum {
   CONFIG_DEFAULT_WIDTH = INT_MAX,
   CONFIG_DEFAULT_HEIGHT = INT_MAX,
   CONFIG_DEFAULT_FLAGS = 0,
+
+  // 0 means 4 for block compressed formats and 1 otherwise.
+  CONFIG_DEFAULT_ALIGN = 0,
+
+  // 0 means one thread per online CPU.
+  CONFIG_DEFAULT_THREADS = 0,
+
+  // 1 means the images are packed all together, on one thread.
+  CONFIG_DEFAULT_SHARDS = 1,
+  CONFIG_DEFAULT_TEX_FORMAT = CONFIG_TEX_RGBA8,
+  CONFIG_DEFAULT_TEX_QUALITY = CONFIG_TEX_QUALITY_NORMAL,
   CONFIG_DEFAULT_PNG_OUT_LENGTH = sizeof CONFIG_DEFAULT_PNG_OUT - 1,
   CONFIG_DEFAULT_CSV_OUT_LENGTH = sizeof CONFIG_DEFAULT_CSV_OUT - 1
 };
 
 #define CONFIG_DEFAULT_INIT_CODE { CONFIG_DEFAULT_WIDTH, \
   CONFIG_DEFAULT_HEIGHT, CONFIG_DEFAULT_FLAGS, CONFIG_DEFAULT_PNG_OUT, \
-  CONFIG_DEFAULT_CSV_OUT, CONFIG_DEFAULT_IMG_LIST_IN, CONFIG_DEFAULT_REPL}
+  CONFIG_DEFAULT_CSV_OUT, CONFIG_DEFAULT_IMG_LIST_IN, \
+  CONFIG_DEFAULT_IMG_DIR_IN, CONFIG_DEFAULT_REPL, CONFIG_DEFAULT_ALIGN, \
+  CONFIG_DEFAULT_THREADS, CONFIG_DEFAULT_TEX_FORMAT, \
+  CONFIG_DEFAULT_TEX_QUALITY, CONFIG_DEFAULT_BIN_OUT, \
+  CONFIG_DEFAULT_CODE_OUT, CONFIG_DEFAULT_CODE_PREFIX, \
+  CONFIG_DEFAULT_STATS_OUT, CONFIG_DEFAULT_TRACE_OUT, \
+  CONFIG_DEFAULT_BATCH_IN, CONFIG_DEFAULT_MAX_MEMORY, CONFIG_DEFAULT_SCALES, \
+  CONFIG_DEFAULT_SHARDS}
 
 #define CONFIG_IS_VERBOSE(cfg) (((cfg).flags & CONFIG_VERBOSE_FLAG) != 0)
+#define CONFIG_EMBEDS_REGIONS(cfg) \
+  (((cfg).flags & CONFIG_EMBED_REGIONS_FLAG) != 0)
+#define CONFIG_HAS_MIPMAPS(cfg) (((cfg).flags & CONFIG_MIPMAPS_FLAG) != 0)
+#define CONFIG_WATCHES(cfg) (((cfg).flags & CONFIG_WATCH_FLAG) != 0)
+#define CONFIG_DEDUPS(cfg) (((cfg).flags & CONFIG_DEDUP_FLAG) != 0)
+#define CONFIG_IS_BLOCK_COMPRESSED(cfg) ((cfg).tex_format != CONFIG_TEX_RGBA8)
 
 #endif
@@ -0,0 +1,227 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <SDL2/SDL_image.h>
+
+#include "XFlow.h"
+#include "Decode.h"
+#include "Workers.h"
+#include "Trace.h"
+
+struct DecodeJob {
+  SDL_Surface *atlas;
+  struct RegionInfo *regions;
+  unsigned flags;
+  int failed; // Region index, only accessed through __atomic builtins.
+  char msg[DECODE_MESSAGE_SIZE];
+
+  // Told about each region once it's done, if not null.
+  struct DecodeStream *stream;
+
+  // If not null, region i is decoded into surfs[i] rather than the atlas.
+  SDL_Surface **surfs;
+};
+
+static void
+stream_done(struct DecodeStream *ds, size_t i, int res) {
+  pthread_mutex_lock(&ds->mutex);
+  ds->done[i] = 1;
+  ds->failed |= res < 0;
+  int next = ds->next;
+  while (ds->next < ds->num_regions && ds->done[ds->next]) {
+    ds->next++;
+  }
+  if (ds->next != next || res < 0) {
+    pthread_cond_broadcast(&ds->cond);
+  }
+  pthread_mutex_unlock(&ds->mutex);
+}
+
+static void
+decode_range(void *ctx, size_t begin, size_t end) {
+  struct DecodeJob *job = ctx;
+  for (size_t i = begin; i < end; i++) {
+    const struct RegionInfo *reg = job->regions + i;
+    SDL_Surface *atlas = job->surfs ? job->surfs[i] : job->atlas;
+    struct NamedSurface *img = reg->img;
+    if (img->surf || !img->data) {
+      if (job->stream) {
+        stream_done(job->stream, i, DECODE_OK);
+      }
+      continue;
+    }
+
+    char *pixels = (char*) atlas->pixels +
+                   (size_t) reg->rect.y*atlas->pitch +
+                   (size_t) reg->rect.x*4;
+    uint64_t t = trace_begin();
+    char msg[DECODE_MESSAGE_SIZE];
+    int w, h;
+    int res;
+    if (xpng_read_size(img->data, img->size, &w, &h) == X_PNG_OK) {
+      res = xpng_decode_rgba(img->data, img->size, pixels, atlas->pitch, msg);
+    }
+    else if (xqoi_read_size(img->data, img->size, &w, &h) == X_QOI_OK) {
+      res = xqoi_decode_rgba(img->data, img->size, pixels, atlas->pitch, msg);
+    }
+    else {
+      res = xjpeg_decode_rgba(img->data, img->size, pixels, atlas->pitch,
+                              msg);
+    }
+    if (job->flags & DECODE_FREE_DATA) {
+      free(img->data);
+      img->data = 0;
+    }
+    trace_end("decode_image", img->name, t);
+
+    int none = -1;
+    if (res < 0 && __atomic_compare_exchange_n(&job->failed, &none, i, 0,
+                                               __ATOMIC_RELAXED,
+                                               __ATOMIC_RELAXED))
+    {
+      memcpy(job->msg, msg, sizeof msg);
+    }
+    if (job->stream) {
+      stream_done(job->stream, i, res);
+    }
+  }
+}
+
+int
+decode_regions(SDL_Surface *atlas,
+               struct RegionInfo *regions,
+               int num_regions,
+               unsigned flags,
+               struct DecodeError *err)
+{
+  assert(atlas);
+  assert(regions);
+  assert(err);
+
+  struct DecodeJob job = {atlas, regions, flags, -1, "", 0, 0};
+  workers_parallel_for(num_regions, 1, decode_range, &job);
+  return_if(job.failed < 0, DECODE_OK);
+  err->region = job.failed;
+  memcpy(err->msg, job.msg, sizeof job.msg);
+  return DECODE_FAIL;
+}
+
+int
+decode_into_surfaces(SDL_Surface **surfs,
+                     struct RegionInfo *regions,
+                     int num_regions,
+                     unsigned flags,
+                     struct DecodeError *err)
+{
+  assert(surfs);
+  assert(regions);
+  assert(err);
+
+  struct DecodeJob job = {0, regions, flags, -1, "", 0, surfs};
+  workers_parallel_for(num_regions, 1, decode_range, &job);
+  return_if(job.failed < 0, DECODE_OK);
+  err->region = job.failed;
+  memcpy(err->msg, job.msg, sizeof job.msg);
+  return DECODE_FAIL;
+}
+
+static void *
+run_stream(void *arg) {
+  struct DecodeStream *ds = arg;
+  struct DecodeJob job = {ds->atlas, ds->regions, ds->flags, -1, "", ds, 0};
+  workers_parallel_for(ds->num_regions, 1, decode_range, &job);
+  // The other thread only reads err after joining this one.
+  ds->err.region = job.failed;
+  memcpy(ds->err.msg, job.msg, sizeof job.msg);
+  return 0;
+}
+
+void
+decode_stream_start(struct DecodeStream *ds,
+                    SDL_Surface *atlas,
+                    struct RegionInfo *regions,
+                    int num_regions,
+                    unsigned flags)
+{
+  assert(ds);
+  assert(atlas);
+  assert(regions);
+
+  *ds = (struct DecodeStream) {
+    .atlas = atlas, .regions = regions, .num_regions = num_regions,
+    .flags = flags
+  };
+  ds->done = calloc(num_regions, 1);
+  if (ds->done && pthread_mutex_init(&ds->mutex, 0) == 0) {
+    if (pthread_cond_init(&ds->cond, 0) == 0) {
+      ds->threaded = pthread_create(&ds->thread, 0, run_stream, ds) == 0;
+      if (!ds->threaded) {
+        pthread_cond_destroy(&ds->cond);
+      }
+    }
+    if (!ds->threaded) {
+      pthread_mutex_destroy(&ds->mutex);
+    }
+  }
+  if (!ds->threaded) {
+    int res = decode_regions(atlas, regions, num_regions, flags, &ds->err);
+    if (res == DECODE_OK) {
+      ds->err.region = -1;
+    }
+    ds->failed = res < 0;
+    ds->next = num_regions;
+  }
+}
+
+int
+decode_stream_wait_rows(struct DecodeStream *ds, int rows) {
+  assert(ds);
+
+  return_if(!ds->threaded, ds->failed ? DECODE_FAIL : DECODE_OK);
+  pthread_mutex_lock(&ds->mutex);
+  while (!ds->failed && ds->next < ds->num_regions &&
+         ds->regions[ds->next].rect.y < rows)
+  {
+    pthread_cond_wait(&ds->cond, &ds->mutex);
+  }
+  int failed = ds->failed;
+  pthread_mutex_unlock(&ds->mutex);
+  return failed ? DECODE_FAIL : DECODE_OK;
+}
+
+int
+decode_stream_finish(struct DecodeStream *ds, struct DecodeError *err) {
+  assert(ds);
+  assert(err);
+
+  if (ds->threaded) {
+    pthread_join(ds->thread, 0);
+    pthread_cond_destroy(&ds->cond);
+    pthread_mutex_destroy(&ds->mutex);
+  }
+  free(ds->done);
+  *err = ds->err;
+  return err->region < 0 ? DECODE_OK : DECODE_FAIL;
+}
+
+// IMG_INIT_* flags of the codecs initialized so far.
+static int img_codecs;
+
+SDL_Surface *
+decode_load_surface(SDL_RWops *rw) {
+  assert(rw);
+
+  int codec = IMG_isJPG(rw) ? IMG_INIT_JPG
+              : IMG_isPNG(rw) ? IMG_INIT_PNG
+              : IMG_isTIF(rw) ? IMG_INIT_TIF
+              : 0;
+  if (codec && !(img_codecs & codec)) {
+    if ((IMG_Init(codec) & codec) != codec) {
+      SDL_RWclose(rw);
+      return 0;
+    }
+    img_codecs |= codec;
+  }
+  return IMG_Load_RW(rw, 1);
+}
@@ -0,0 +1,129 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <pthread.h>
+
+#include "RegionInfo.h"
+#include "xPNG.h"
+#include "xJPEG.h"
+#include "xQOI.h"
+
+enum {
+  DECODE_OK = 0,
+  DECODE_FAIL = -1
+};
+
+enum {
+  DECODE_PNG_JPEG_MESSAGE_SIZE =
+    (int) X_PNG_MESSAGE_SIZE > (int) X_JPEG_MESSAGE_SIZE
+    ? X_PNG_MESSAGE_SIZE
+    : X_JPEG_MESSAGE_SIZE,
+  DECODE_MESSAGE_SIZE =
+    (int) DECODE_PNG_JPEG_MESSAGE_SIZE > (int) X_QOI_MESSAGE_SIZE
+    ? DECODE_PNG_JPEG_MESSAGE_SIZE
+    : X_QOI_MESSAGE_SIZE
+};
+
+enum {
+  // The encoded data of each image is freed, and its data set to null, once
+  // it's decoded.
+  DECODE_FREE_DATA = 1
+};
+
+struct DecodeError {
+  int region;
+  char msg[DECODE_MESSAGE_SIZE];
+};
+
+/**
+ * Decodes the images that bin_pack_2d left out (PNG, JPEG or QOI data, no
+ * surface) straight into their regions of the atlas, in parallel since
+ * regions don't overlap.
+ *
+ * On failure, err has the index of a region that couldn't be decoded, and
+ * the decoder's message. Other regions are still decoded.
+ */
+int
+decode_regions(SDL_Surface *atlas,
+               struct RegionInfo *regions,
+               int num_regions,
+               unsigned flags,
+               struct DecodeError *err);
+
+/**
+ * Decodes like decode_regions, but region i into surfs[i] (32 bits RGBA)
+ * rather than into a single atlas: each image gets a surface of its own,
+ * its region usually being at (0, 0) in it.
+ */
+int
+decode_into_surfaces(SDL_Surface **surfs,
+                     struct RegionInfo *regions,
+                     int num_regions,
+                     unsigned flags,
+                     struct DecodeError *err);
+
+/**
+ * Decodes like decode_regions, but in the background, so the atlas can be
+ * written out while it's being decoded: each of its rows can be used as soon
+ * as every region over it is decoded.
+ *
+ * regions must be sorted by rect.y. They're handed out to the workers in that
+ * order, so the rows become final from the top down, and the rows above the
+ * first region not decoded yet are final.
+ */
+struct DecodeStream {
+  SDL_Surface *atlas;
+  struct RegionInfo *regions;
+  int num_regions;
+  unsigned flags;
+
+  // Regions [0, next) are decoded. done flags the ones after, decoded out of
+  // order.
+  unsigned char *done;
+  int next;
+  int failed;
+  int threaded;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  struct DecodeError err;
+};
+
+/**
+ * Never fails: without memory or a thread for the stream, everything is
+ * decoded before returning.
+ */
+void
+decode_stream_start(struct DecodeStream *ds,
+                    SDL_Surface *atlas,
+                    struct RegionInfo *regions,
+                    int num_regions,
+                    unsigned flags);
+
+/**
+ * Waits until rows [0, rows) of the atlas are final. Returns DECODE_FAIL
+ * without waiting further once a region couldn't be decoded.
+ */
+int
+decode_stream_wait_rows(struct DecodeStream *ds, int rows);
+
+/**
+ * Waits for the end of the decoding and frees the stream. Returns like
+ * decode_regions.
+ */
+int
+decode_stream_finish(struct DecodeStream *ds, struct DecodeError *err);
+
+/**
+ * Loads the file read by rw into a new surface with SDL2_image, for formats
+ * other than PNG, JPEG and QOI (or PNG and JPEG files xPNG and xJPEG
+ * refuse). rw is closed.
+ *
+ * Nothing has to be initialized beforehand: the SDL2_image codecs needing it
+ * (JPEG, PNG, TIFF) are initialized on first use. Returns null on failure,
+ * with the reason in IMG_GetError. Calls mustn't overlap.
+ */
+SDL_Surface *
+decode_load_surface(SDL_RWops *rw);
+
+#endif
@@ -0,0 +1,223 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#include "XFlow.h"
+#include "Dedup.h"
+#include "Workers.h"
+#include "Trace.h"
+
+enum {
+  // Images hashed per chunk handed to a worker.
+  HASH_GRAIN = 16
+};
+
+struct Key {
+  uint64_t hash;
+  int w, h;
+
+  // The NamedSurface index, so copies go to the first image, and the
+  // position in imgs.
+  int index;
+  int i;
+};
+
+struct Run {
+  int first, end;
+};
+
+struct DedupJob {
+  struct NamedSurface *const *imgs;
+  struct Key *keys;
+  const struct Run *runs;
+  struct DedupMatch *matches;
+};
+
+/*
+ * The hash folds each row around its middle, and then the rows around the
+ * middle one: pixels at the same distance from the middle of their row (x
+ * and w-1-x) are weighted the same and summed, and so are rows at the same
+ * distance from the middle row (y and h-1-y). Flipping an image only swaps
+ * such pixels or rows, so its hash doesn't change. The row loop is plain 32
+ * bits arithmetic, which compilers vectorize.
+ */
+
+static inline uint32_t
+mix32(uint32_t v) {
+  v ^= v >> 16;
+  v *= 0x7feb352du;
+  v ^= v >> 15;
+  v *= 0x846ca68bu;
+  return v ^ (v >> 16);
+}
+
+static inline uint64_t
+mix64(uint64_t z) {
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline const Uint32 *
+surface_row(const SDL_Surface *surf, int y) {
+  return (const Uint32*) ((const Uint8*) surf->pixels +
+                          (size_t) y*surf->pitch);
+}
+
+static uint32_t
+hash_row(const Uint32 *px, int w) {
+  uint32_t sum = 0;
+  for (int x = 0; x < w; x++) {
+    uint32_t fold = x < w - 1 - x ? x : w - 1 - x;
+    sum += mix32(px[x])*(2*fold + 1);
+  }
+  return sum;
+}
+
+static uint64_t
+hash_surface(const SDL_Surface *surf) {
+  uint64_t sum = 0;
+  for (int y = 0; y < surf->h; y++) {
+    uint64_t fold = y < surf->h - 1 - y ? y : surf->h - 1 - y;
+    sum += mix64(fold << 32 | hash_row(surface_row(surf, y), surf->w));
+  }
+  return sum;
+}
+
+static void
+hash_range(void *ctx, size_t begin, size_t end) {
+  struct DedupJob *job = ctx;
+  for (size_t k = begin; k < end; k++) {
+    struct Key *key = job->keys + k;
+    uint64_t t = trace_begin();
+    key->hash = hash_surface(job->imgs[key->i]->surf);
+    trace_end("hash_image", job->imgs[key->i]->name, t);
+  }
+}
+
+/**
+ * Whether a is b flipped as flip says. Both have the same size.
+ */
+static int
+same_flipped(const SDL_Surface *a, const SDL_Surface *b, int flip) {
+  const int w = a->w;
+  for (int y = 0; y < a->h; y++) {
+    const Uint32 *ra = surface_row(a, y);
+    const Uint32 *rb = surface_row(b, flip & REGION_FLIP_V ? a->h - 1 - y : y);
+    if (!(flip & REGION_FLIP_H)) {
+      return_if(memcmp(ra, rb, (size_t) w*4), 0);
+      continue;
+    }
+    for (int x = 0; x < w; x++) {
+      return_if(ra[x] != rb[w - 1 - x], 0);
+    }
+  }
+  return 1;
+}
+
+/**
+ * Within a run of keys, each image is compared to the earlier ones that are
+ * copies of none, so a copy goes to the first image it's a copy of.
+ */
+static void
+match_range(void *ctx, size_t begin, size_t end) {
+  struct DedupJob *job = ctx;
+  for (size_t r = begin; r < end; r++) {
+    const struct Key *keys = job->keys;
+    const struct Run run = job->runs[r];
+    for (int k = run.first + 1; k < run.end; k++) {
+      struct DedupMatch *match = job->matches + keys[k].i;
+      const SDL_Surface *surf = job->imgs[keys[k].i]->surf;
+      for (int o = run.first; o < k && match->of < 0; o++) {
+        continue_if(job->matches[keys[o].i].of >= 0);
+        const SDL_Surface *orig = job->imgs[keys[o].i]->surf;
+        for (int flip = REGION_FLIP_NONE;
+             flip <= (REGION_FLIP_H | REGION_FLIP_V);
+             flip++)
+        {
+          if (same_flipped(surf, orig, flip)) {
+            *match = (struct DedupMatch) {keys[o].i, flip};
+            break;
+          }
+        }
+      }
+    }
+  }
+}
+
+static int
+cmp_keys(const void *a, const void *b) {
+  const struct Key *k1 = a;
+  const struct Key *k2 = b;
+  if (k1->w != k2->w) {
+    return k1->w < k2->w ? -1 : 1;
+  }
+  if (k1->h != k2->h) {
+    return k1->h < k2->h ? -1 : 1;
+  }
+  if (k1->hash != k2->hash) {
+    return k1->hash < k2->hash ? -1 : 1;
+  }
+  return (k1->index > k2->index) - (k1->index < k2->index);
+}
+
+int
+dedup_find(struct NamedSurface *const *imgs,
+           int num_imgs,
+           struct DedupMatch *matches)
+{
+  assert(imgs);
+  assert(matches);
+  assert(num_imgs > 0);
+
+  struct Key *keys = malloc(num_imgs * sizeof *keys);
+  struct Run *runs = malloc(num_imgs * sizeof *runs);
+  if (!keys || !runs) {
+    free(keys);
+    free(runs);
+    return DEDUP_FAIL_NO_MEM;
+  }
+
+  int num_keys = 0;
+  for (int i = 0; i < num_imgs; i++) {
+    matches[i] = (struct DedupMatch) {-1, REGION_FLIP_NONE};
+    const SDL_Surface *surf = imgs[i]->surf;
+    continue_if(!surf || surf->format->format != SDL_PIXELFORMAT_RGBA32);
+    keys[num_keys++] = (struct Key) {0, surf->w, surf->h, imgs[i]->index, i};
+  }
+  struct DedupJob job = {imgs, keys, runs, matches};
+  workers_parallel_for(num_keys, HASH_GRAIN, hash_range, &job);
+  qsort(keys, num_keys, sizeof *keys, cmp_keys);
+
+  // Runs of keys with the same size and hash. Runs of one are left out.
+  int num_runs = 0;
+  for (int first = 0, end; first < num_keys; first = end) {
+    for (end = first + 1;
+         end < num_keys && keys[end].w == keys[first].w &&
+         keys[end].h == keys[first].h && keys[end].hash == keys[first].hash;
+         end++)
+    {
+    }
+    if (end - first > 1) {
+      runs[num_runs++] = (struct Run) {first, end};
+    }
+  }
+  workers_parallel_for(num_runs, 1, match_range, &job);
+
+  free(keys);
+  free(runs);
+  return DEDUP_OK;
+}
+
+const char *
+dedup_strerror(int code) {
+  switch (code) {
+    case DEDUP_FAIL_NO_MEM:
+      return strerror(errno);
+  }
+  return 0;
+}
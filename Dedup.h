@@ -0,0 +1,40 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "RegionInfo.h"
+
+enum {
+  DEDUP_OK = 0,
+  DEDUP_FAIL_NO_MEM = -1
+};
+
+struct DedupMatch {
+  // Index (into the images given) of the image this one is a copy of, or -1
+  // if it's none's.
+  int of;
+
+  // REGION_FLIP_* flags: this image is imgs[of] flipped that way.
+  int flip;
+};
+
+/**
+ * Finds the images that are copies of another one, as they are or flipped
+ * left to right, top to bottom or both, and sets matches[i] for imgs[i].
+ * Only surfaces in SDL_PIXELFORMAT_RGBA32 are compared, so images without
+ * one are never copies. A copy is always matched to the image with the
+ * smallest index (the NamedSurface field) it's a copy of, which is a copy of
+ * none, so the result doesn't depend on the order of imgs.
+ *
+ * Images are hashed in parallel (see Workers.h), by a hash that doesn't
+ * change when they're flipped, and those with the same size and hash are then
+ * compared pixel by pixel, in each orientation.
+ */
+int
+dedup_find(struct NamedSurface *const *imgs,
+           int num_imgs,
+           struct DedupMatch *matches);
+
+const char *
+dedup_strerror(int code);
+
+#endif
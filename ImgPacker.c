@@ -0,0 +1,193 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#include "XFlow.h"
+#include "ImgPacker.h"
+#include "RegionInfo.h"
+#include "BinPack2D.h"
+#include "Decode.h"
+#include "Workers.h"
+#include "AU.h"
+
+enum {
+  ARENA_BLOCK_SIZE = 64 << 10
+};
+
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+#define RMASK 0xff000000
+#define GMASK 0x00ff0000
+#define BMASK 0x0000ff00
+#define AMASK 0x000000ff
+#else
+#define RMASK 0x000000ff
+#define GMASK 0x0000ff00
+#define BMASK 0x00ff0000
+#define AMASK 0xff000000
+#endif
+
+/**
+ * Sets img up for input. Surfaces made here are freed by the caller, even on
+ * failure.
+ */
+static int
+setup_img(struct NamedSurface *img, const struct ImgPackerInput *in) {
+  if (in->pixels) {
+    return_if(in->w <= 0 || in->h <= 0, IMGPACKER_FAIL_INVALID);
+    return_if(in->w > INT_MAX/4 || in->pitch < (size_t) in->w*4 ||
+              in->pitch > INT_MAX, IMGPACKER_FAIL_INVALID);
+    // The surface only wraps the input, which is never written to.
+    img->surf = SDL_CreateRGBSurfaceFrom((void*) in->pixels, in->w, in->h,
+                                         32, in->pitch,
+                                         RMASK, GMASK, BMASK, AMASK);
+    return_if(!img->surf, IMGPACKER_FAIL_SDL);
+  }
+  else if (xpng_read_size(in->data, in->size, &img->w, &img->h) == X_PNG_OK ||
+           xqoi_read_size(in->data, in->size, &img->w, &img->h) == X_QOI_OK ||
+           xjpeg_read_size(in->data, in->size, &img->w, &img->h) == X_JPEG_OK)
+  {
+    img->data = (void*) in->data;
+    img->size = in->size;
+    return IMGPACKER_OK;
+  }
+  else {
+    return_if(in->size > INT_MAX, IMGPACKER_FAIL_INVALID);
+    SDL_RWops *rw = SDL_RWFromConstMem(in->data, in->size);
+    return_if(!rw, IMGPACKER_FAIL_SDL);
+    img->surf = decode_load_surface(rw);
+    return_if(!img->surf, IMGPACKER_FAIL_SDL);
+  }
+  img->w = img->surf->w;
+  img->h = img->surf->h;
+  return IMGPACKER_OK;
+}
+
+static int
+pack(const struct ImgPackerInput *inputs,
+     int num_inputs,
+     struct ImgPackerOptions opts,
+     struct ImgPackerAtlas *atlas,
+     struct NamedSurface *imgs,
+     AU_Arena *arena)
+{
+  for (int i = 0; i < num_inputs; i++) {
+    const struct ImgPackerInput *in = inputs + i;
+    return_if(!in->pixels && !in->data, IMGPACKER_FAIL_INVALID);
+    imgs[i] = (struct NamedSurface) {0, 0, 0, in->name, i, 0, 0};
+    int res = setup_img(imgs + i, in);
+    return_if(res < 0, res);
+  }
+
+  struct BinPack2DResult bp2d = bin_pack_2d(imgs, num_inputs,
+    (struct BinPack2DOptions) {opts.w, opts.h, opts.align, arena,
+                               opts.shards});
+  switch (bp2d.attempt) {
+    case ATTEMPT_NO_MEM:
+      return IMGPACKER_FAIL_NO_MEM;
+    case ATTEMPT_NO_SURFACE:
+      return IMGPACKER_FAIL_SDL;
+    case ATTEMPT_TOO_LARGE:
+      return IMGPACKER_FAIL_TOO_LARGE;
+  }
+
+  struct DecodeError err;
+  if (decode_regions(bp2d.img, bp2d.regions, num_inputs, 0, &err) < 0) {
+    atlas_free(bp2d.img);
+    atlas->failed_input = bp2d.regions[err.region].img->index;
+    snprintf(atlas->message, sizeof atlas->message, "%s", err.msg);
+    return IMGPACKER_FAIL_DECODE;
+  }
+
+  atlas->regions = malloc(num_inputs * sizeof *atlas->regions);
+  if (!atlas->regions) {
+    atlas_free(bp2d.img);
+    return IMGPACKER_FAIL_NO_MEM;
+  }
+  for (int i = 0; i < num_inputs; i++) {
+    const struct RegionInfo *reg = bp2d.regions + i;
+    int index = reg->img->index;
+    atlas->regions[index] = (struct ImgPackerRegion) {
+      reg->rect.x, reg->rect.y, reg->rect.w, reg->rect.h, index, reg->img->name
+    };
+  }
+  atlas->num_regions = num_inputs;
+  atlas->pixels = bp2d.img->pixels;
+  atlas->w = bp2d.img->w;
+  atlas->h = bp2d.img->h;
+  atlas->pitch = bp2d.img->pitch;
+  atlas->internal = bp2d.img;
+  return IMGPACKER_OK;
+}
+
+int
+imgpacker_pack(const struct ImgPackerInput *inputs,
+               int num_inputs,
+               struct ImgPackerOptions opts,
+               struct ImgPackerAtlas *atlas)
+{
+  assert(inputs);
+  assert(atlas);
+
+  memset(atlas, 0, sizeof *atlas);
+  atlas->failed_input = -1;
+  return_if(num_inputs <= 0 || opts.w <= 0 || opts.h <= 0 ||
+            opts.align < 0 || opts.threads < 0, IMGPACKER_FAIL_INVALID);
+  return_if((size_t) num_inputs > SIZE_MAX/sizeof (struct NamedSurface),
+            IMGPACKER_FAIL_NO_MEM);
+  if (opts.align == 0) {
+    opts.align = 1;
+  }
+  if (opts.threads > 0) {
+    workers_set_count(opts.threads);
+  }
+
+  // Images and the packer's regions only live through the call.
+  AU_Arena arena;
+  return_if(AU_AR_Setup(&arena, ARENA_BLOCK_SIZE, 0) < 0,
+            IMGPACKER_FAIL_NO_MEM);
+  struct NamedSurface *imgs = AU_AR_Alloc(&arena,
+                                          num_inputs * sizeof *imgs);
+  int res = IMGPACKER_FAIL_NO_MEM;
+  if (imgs) {
+    memset(imgs, 0, num_inputs * sizeof *imgs);
+    res = pack(inputs, num_inputs, opts, atlas, imgs, &arena);
+    for (int i = 0; i < num_inputs; i++) {
+      if (imgs[i].surf) {
+        SDL_FreeSurface(imgs[i].surf);
+      }
+    }
+  }
+  AU_AR_Destroy(&arena);
+  return res;
+}
+
+void
+imgpacker_free(struct ImgPackerAtlas *atlas) {
+  assert(atlas);
+  atlas_free(atlas->internal);
+  free(atlas->regions);
+  memset(atlas, 0, sizeof *atlas);
+}
+
+const char *
+imgpacker_strerror(int code) {
+  switch (code) {
+    case IMGPACKER_FAIL_NO_MEM:
+      return strerror(ENOMEM);
+    case IMGPACKER_FAIL_SDL:
+      return SDL_GetError();
+    case IMGPACKER_FAIL_DECODE:
+      return "Image couldn't be decoded";
+    case IMGPACKER_FAIL_INVALID:
+      return "Invalid input or options";
+    case IMGPACKER_FAIL_TOO_LARGE:
+      return "Images don't fit in the largest atlas";
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+#ifndef IMG_PACKER_H
+#define IMG_PACKER_H
+
+#include <stddef.h>
+
+/*
+ * libimgpacker: packs images held in memory into an atlas held in memory.
+ * Nothing is read from or written to disk, and errors are returned rather
+ * than ending the process.
+ *
+ * Build it with "make lib", which gives libimgpacker.a and libimgpacker.so.
+ * Programs linking it also need SDL2, SDL2_image, libpng, libjpeg and
+ * pthreads, like the imgpacker program.
+ */
+
+enum {
+  IMGPACKER_OK = 0,
+  IMGPACKER_FAIL_NO_MEM = -1,
+  IMGPACKER_FAIL_SDL = -2,
+  IMGPACKER_FAIL_DECODE = -3,
+  IMGPACKER_FAIL_INVALID = -4,
+  IMGPACKER_FAIL_TOO_LARGE = -5
+};
+
+enum {
+  IMGPACKER_MESSAGE_SIZE = 200
+};
+
+/**
+ * One image, either as RGBA8 pixels (bytes in R, G, B, A order) or as an
+ * encoded file: PNG, JPEG and QOI are decoded straight into the atlas, any
+ * other format SDL2_image knows goes through an intermediate surface.
+ *
+ * If pixels isn't null, it's used along with w, h and pitch (in bytes).
+ * Otherwise data and size are. Neither is modified or kept after the call.
+ */
+struct ImgPackerInput {
+  const void *pixels;
+  int w, h;
+  size_t pitch;
+
+  const void *data;
+  size_t size;
+
+  // Optional. Only copied (as a pointer) into the matching region.
+  const char *name;
+};
+
+struct ImgPackerOptions {
+  // Soft limits on the atlas size: it only grows wider than w, or higher than
+  // h, when it can't grow the other way (see BinPack2D.h).
+  int w, h;
+
+  // Regions are placed at multiples of align (0 or 1 for no alignment).
+  int align;
+
+  // Threads used for decoding. 0 keeps the current count, which defaults to
+  // one per online CPU.
+  int threads;
+
+  // Packing shards (see BinPack2D.h). 0 or 1 packs every input together.
+  int shards;
+};
+
+/**
+ * A region of the atlas, for the input with the same index.
+ */
+struct ImgPackerRegion {
+  int x, y, w, h;
+  int index;
+  const char *name;
+};
+
+struct ImgPackerAtlas {
+  // RGBA8, same byte order as the inputs.
+  void *pixels;
+  int w, h;
+  size_t pitch;
+
+  // In input order.
+  struct ImgPackerRegion *regions;
+  int num_regions;
+
+  // On IMGPACKER_FAIL_DECODE, the input that couldn't be decoded and why.
+  int failed_input;
+  char message[IMGPACKER_MESSAGE_SIZE];
+
+  void *internal;
+};
+
+/**
+ * Packs num_inputs images into atlas. On success, atlas has to be freed with
+ * imgpacker_free. On failure, there's nothing to free.
+ *
+ * Calls shouldn't overlap: the thread count and the --stats/--trace
+ * bookkeeping the packer does are process-wide.
+ */
+int
+imgpacker_pack(const struct ImgPackerInput *inputs,
+               int num_inputs,
+               struct ImgPackerOptions opts,
+               struct ImgPackerAtlas *atlas);
+
+void
+imgpacker_free(struct ImgPackerAtlas *atlas);
+
+const char *
+imgpacker_strerror(int code);
+
+#endif
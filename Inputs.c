@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "XFlow.h"
+#include "Inputs.h"
+#include "Workers.h"
+#include "AU.h"
+
+enum {
+  ENTRY_UNKNOWN,
+  ENTRY_DIR,
+  ENTRY_FILE,
+  ENTRY_LINK
+};
+
+enum {
+  EXPECTED_FILES = 256,
+  EXPECTED_CHARS = 16384,
+  STAT_GRAIN = 32
+};
+
+struct Scan {
+  AU_ByteBuilder chars;     // Every path found, NUL terminated.
+  AU_FixedSizeBuilder offs; // Where each path starts in chars.
+  AU_ByteBuilder dir;       // The directory being scanned, '/' terminated.
+};
+
+static const char *image_exts[] = {
+  "png", "qoi", "jpg", "jpeg", "tif", "tiff", "bmp", "gif", "tga", "webp",
+  "pcx", "pnm", "ppm", "pgm", "pbm", "xpm", "lbm"
+};
+
+static int
+is_image_name(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return_if(!dot, 0);
+  dot++;
+  for (size_t i = 0; i < sizeof image_exts / sizeof *image_exts; i++) {
+    const char *ext = image_exts[i];
+    size_t j;
+    for (j = 0; ext[j] && tolower((unsigned char) dot[j]) == ext[j]; j++);
+    return_if(!ext[j] && !dot[j], 1);
+  }
+  return 0;
+}
+
+void
+inputs_from_argv(struct InputList *list, char **argv, int argc) {
+  assert(list);
+  assert(argc >= 0);
+
+  memset(list, 0, sizeof *list);
+  list->paths = argv;
+  list->num = argc;
+}
+
+/**
+ * Reads all of fd into list->chars, making sure the text ends with a line
+ * break.
+ */
+static int
+read_text(struct InputList *list, int fd, size_t *size) {
+  AU_ByteBuilder chars;
+  return_if(AU_B1_Setup(&chars, EXPECTED_CHARS) < 0, INPUTS_FAIL_NO_MEM);
+  list->chars = AU_B1_GetMemory(&chars);
+  for (;;) {
+    char *buf = AU_B1_AppendForSetup(&chars, EXPECTED_CHARS);
+    list->chars = AU_B1_GetMemory(&chars);
+    return_if(!buf, INPUTS_FAIL_NO_MEM);
+    ssize_t n = read(fd, buf, EXPECTED_CHARS);
+    AU_B1_DiscardLastBytes(&chars, EXPECTED_CHARS - (n > 0 ? n : 0));
+    continue_if(n < 0 && errno == EINTR);
+    return_if(n < 0, INPUTS_FAIL_LIBC);
+    break_if(n == 0);
+  }
+  *size = AU_B1_GetUsedCount(&chars);
+  if (*size > 0 && list->chars[*size - 1] != '\n') {
+    return_if(AU_B1_Append(&chars, "\n", 1) < 0, INPUTS_FAIL_NO_MEM);
+    list->chars = AU_B1_GetMemory(&chars);
+    ++*size;
+  }
+  return INPUTS_OK;
+}
+
+int
+inputs_read_manifest(struct InputList *list, const char *filename) {
+  assert(list);
+  assert(filename);
+
+  memset(list, 0, sizeof *list);
+  list->owns_paths = 1;
+
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  return_if(fd < 0, INPUTS_FAIL_LIBC);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return INPUTS_FAIL_LIBC;
+  }
+  char *text = 0;
+  size_t size = 0;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    // Private and writable, so lines can be terminated in place. Only the
+    // pages with a line break get copied.
+    text = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      size = st.st_size;
+      list->map = text;
+      list->map_size = size;
+      posix_madvise(text, size, POSIX_MADV_SEQUENTIAL);
+    }
+  }
+  if (!list->map) {
+    // Pipes and the like have no size to map, so they're read instead.
+    int res = read_text(list, fd, &size);
+    if (res < 0) {
+      close(fd);
+      return res;
+    }
+    text = list->chars;
+  }
+  close(fd);
+
+  AU_FixedSizeBuilder lines;
+  return_if(AU_FSB_Setup(&lines, sizeof (char*), EXPECTED_FILES) < 0,
+            INPUTS_FAIL_NO_MEM);
+  list->paths = AU_FSB_GetMemory(&lines);
+
+  char *end = text + size;
+  for (char *line = text; line < end;) {
+    char *nl = memchr(line, '\n', end - line);
+    char *next = nl ? nl + 1 : end;
+    if (!nl) {
+      // The last line has no line break, and there's no room for the
+      // terminator in the mapping.
+      list->tail = malloc(end - line + 1);
+      return_if(!list->tail, INPUTS_FAIL_NO_MEM);
+      memcpy(list->tail, line, end - line);
+      nl = list->tail + (end - line);
+      line = list->tail;
+    }
+    *nl = 0;
+    if (nl > line && nl[-1] == '\r') {
+      *--nl = 0;
+    }
+    if (nl > line) {
+      return_if(AU_FSB_GetUsedCount(&lines) >= INT_MAX, INPUTS_FAIL_TOO_MANY);
+      int res = AU_FSB_Append(&lines, &line, 1);
+      list->paths = AU_FSB_GetMemory(&lines);
+      return_if(res < 0, INPUTS_FAIL_NO_MEM);
+    }
+    line = next;
+  }
+  list->num = AU_FSB_GetUsedCount(&lines);
+  return INPUTS_OK;
+}
+
+static int
+add_file(struct Scan *s, const char *name) {
+  size_t off = AU_B1_GetUsedCount(&s->chars);
+  size_t dir_len = AU_B1_GetUsedCount(&s->dir);
+  size_t name_len = strlen(name);
+  return_if(AU_FSB_GetUsedCount(&s->offs) >= INT_MAX, INPUTS_FAIL_TOO_MANY);
+  char *path = AU_B1_AppendForSetup(&s->chars, dir_len + name_len + 1);
+  return_if(!path, INPUTS_FAIL_NO_MEM);
+  memcpy(path, AU_B1_GetMemory(&s->dir), dir_len);
+  memcpy(path + dir_len, name, name_len + 1);
+  return_if(AU_FSB_Append(&s->offs, &off, 1) < 0, INPUTS_FAIL_NO_MEM);
+  return INPUTS_OK;
+}
+
+static int
+scan_fd(struct Scan *s, int fd);
+
+static int
+scan_entry(struct Scan *s, int fd, const char *name, int type) {
+  // Hidden files, "." and "..".
+  return_if(name[0] == '.', INPUTS_OK);
+
+  struct stat st;
+  if (type == ENTRY_UNKNOWN) {
+    return_if(fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0,
+              INPUTS_FAIL_LIBC);
+    type = S_ISDIR(st.st_mode) ? ENTRY_DIR
+         : S_ISREG(st.st_mode) ? ENTRY_FILE
+         : S_ISLNK(st.st_mode) ? ENTRY_LINK
+         : ENTRY_UNKNOWN;
+  }
+  if (type == ENTRY_LINK) {
+    // Links to files are followed, but not links to directories, which
+    // could make the scan loop.
+    return_if(fstatat(fd, name, &st, 0) < 0 || !S_ISREG(st.st_mode),
+              INPUTS_OK);
+    type = ENTRY_FILE;
+  }
+
+  if (type == ENTRY_FILE) {
+    return_if(!is_image_name(name), INPUTS_OK);
+    return add_file(s, name);
+  }
+  return_if(type != ENTRY_DIR, INPUTS_OK);
+
+  int sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return_if(sub < 0, INPUTS_FAIL_LIBC);
+  size_t name_len = strlen(name);
+  int res = INPUTS_FAIL_NO_MEM;
+  if (AU_B1_Append(&s->dir, name, name_len) >= 0 &&
+      AU_B1_Append(&s->dir, "/", 1) >= 0)
+  {
+    res = scan_fd(s, sub);
+    AU_B1_DiscardLastBytes(&s->dir, name_len + 1);
+  }
+  close(sub);
+  return res;
+}
+
+#ifdef __linux__
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/*
+ * getdents64 fills a whole buffer of entries per system call, with their
+ * types, where readdir would go through a DIR stream allocated per
+ * directory.
+ */
+static int
+scan_fd(struct Scan *s, int fd) {
+  uint64_t buf[1024];
+  for (;;) {
+    long n = syscall(SYS_getdents64, fd, buf, sizeof buf);
+    return_if(n < 0, INPUTS_FAIL_LIBC);
+    return_if(n == 0, INPUTS_OK);
+    for (long pos = 0; pos < n;) {
+      const struct linux_dirent64 *d =
+        (const struct linux_dirent64*) ((char*) buf + pos);
+      int type = d->d_type == DT_DIR ? ENTRY_DIR
+               : d->d_type == DT_REG ? ENTRY_FILE
+               : d->d_type == DT_LNK ? ENTRY_LINK
+               : d->d_type == DT_UNKNOWN ? ENTRY_UNKNOWN
+               : -1;
+      pos += d->d_reclen;
+      continue_if(type < 0);
+      int res = scan_entry(s, fd, d->d_name, type);
+      return_if(res < 0, res);
+    }
+  }
+}
+
+#else
+
+static int
+scan_fd(struct Scan *s, int fd) {
+  // closedir would close fd, which belongs to the caller.
+  int fd2 = dup(fd);
+  return_if(fd2 < 0, INPUTS_FAIL_LIBC);
+  DIR *dir = fdopendir(fd2);
+  if (!dir) {
+    close(fd2);
+    return INPUTS_FAIL_LIBC;
+  }
+  int res = INPUTS_OK;
+  struct dirent *d;
+  errno = 0;
+  while (res == INPUTS_OK && (d = readdir(dir))) {
+    res = scan_entry(s, fd, d->d_name, ENTRY_UNKNOWN);
+  }
+  if (res == INPUTS_OK && errno) {
+    res = INPUTS_FAIL_LIBC;
+  }
+  closedir(dir);
+  return res;
+}
+
+#endif
+
+static int
+cmp_paths(const void *a, const void *b) {
+  return strcmp(*(char *const*) a, *(char *const*) b);
+}
+
+int
+inputs_scan_dir(struct InputList *list, const char *dir) {
+  assert(list);
+  assert(dir);
+  assert(*dir);
+
+  memset(list, 0, sizeof *list);
+  list->owns_paths = 1;
+
+  struct Scan s;
+  return_if(AU_B1_Setup(&s.chars, EXPECTED_CHARS) < 0, INPUTS_FAIL_NO_MEM);
+  list->chars = AU_B1_GetMemory(&s.chars);
+  int res = INPUTS_FAIL_NO_MEM;
+  goto_if(AU_FSB_Setup(&s.offs, sizeof (size_t), EXPECTED_FILES) < 0, end);
+  if (AU_B1_Setup(&s.dir, PATH_MAX) < 0) {
+    free(AU_FSB_GetMemory(&s.offs));
+    goto end;
+  }
+
+  size_t dir_len = strlen(dir);
+  if (AU_B1_Append(&s.dir, dir, dir_len) >= 0 &&
+      (dir[dir_len-1] == '/' || AU_B1_Append(&s.dir, "/", 1) >= 0))
+  {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    res = INPUTS_FAIL_LIBC;
+    if (fd >= 0) {
+      res = scan_fd(&s, fd);
+      close(fd);
+    }
+  }
+  list->chars = AU_B1_GetMemory(&s.chars);
+
+  // Pointers into chars can only be made once it stops moving.
+  size_t num = AU_FSB_GetUsedCount(&s.offs);
+  if (res == INPUTS_OK && num > 0) {
+    list->paths = malloc(num * sizeof (char*));
+    res = INPUTS_FAIL_NO_MEM;
+    if (list->paths) {
+      const size_t *offs = AU_FSB_GetMemory(&s.offs);
+      for (size_t i = 0; i < num; i++) {
+        list->paths[i] = list->chars + offs[i];
+      }
+      qsort(list->paths, num, sizeof (char*), cmp_paths);
+      list->num = num;
+      res = INPUTS_OK;
+    }
+  }
+  free(AU_B1_GetMemory(&s.dir));
+  free(AU_FSB_GetMemory(&s.offs));
+end:
+  return res;
+}
+
+struct StatKey {
+  uint64_t dev, ino;
+  int index;
+};
+
+static void
+stat_range(void *ctx, size_t begin, size_t end) {
+  struct InputList *list = ctx;
+  for (size_t i = begin; i < end; i++) {
+    struct stat st;
+    struct InputStat *is = list->stats + i;
+    if (stat(list->paths[i], &st) < 0) {
+      *is = (struct InputStat) {UINT64_MAX, UINT64_MAX, -1};
+    }
+    else {
+      *is = (struct InputStat) {st.st_dev, st.st_ino, st.st_size};
+    }
+  }
+}
+
+static int
+cmp_stat_keys(const void *a, const void *b) {
+  const struct StatKey *k1 = a;
+  const struct StatKey *k2 = b;
+  if (k1->dev != k2->dev) {
+    return k1->dev < k2->dev ? -1 : 1;
+  }
+  if (k1->ino != k2->ino) {
+    return k1->ino < k2->ino ? -1 : 1;
+  }
+  return k1->index < k2->index ? -1 : k1->index > k2->index;
+}
+
+int
+inputs_plan(struct InputList *list) {
+  assert(list);
+  assert(list->num > 0);
+
+  const size_t num = list->num;
+  list->order = malloc(num * sizeof *list->order);
+  list->stats = malloc(num * sizeof *list->stats);
+  struct StatKey *keys = malloc(num * sizeof *keys);
+  if (!list->order || !list->stats || !keys) {
+    free(keys);
+    return INPUTS_FAIL_NO_MEM;
+  }
+
+  // Mostly waiting on the file system, so it pays off even on one CPU when
+  // the metadata isn't cached.
+  workers_parallel_for(num, STAT_GRAIN, stat_range, list);
+
+  for (size_t i = 0; i < num; i++) {
+    keys[i] = (struct StatKey) {list->stats[i].dev, list->stats[i].ino, i};
+  }
+  qsort(keys, num, sizeof *keys, cmp_stat_keys);
+  for (size_t i = 0; i < num; i++) {
+    list->order[i] = keys[i].index;
+  }
+  free(keys);
+  return INPUTS_OK;
+}
+
+void
+inputs_free(struct InputList *list) {
+  assert(list);
+
+  if (list->owns_paths) {
+    free(list->paths);
+  }
+  if (list->map) {
+    munmap(list->map, list->map_size);
+  }
+  free(list->chars);
+  free(list->tail);
+  free(list->order);
+  free(list->stats);
+  memset(list, 0, sizeof *list);
+}
+
+const char *
+inputs_strerror(int code) {
+  switch (code) {
+    case INPUTS_FAIL_LIBC:
+      return strerror(errno);
+    case INPUTS_FAIL_NO_MEM:
+      return "Out of memory";
+    case INPUTS_FAIL_TOO_MANY:
+      return "Too many input files";
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef INPUTS_H
+#define INPUTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  INPUTS_OK = 0,
+  INPUTS_FAIL_LIBC = -1,
+  INPUTS_FAIL_NO_MEM = -2,
+  INPUTS_FAIL_TOO_MANY = -3
+};
+
+struct InputStat {
+  uint64_t dev, ino;
+
+  // -1 if the file couldn't be stat'ed.
+  int64_t size;
+};
+
+/**
+ * The list of input image files. Only paths, num, order and stats are meant
+ * to be read by users. The rest is bookkeeping for inputs_free.
+ */
+struct InputList {
+  char **paths;
+  int num;
+
+  // Set by inputs_plan. order is a permutation of [0, num) telling in which
+  // order the files should be read. stats is indexed like paths.
+  int *order;
+  struct InputStat *stats;
+
+  int owns_paths;
+  void *map;
+  size_t map_size;
+  char *chars;
+  char *tail;
+};
+
+/**
+ * The list is made of argv's strings, which are not copied.
+ */
+void
+inputs_from_argv(struct InputList *list, char **argv, int argc);
+
+/**
+ * Reads a list of files, one per line. A regular file is mmap'd privately and
+ * split in place, so lines are never copied; anything else (a pipe, say) is
+ * read into memory first. Empty lines are skipped and "\r\n" line endings are
+ * accepted.
+ */
+int
+inputs_read_manifest(struct InputList *list, const char *filename);
+
+/**
+ * Recursively scans dir for image files (by extension), skipping hidden
+ * entries. On Linux, directories are read with openat and getdents64, so the
+ * file type usually comes with the entry and no stat is needed. The list is
+ * sorted by path, so the outputs don't depend on the directory order.
+ */
+int
+inputs_scan_dir(struct InputList *list, const char *dir);
+
+/**
+ * Stats every file (in parallel, see Workers.h) and computes a read order by
+ * device and inode number, which follows the physical layout of most file
+ * systems closely enough to cut seeks on spinning or network backed disks.
+ */
+int
+inputs_plan(struct InputList *list);
+
+void
+inputs_free(struct InputList *list);
+
+const char *
+inputs_strerror(int code);
+
+#endif
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <SDL2/SDL.h>
@@ -14,9 +15,38 @@
 #include "Config.h"
 #include "RegionInfo.h"
 #include "BinPack2D.h"
+#include "Atlas.h"
 #include "xPNG.h"
+#include "xJPEG.h"
+#include "xQOI.h"
+#include "xKTX.h"
+#include "BlockComp.h"
+#include "Workers.h"
+#include "Mipmap.h"
+#include "RegionTable.h"
+#include "CodeGen.h"
+#include "Inputs.h"
+#include "ReadAhead.h"
+#include "Decode.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Watch.h"
+#include "Batch.h"
+#include "Dedup.h"
 #include "AU.h"
 
+enum {
+  // How many input files, and about how many bytes of them, are read ahead
+  // of the decoding.
+  READ_AHEAD_FILES = 64,
+  READ_AHEAD_BYTES = 256 << 20
+};
+
+enum {
+  // Names, images and regions take a bit over 100 bytes per input.
+  ARENA_BLOCK_SIZE = 2 << 20
+};
+
 enum {
   PINT_EMPTY_INPUT = -1,
   PINT_INVALID_INPUT = -2,
@@ -27,9 +57,75 @@ enum {
 static struct Config cfg = CONFIG_DEFAULT_INIT_CODE;
 static int num_imgs, loaded;
 static struct NamedSurface *imgs;
-static char **files;
+
+/*
+ * Everything living as long as the run: imgs, their names and bp2d.regions.
+ */
+static AU_Arena arena;
+static struct InputList inputs;
+static struct ReadAhead rda;
+static struct Watch watch;
 static struct BinPack2DResult bp2d;
 
+/*
+ * Watch mode: the rectangles the regions were packed with, indexed like
+ * bp2d.regions. A changed image goes back into its slot whenever it fits it,
+ * even if the image was drawn smaller in between.
+ */
+static SDL_Rect *slots;
+
+/*
+ * With -u, the images that are copies of others (maybe flipped) are moved
+ * after the first num_packed ones, and left out of the packing. The image
+ * imgs[num_packed + i] is a copy of the input copies[i].of, flipped as
+ * copies[i].flip says, and gets its region. Without -u, num_packed is
+ * num_imgs.
+ */
+static int num_packed;
+static struct DedupMatch *copies;
+
+/*
+ * mips[0] is bp2d.img. Only the other levels are owned here.
+ */
+static SDL_Surface *mips[MIP_MAX_LEVELS];
+static int num_mips;
+
+/*
+ * Set when imgpack wrote the image output while decoding the atlas, so output
+ * doesn't write it again.
+ */
+static int image_written;
+
+/*
+ * Batch mode: the atlases of the manifest, each with its cfg and inputs
+ * (moved into the globals while it's built), and the block being read or
+ * built, for error messages.
+ */
+struct BatchAtlas {
+  struct Config cfg;
+  struct InputList inputs;
+};
+
+static struct Batch batch;
+static struct BatchAtlas *atlases;
+static int num_atlases;
+static const struct BatchBlock *block;
+
+/*
+ * Files used more than once in a batch, by device and inode number (so two
+ * paths to the same file are the same file), sorted by those. They're decoded
+ * once into surf, which the images of every atlas using them borrow. refs
+ * counts the uses left.
+ */
+struct SharedImg {
+  uint64_t dev, ino;
+  int refs;
+  SDL_Surface *surf;
+};
+
+static struct SharedImg *shared;
+static int num_shared;
+
 /**
  * Parse positive int.
  */
@@ -44,26 +140,208 @@ parse_pint(const char *text, int *out) {
   return PINT_SUCCESS;
 }
 
+/**
+ * Parse a positive size in bytes, with an optional K, M or G suffix (powers
+ * of 1024).
+ */
+static int
+parse_size(const char *text, size_t *out) {
+  return_if(!text || !*text, PINT_EMPTY_INPUT);
+  return_if(!isdigit((unsigned char) *text), PINT_INVALID_INPUT);
+  char *e;
+  errno = 0;
+  unsigned long long size = strtoull(text, &e, 10);
+  int shift = 0;
+  switch (*e) {
+    case 'K': shift = 10; e++; break;
+    case 'M': shift = 20; e++; break;
+    case 'G': shift = 30; e++; break;
+  }
+  return_if(*e, PINT_INVALID_INPUT);
+  return_if(errno || size == 0 || size > SIZE_MAX >> shift,
+            PINT_OVERFLOW_INPUT);
+  *out = (size_t) size << shift;
+  return PINT_SUCCESS;
+}
+
+/**
+ * Parse the -t argument: FORMAT[:PRESET].
+ */
+static int
+parse_tex_format(const char *text) {
+  static const char *formats[] = {"rgba8", "bc1", "bc3"};
+  static const int format_values[] = {
+    CONFIG_TEX_RGBA8, CONFIG_TEX_BC1, CONFIG_TEX_BC3
+  };
+  static const char *presets[] = {"fast", "normal", "high"};
+  static const int preset_values[] = {
+    CONFIG_TEX_QUALITY_FAST, CONFIG_TEX_QUALITY_NORMAL,
+    CONFIG_TEX_QUALITY_HIGH
+  };
+  enum {
+    NUM_FORMATS = sizeof formats / sizeof *formats,
+    NUM_PRESETS = sizeof presets / sizeof *presets
+  };
+
+  const char *colon = strchr(text, ':');
+  size_t len = colon ? (size_t) (colon - text) : strlen(text);
+  int i;
+  for (i = 0; i < NUM_FORMATS; i++) {
+    break_if(strlen(formats[i]) == len && !strncmp(formats[i], text, len));
+  }
+  return_if(i == NUM_FORMATS, -1);
+  cfg.tex_format = format_values[i];
+  if (colon) {
+    for (i = 0; i < NUM_PRESETS; i++) {
+      break_if(!strcmp(presets[i], colon+1));
+    }
+    return_if(i == NUM_PRESETS, -1);
+    cfg.tex_quality = preset_values[i];
+  }
+  return 0;
+}
+
+/**
+ * Parse the -s argument: comma separated scales, from 1 to CONFIG_MAX_SCALE,
+ * into a bit set.
+ */
+static int
+parse_scales(const char *text, unsigned *out) {
+  return_if(!text || !*text, PINT_EMPTY_INPUT);
+  unsigned scales = 0;
+  for (;;) {
+    return_if(!isdigit((unsigned char) *text), PINT_INVALID_INPUT);
+    char *e;
+    long scale = strtol(text, &e, 10);
+    return_if(scale <= 0 || scale > CONFIG_MAX_SCALE, PINT_OVERFLOW_INPUT);
+    scales |= 1u << scale;
+    break_if(!*e);
+    return_if(*e != ',', PINT_INVALID_INPUT);
+    text = e + 1;
+  }
+  *out = scales;
+  return PINT_SUCCESS;
+}
+
+/**
+ * The largest scale in a -s bit set, 0 if there's none.
+ */
+static int
+top_scale(unsigned scales) {
+  int top = 0;
+  for (; scales >>= 1; top++);
+  return top;
+}
+
+static int
+gcd(int a, int b) {
+  while (b) {
+    int r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+static int
+is_identifier(const char *text) {
+  return_if(!isalpha((unsigned char) *text) && *text != '_', 0);
+  for (; *text; text++) {
+    return_if(!isalnum((unsigned char) *text) && *text != '_', 0);
+  }
+  return 1;
+}
+
+static int
+has_extension(const char *filename, const char *ext) {
+  size_t len = strlen(filename);
+  size_t ext_len = strlen(ext);
+  return_if(len < ext_len, 0);
+  filename += len - ext_len;
+  for (size_t i = 0; i < ext_len; i++) {
+    return_if(tolower((unsigned char) filename[i]) != ext[i], 0);
+  }
+  return 1;
+}
+
+static int
+cmp_shared_img(const void *a, const void *b) {
+  const struct SharedImg *s1 = a;
+  const struct SharedImg *s2 = b;
+  if (s1->dev != s2->dev) {
+    return s1->dev < s2->dev ? -1 : 1;
+  }
+  return (s1->ino > s2->ino) - (s1->ino < s2->ino);
+}
+
+/**
+ * The shared file the i-th input is, if any.
+ */
+static struct SharedImg *
+find_shared(int i) {
+  return_if(num_shared == 0 || inputs.stats[i].size < 0, 0);
+  struct SharedImg key = {inputs.stats[i].dev, inputs.stats[i].ino, 0, 0};
+  return bsearch(&key, shared, num_shared, sizeof *shared, cmp_shared_img);
+}
+
+/**
+ * Whether img borrows its surface from a file used by several atlases.
+ */
+static int
+borrows_surf(const struct NamedSurface *img) {
+  const struct SharedImg *sh = find_shared(img->index);
+  return sh && sh->surf && sh->surf == img->surf;
+}
+
+/**
+ * Takes the shared surfaces back from the loaded images, freeing those no
+ * atlas uses anymore.
+ */
+static void
+detach_shared(void) {
+  for (int i = 0; i < loaded && num_shared > 0; i++) {
+    struct NamedSurface *img = imgs + i;
+    continue_if(!img->surf);
+    struct SharedImg *sh = find_shared(img->index);
+    continue_if(!sh || sh->surf != img->surf);
+    img->surf = 0;
+    if (--sh->refs == 0) {
+      atlas_release(sh->surf);
+      sh->surf = 0;
+    }
+  }
+}
+
+static void
+free_batch(void) {
+  for (int i = 0; i < num_shared; i++) {
+    atlas_release(shared[i].surf);
+  }
+  free(shared);
+  for (int i = 0; i < num_atlases; i++) {
+    inputs_free(&atlases[i].inputs);
+  }
+  free(atlases);
+  batch_free(&batch);
+}
+
 static void
 cleanup(void) {
+  rda_stop(&rda);
+  watch_stop(&watch);
+  trace_free();
+  detach_shared();
   for (int i = 0; i < loaded; i++) {
-    SDL_FreeSurface(imgs[i].surf);
-    // The cast is to indicate to the compiler that we really mean to
-    // discard the const qualifier.
-    free((void*) imgs[i].name);
-  }
-  free(imgs);
-  free(bp2d.regions);
-  if(bp2d.img) {
-    SDL_FreeSurface(bp2d.img);
-  }
-  if (cfg.img_list_in) {
-    /*
-     * The memory allocated by the AU_ByteBuilder in the call to
-     * read_files_list.
-     */
-    free(*files);
+    atlas_release(imgs[i].surf);
+    free(imgs[i].data);
   }
+  for (int i = 1; i < num_mips; i++) {
+    SDL_FreeSurface(mips[i]);
+  }
+  atlas_free(bp2d.img);
+  inputs_free(&inputs);
+  free_batch();
+  AU_AR_Destroy(&arena);
   IMG_Quit();
   SDL_Quit();
 }
@@ -71,18 +349,95 @@ cleanup(void) {
 static void
 print_usage(void) {
   fputs("Usage:\n"
-        "imgpacker [-l] [-w WITDH] [-h HEIGHT] [-o PNG_OUT_FILE]\n"
-        "          [-c CSV_OUT_FILE] [-r REPLACEMENT_CHAR] \n"
-        "          (-f IMAGE_LIST_FILE | <input file>+)\n"
+        "imgpacker [-l] [-e] [-m] [-w WITDH] [-h HEIGHT] [-o IMG_OUT_FILE]\n"
+        "          [-c CSV_OUT_FILE] [-b BIN_OUT_FILE] [-r REPLACEMENT_CHAR]\n"
+        "          [-a ALIGN] [-t FORMAT[:PRESET]] [-j THREADS] [-k SHARDS]\n"
+        "          [-g C_OUT_BASENAME] [-p C_PREFIX] [-s SCALES] [-u]\n"
+        "          [--stats STATS_FILE] [--trace TRACE_FILE]\n"
+        "          [--max-memory SIZE] [--watch]\n"
+        "          (-f IMAGE_LIST_FILE | -d IMAGE_DIR | <input file>+ |\n"
+        "           --batch MANIFEST)\n"
         "\n"
-        "* In case no PNG output file is specified, 'out.png' will be used.\n"
-        "* In case no CSV output file is specified, 'out.csv' will be used.\n",
+        "* In case no image output file is specified, 'out.png' will be used.\n"
+        "* An image output file ending in '.ktx2' is written as an\n"
+        "  uncompressed KTX2 container instead of a PNG.\n"
+        "* An image output file ending in '.qoi' is written as QOI, several\n"
+        "  times faster to write and read than PNG, for a slightly larger\n"
+        "  file. QOI inputs are supported too.\n"
+        "* With -e, the regions table is also embedded in the KTX2 container.\n"
+        "* FORMAT is the KTX2 pixel format: rgba8 (default), bc1 or bc3.\n"
+        "  PRESET is the block compression quality: fast, normal (default)\n"
+        "  or high.\n"
+        "* Regions are placed at multiples of ALIGN pixels. It defaults to 4\n"
+        "  for block compressed formats, so no two images share a block.\n"
+        "* THREADS defaults to the number of online CPUs.\n"
+        "* With -k, the images are dealt round-robin, largest first, to\n"
+        "  SHARDS groups that each get about the same mix of sizes. The\n"
+        "  groups are packed in parallel, and then packed together. That is\n"
+        "  much faster with hundreds of thousands of images, for a lower\n"
+        "  occupancy: compare the atlas size and occupancy printed with -v\n"
+        "  (or written with --stats) to those without -k.\n"
+        "* With -m, the whole mip chain is generated. Levels go into the KTX2\n"
+        "  container, or into PNG files named like 'out.1.png', 'out.2.png'.\n"
+        "  Images don't share texels in the first N levels when ALIGN is a\n"
+        "  multiple of 2^N.\n"
+        "* IMAGE_LIST_FILE has one input file per line.\n"
+        "* With -d, the image files (by extension) under IMAGE_DIR and its\n"
+        "  subdirectories are the inputs, in path order. Hidden files and\n"
+        "  directories are skipped.\n"
+        "* In case no CSV output file is specified, 'out.csv' will be used.\n"
+        "* With -b, the regions are also written as a binary table with a\n"
+        "  name hash index, ready to be mmap'd (see RegionTable.h).\n"
+        "* With -g, C_OUT_BASENAME.h and C_OUT_BASENAME.c are generated: an\n"
+        "  enum of sprite ids, a const table of regions and a perfect hash\n"
+        "  lookup by name. Identifiers start with C_PREFIX ('Atlas' by\n"
+        "  default).\n"
+        "* With -s, the inputs are taken at the largest of SCALES (comma\n"
+        "  separated, like '4,2,1', each dividing the largest one), and the\n"
+        "  atlas is packed once and scaled down for the others. Every output\n"
+        "  is written for each scale, named like 'out@2x.png', 'out@2x.csv'.\n"
+        "  ALIGN (4 for block compressed formats) holds at every scale.\n"
+        "* With -u, an image that's the same as an earlier one, or the same\n"
+        "  flipped left to right, top to bottom or both (a 180 degrees\n"
+        "  rotation), isn't packed again: it gets the other one's region, and\n"
+        "  its CSV output line a sixth field, its flip: 0 for none, 1 left to\n"
+        "  right, 2 top to bottom, 3 both. Texture coordinates are meant to\n"
+        "  be flipped that way. Can't be used with -b, -g, -e, --watch or\n"
+        "  --max-memory.\n",
+        stderr);
+  // Split in two, as C99 compilers needn't support longer strings.
+  fputs("* With --stats, the time spent, bytes read and written and pixels\n"
+        "  processed in each phase, the atlas occupancy and the peak memory\n"
+        "  use are written to STATS_FILE as JSON.\n"
+        "* With --trace, spans of work on every thread (file reads, image\n"
+        "  loads, blits, decodes, PNG strips, file writes) are written to\n"
+        "  TRACE_FILE in the Chrome trace event format, for chrome://tracing\n"
+        "  or Perfetto.\n"
+        "* With --max-memory, imgpacker tries to keep its memory use under\n"
+        "  SIZE bytes (K, M and G suffixes allowed; Linux only): files read\n"
+        "  ahead take up to a quarter of SIZE, and decoded images past\n"
+        "  another quarter and atlas pixels past the last half go to a\n"
+        "  scratch file in $TMPDIR (or /tmp), which the kernel can page out.\n"
+        "* With --watch, imgpacker keeps running once the outputs are written\n"
+        "  (Linux only). Input files saved again are reloaded, put back in\n"
+        "  their regions when they still fit (everything is repacked when one\n"
+        "  doesn't) and the outputs are updated. Files added later are not\n"
+        "  picked up.\n"
+        "* With --batch, one atlas is built for each block of MANIFEST.\n"
+        "  Blocks are separated by empty lines. A block's first line has the\n"
+        "  options of its atlas if it starts with '-' (added to those given\n"
+        "  on the command line, long options excepted), and every other line\n"
+        "  is an input file. Lines starting with '#' are comments. Files used\n"
+        "  by several atlases are only decoded once.\n",
         stderr);
 }
 
 static void
 print_err(const char *fmt, va_list params) {
   fputs("Error: ", stderr);
+  if (block) {
+    fprintf(stderr, "%s:%d: ", block->argv[0], block->line);
+  }
   vfprintf(stderr, fmt, params);
   putc('\n', stderr);
 }
@@ -97,6 +452,17 @@ err_exit(const char *fmt, ...) {
   exit(EXIT_FAILURE);
 }
 
+/**
+ * For errors that don't end the run, in watch mode.
+ */
+static void
+report_err(const char *fmt, ...) {
+  va_list params;
+  va_start(params, fmt);
+  print_err(fmt, params);
+  va_end(params);
+}
+
 static void
 uerr_exit(const char *fmt, ...) {
   va_list params;
@@ -126,9 +492,9 @@ dup_adjust_name(const char *name) {
   }
   int len = ulen;
   assert(len+1 <= INT_MAX);
-  char *str = malloc(len+1);
+  char *str = AU_AR_Alloc(&arena, len+1);
   if (!str) {
-    err_exit("libc: %s.", strerror(errno));
+    err_exit("Out of memory.");
   }
   strcpy(str, name);
   for (int i = len-1; i >= 0; i--) {
@@ -146,108 +512,63 @@ dup_adjust_name(const char *name) {
   return str;
 }
 
+/**
+ * Long options: --NAME [VALUE]. Returns argv moved to the last argument used.
+ */
 static char **
-read_files_list(const char *img_list_file, int *out_num_files) {
-  /*
-   * The idea here is to keep two builders around, one for the the chars of
-   * the strings, and another one for the length of the strings. Both builders
-   * keep their data according to the order of the strings being read.
-   *
-   * After reading everything into the buffer, I can build a char** and return
-   * it.
-   */
-
-  enum {
-    INITIAL_BUF_CAP = 8000,
-    EXPECTED_LINES = 100
-  };
-
-  FILE *file = fopen(img_list_file, "r");
-  if (!file) {
-    err_exit("Couldn't open input file: %s\n"
-      "libc: %s", img_list_file, strerror(errno));
+parse_long_opt(char **argv) {
+  const char *opt = *argv;
+  if (block) {
+    uerr_exit("Option not allowed in a batch manifest: %s.", opt);
   }
-
-  AU_ByteBuilder chars_b1;
-  AU_FixedSizeBuilder lens_fsb;
-  char buf[INITIAL_BUF_CAP];
-  size_t len = 0;
-
-  AU_B1_Setup(&chars_b1, INITIAL_BUF_CAP);
-  AU_FSB_Setup(&lens_fsb, sizeof (size_t), EXPECTED_LINES);
-
-  /*
-   * buf[INITIAL_BUF_CAP-2] is initially set to 0, and after each iteration,
-   * it's reset to 0.
-   */
-  buf[INITIAL_BUF_CAP-2] = 0;
-  while (fgets(buf, INITIAL_BUF_CAP, file)) {
-    char candidate_last = buf[INITIAL_BUF_CAP-2];
-
-    if (candidate_last == 0 || candidate_last == '\n') {
-      // Found end of line.
-
-      size_t final_len = strlen(buf);
-      if (buf[final_len-1] == '\n') {
-        buf[final_len-1] = 0;
-        final_len--;
-      }
-      AU_B1_Append(&chars_b1, buf, final_len+1);
-      len += final_len;
-      AU_FSB_Append(&lens_fsb, &len, 1);
-      len = 0;
+  if (!strcmp(opt, "--watch")) {
+    cfg.flags |= CONFIG_WATCH_FLAG;
+  }
+  else if (!strcmp(opt, "--batch")) {
+    cfg.batch_in = *++argv;
+    if (!cfg.batch_in || !*cfg.batch_in) {
+      uerr_exit("Empty string for batch manifest.");
     }
-    else {
-      // Still in the middle of the line.
-
-      AU_B1_Append(&chars_b1, buf, INITIAL_BUF_CAP-1);
-      len += INITIAL_BUF_CAP-1;
+  }
+  else if (!strcmp(opt, "--max-memory")) {
+    argv++;
+    if (parse_size(*argv, &cfg.max_memory) < 0) {
+      uerr_exit("Invalid memory size: '%s'.", *argv ? *argv : "");
     }
-
-    // The reset to 0.
-    buf[INITIAL_BUF_CAP-2] = 0;
   }
-
-  if (ferror(file)) {
-    err_exit("Error while reading the file: %s.\n"
-      "libc: %s.", img_list_file, strerror(errno));
+  else if (!strcmp(opt, "--stats")) {
+    cfg.stats_out = *++argv;
+    if (!cfg.stats_out || !*cfg.stats_out) {
+      uerr_exit("Empty string for stats output.");
+    }
   }
-
-  assert(feof(file));
-
-  const size_t num_lines = AU_FSB_GetUsedCount(&lens_fsb);
-  char **file_names_list = malloc(sizeof (char*) * num_lines);
-  if (!file_names_list) {
-    err_exit("Allocation error.\n"
-      "libc: %s", strerror(errno));
+  else if (!strcmp(opt, "--trace")) {
+    cfg.trace_out = *++argv;
+    if (!cfg.trace_out || !*cfg.trace_out) {
+      uerr_exit("Empty string for trace output.");
+    }
+    trace_enable();
   }
-
-  char *chars_mem = AU_B1_GetMemory(&chars_b1);
-  long *line_lens = AU_FSB_GetMemory(&lens_fsb);
-  for (size_t i = 0; i < num_lines; i++) {
-    file_names_list[i] = chars_mem;
-    chars_mem += *line_lens + 1;
-    line_lens++;
+  else {
+    uerr_exit("Invalid option: %s.", opt);
   }
-  *out_num_files = num_lines;
-
-  assert(file_names_list);
-  assert(file);
-  assert(AU_FSB_GetMemory(&lens_fsb));
-
-  free(AU_FSB_GetMemory(&lens_fsb));
-  fclose(file);
-  return file_names_list;
+  return argv;
 }
 
-static void
-build_cfg(int argc, char **argv) {
-  char **argv_begin = argv;
+/**
+ * Parses the options following argv[0] into cfg. Returns argv moved to the
+ * first argument after them.
+ */
+static char **
+parse_opts(char **argv) {
   for (char *opt = *++argv;
-       opt && *opt == '-' && !opt[2];
+       opt && *opt == '-' && opt[1] && (!opt[2] || opt[1] == '-');
        opt = *++argv)
   {
     switch (opt[1]) {
+      case '-':
+        argv = parse_long_opt(argv);
+        break;
       case 'w':
         argv++;
         if (parse_pint(*argv, &cfg.w) < 0) {
@@ -284,74 +605,358 @@ build_cfg(int argc, char **argv) {
       case 'v':
         cfg.flags |= CONFIG_VERBOSE_FLAG;
         break;
+      case 'e':
+        cfg.flags |= CONFIG_EMBED_REGIONS_FLAG;
+        break;
+      case 'm':
+        cfg.flags |= CONFIG_MIPMAPS_FLAG;
+        break;
+      case 'u':
+        cfg.flags |= CONFIG_DEDUP_FLAG;
+        break;
+      case 'a':
+        argv++;
+        if (parse_pint(*argv, &cfg.align) < 0) {
+          uerr_exit("Invalid alignment value: '%s'.", *argv);
+        }
+        break;
+      case 'j':
+        argv++;
+        if (parse_pint(*argv, &cfg.threads) < 0) {
+          uerr_exit("Invalid threads value: '%s'.", *argv);
+        }
+        break;
+      case 't':
+        argv++;
+        if (!*argv || parse_tex_format(*argv) < 0) {
+          uerr_exit("Invalid texture format: '%s'.", *argv);
+        }
+        break;
       case 'f':
         argv++;
         cfg.img_list_in = *argv;
+        if (!cfg.img_list_in || !*cfg.img_list_in) {
+          uerr_exit("Empty string for image list input.");
+        }
+        break;
+      case 'd':
+        argv++;
+        cfg.img_dir_in = *argv;
+        if (!cfg.img_dir_in || !*cfg.img_dir_in) {
+          uerr_exit("Empty string for image directory input.");
+        }
+        break;
+      case 'g':
+        argv++;
+        cfg.code_out = *argv;
+        if (!cfg.code_out || !*cfg.code_out) {
+          uerr_exit("Empty string for C output.");
+        }
+        break;
+      case 'p':
+        argv++;
+        cfg.code_prefix = *argv;
+        if (!cfg.code_prefix || !is_identifier(cfg.code_prefix)) {
+          uerr_exit("Invalid C prefix: '%s'.", *argv);
+        }
+        break;
+      case 'k':
+        argv++;
+        if (parse_pint(*argv, &cfg.shards) < 0) {
+          uerr_exit("Invalid shards value: '%s'.", *argv);
+        }
+        break;
+      case 's':
+        argv++;
+        if (parse_scales(*argv, &cfg.scales) < 0) {
+          uerr_exit("Invalid scales: '%s'.", *argv ? *argv : "");
+        }
+        break;
+      case 'b':
+        argv++;
+        cfg.bin_out = *argv;
+        if (!cfg.bin_out || !*cfg.bin_out) {
+          uerr_exit("Empty string for binary regions output.");
+        }
         break;
       default:
         uerr_exit("Invalid option: %s.", opt);
         break;
     }
   }
+  return argv;
+}
+
+/**
+ * Settles cfg once every option is known, and lists the inputs: argc files
+ * at argv unless -f or -d was given.
+ */
+static void
+finish_cfg(int argc, char **argv) {
+  if (cfg.align == CONFIG_DEFAULT_ALIGN) {
+    cfg.align = CONFIG_IS_BLOCK_COMPRESSED(cfg) ? BC_BLOCK_DIM : 1;
+  }
+  if (CONFIG_IS_BLOCK_COMPRESSED(cfg) && !has_extension(cfg.png_out, ".ktx2")) {
+    uerr_exit("Block compressed formats need a .ktx2 image output.");
+  }
+  if (cfg.scales) {
+    if (CONFIG_HAS_MIPMAPS(cfg) || CONFIG_WATCHES(cfg)) {
+      uerr_exit("-s can't be used with -m or --watch.");
+    }
+    // Regions start on a multiple of the alignment at every scale (so BC
+    // blocks never straddle two regions): step is the smallest multiple of
+    // every top/s.
+    int top = top_scale(cfg.scales);
+    int step = 1;
+    for (int s = 1; s < top; s++) {
+      continue_if(!(cfg.scales & 1u << s));
+      if (top % s) {
+        uerr_exit("Scale %d doesn't divide the largest one, %d.", s, top);
+      }
+      step = step/gcd(step, top/s)*(top/s);
+    }
+    if (cfg.align > INT_MAX/step) {
+      uerr_exit("Alignment too large for the scales.");
+    }
+    cfg.align *= step;
+  }
+  if (CONFIG_DEDUPS(cfg) && (cfg.bin_out || cfg.code_out ||
+                             CONFIG_EMBEDS_REGIONS(cfg) ||
+                             CONFIG_WATCHES(cfg)))
+  {
+    // Only the CSV output has room for the flips.
+    uerr_exit("-u can't be used with -b, -g, -e or --watch.");
+  }
+  if (CONFIG_DEDUPS(cfg) && cfg.max_memory) {
+    // The images compared are decoded up front, outside of the budget.
+    uerr_exit("-u can't be used with --max-memory.");
+  }
+  workers_set_count(cfg.threads);
 
-  if (cfg.img_list_in) {
-    files = read_files_list(cfg.img_list_in, &num_imgs);
+  stats_begin(STATS_PHASE_INPUTS);
+  int res = INPUTS_OK;
+  if (cfg.img_list_in && cfg.img_dir_in) {
+    uerr_exit("Only one of -f and -d can be given.");
+  }
+  else if (cfg.img_list_in) {
+    res = inputs_read_manifest(&inputs, cfg.img_list_in);
+  }
+  else if (cfg.img_dir_in) {
+    res = inputs_scan_dir(&inputs, cfg.img_dir_in);
   }
   else {
-    files = argv;
-    num_imgs = argc - (argv - argv_begin);
+    inputs_from_argv(&inputs, argv, argc);
+  }
+  if (res < 0) {
+    err_exit("Inputs: %s: %s.",
+             cfg.img_list_in ? cfg.img_list_in : cfg.img_dir_in,
+             inputs_strerror(res));
   }
+  num_imgs = inputs.num;
 
   if (num_imgs == 0) {
     uerr_exit("No input files.");
   }
-  else if (num_imgs < 0) {
-    err_exit("Number of images is invalid: %d.\n", num_imgs);
-  }
 
-  /*
-   * What if num_imgs is too large? Overflow check here is silly, but the value
-   * for num_imgs is out of my control, so it seems like it should be checked.
-   *
-   * Basically, num_imgs needs to be positive and within SIZE_MAX.
-   */
+  res = inputs_plan(&inputs);
+  if (res < 0) {
+    err_exit("Inputs: %s.", inputs_strerror(res));
+  }
+  stats_end(STATS_PHASE_INPUTS);
+  stats_set_counts(num_imgs, workers_get_count());
 
-  assert(files);
+  assert(inputs.paths);
   assert(num_imgs > 0);
 }
 
+static void
+build_cfg(int argc, char **argv) {
+  char **args = parse_opts(argv);
+  if (cfg.batch_in) {
+    // The options given here are the defaults for every atlas.
+    if (*args || cfg.img_list_in || cfg.img_dir_in) {
+      uerr_exit("Inputs go in the manifest with --batch.");
+    }
+    if (CONFIG_WATCHES(cfg)) {
+      uerr_exit("--watch can't be used with --batch.");
+    }
+    return;
+  }
+  finish_cfg(argc - (args - argv), args);
+}
+
+enum {
+  SETUP_IMG_OK = 0,
+  SETUP_IMG_KEEP_DATA = 1,
+  SETUP_IMG_FAIL_TOO_LARGE = -1,
+  SETUP_IMG_FAIL_SDL = -2,
+  SETUP_IMG_FAIL_SDL_IMAGE = -3
+};
+
+/**
+ * Sets img's size, and its surface if the file at data needs one.
+ *
+ * PNG, JPEG and QOI files are only decoded once packed, straight into the atlas
+ * (see decode_into_atlas), so their data has to be kept until then:
+ * SETUP_IMG_KEEP_DATA is returned for them. SDL2_image handles everything
+ * else.
+ */
+static int
+setup_img(struct NamedSurface *img, const void *data, size_t size) {
+  if (xpng_read_size(data, size, &img->w, &img->h) == X_PNG_OK ||
+      xqoi_read_size(data, size, &img->w, &img->h) == X_QOI_OK ||
+      xjpeg_read_size(data, size, &img->w, &img->h) == X_JPEG_OK)
+  {
+    return SETUP_IMG_KEEP_DATA;
+  }
+  return_if(size > INT_MAX, SETUP_IMG_FAIL_TOO_LARGE);
+  SDL_RWops *rw = SDL_RWFromConstMem(data, size);
+  return_if(!rw, SETUP_IMG_FAIL_SDL);
+  img->surf = decode_load_surface(rw);
+  return_if(!img->surf, SETUP_IMG_FAIL_SDL_IMAGE);
+  img->w = img->surf->w;
+  img->h = img->surf->h;
+  return SETUP_IMG_OK;
+}
+
+static const char *
+setup_img_strerror(int code) {
+  static char msg[256];
+  switch (code) {
+    case SETUP_IMG_FAIL_TOO_LARGE:
+      return "File too large";
+    case SETUP_IMG_FAIL_SDL:
+      snprintf(msg, sizeof msg, "SDL2: %s", SDL_GetError());
+      return msg;
+    case SETUP_IMG_FAIL_SDL_IMAGE:
+      snprintf(msg, sizeof msg, "SDL2_image: %s", IMG_GetError());
+      return msg;
+  }
+  return 0;
+}
+
+/**
+ * Makes img, loaded from file, the shared surface of sh. An encoded file kept
+ * for decoding into the atlas is decoded into a surface of its own instead.
+ */
+static void
+share_img(struct SharedImg *sh, struct NamedSurface *img, const char *file) {
+  if (!img->surf) {
+    SDL_Surface *surf = SDL_CreateRGBSurfaceWithFormat(0, img->w, img->h, 32,
+                                                       SDL_PIXELFORMAT_RGBA32);
+    if (!surf) {
+      err_exit("SDL2: %s.", SDL_GetError());
+    }
+    struct RegionInfo reg = {{0, 0, img->w, img->h}, img, REGION_FLIP_NONE};
+    struct DecodeError err;
+    int res = decode_regions(surf, &reg, 1, DECODE_FREE_DATA, &err);
+    img->surf = surf;
+    if (res < 0) {
+      err_exit("Decoding file: %s: %s.", file, err.msg);
+    }
+  }
+  sh->surf = img->surf;
+}
+
 static void
 load_imgs(void) {
   assert(num_imgs > 0);
-  assert(files);
-
-  // What if ((size_t) num_imgs * sizeof (struct NamedSurface)) overflows?
+  assert(inputs.paths);
+  assert(inputs.order);
 
-  imgs = malloc(num_imgs * sizeof (struct NamedSurface));
+  if ((size_t) num_imgs > SIZE_MAX/sizeof (struct NamedSurface)) {
+    err_exit("Out of memory.");
+  }
+  imgs = AU_AR_Alloc(&arena, num_imgs * sizeof (struct NamedSurface));
   if (!imgs) {
-    err_exit("libc: %s.", strerror(errno));
+    err_exit("Out of memory.");
   }
 
+  /*
+   * Files are read in the order given by inputs_plan, but each image keeps
+   * its position in the list as index, so the outputs follow the list.
+   *
+   * Reading happens on the read ahead threads, so only decoding is left here.
+   */
+  stats_begin(STATS_PHASE_LOAD);
+  size_t ahead = READ_AHEAD_BYTES;
+  if (cfg.max_memory && cfg.max_memory/4 < ahead) {
+    ahead = cfg.max_memory/4;
+  }
+  int res = rda_start(&rda, &inputs, READ_AHEAD_FILES, ahead);
+  if (res < 0) {
+    err_exit("ReadAhead: %s.", rda_strerror(res));
+  }
+  int spilled = 0;
   for (loaded = 0; loaded < num_imgs; loaded++) {
-    imgs[loaded].surf = IMG_Load(files[loaded]);
-    if (!imgs[loaded].surf) {
-      err_exit("Loading file: %s: SDL2_image: %s.", files[loaded],
-         IMG_GetError());
+    int i = inputs.order[loaded];
+    const char *file = inputs.paths[i];
+    struct NamedSurface *img = imgs + loaded;
+    const struct RDAFile *data = rda_wait(&rda, loaded);
+    if (data->res < 0) {
+      err_exit("Loading file: %s: %s.", file, rda_strerror(data->res));
     }
-    imgs[loaded].name = dup_adjust_name(files[loaded]);
-    vlog("Loaded %s.\n", files[loaded]);
-    imgs[loaded].index = loaded;
+    stats_add_read(STATS_PHASE_LOAD, data->size);
+    uint64_t t = trace_begin();
+
+    *img = (struct NamedSurface) {0, 0, 0, 0, i, 0, 0};
+    struct SharedImg *sh = find_shared(i);
+    int borrowed = sh && sh->surf;
+    if (borrowed) {
+      img->surf = sh->surf;
+      img->w = sh->surf->w;
+      img->h = sh->surf->h;
+      res = SETUP_IMG_OK;
+    }
+    else {
+      res = setup_img(img, data->data, data->size);
+    }
+    if (res < 0) {
+      err_exit("Loading file: %s: %s.", file, setup_img_strerror(res));
+    }
+    if (res == SETUP_IMG_KEEP_DATA) {
+      img->size = data->size;
+      img->data = rda_take(&rda, loaded);
+    }
+    rda_release(&rda, loaded);
+    if (sh && !borrowed) {
+      share_img(sh, img, file);
+    }
+    // Encoded data waits in memory, to be decoded into the atlas: only
+    // decoded surfaces count against --max-memory (see atlas_hold).
+    if (img->surf && !borrowed) {
+      int spill;
+      SDL_Surface *surf = atlas_hold(img->surf, &spill);
+      if (!surf) {
+        err_exit("Spilling file: %s: %s.", file, SDL_GetError());
+      }
+      img->surf = surf;
+      spilled += spill;
+      if (sh) {
+        sh->surf = surf;
+      }
+    }
+    trace_end("load_image", file, t);
+    stats_add_pixels(STATS_PHASE_LOAD, (uint64_t) img->w*img->h);
+    img->name = dup_adjust_name(file);
+    vlog("Loaded %s.\n", file);
   }
+  rda_stop(&rda);
+  if (spilled) {
+    vlog("Spilled %d images to the scratch file.\n", spilled);
+  }
+  stats_end(STATS_PHASE_LOAD);
 }
 
+/**
+ * No SDL subsystem is initialized: surfaces and blits don't need one, and
+ * SDL2_image codecs are only initialized for the formats found in the inputs
+ * (see decode_load_surface).
+ */
 static void
 init(void) {
-  if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-    err_exit("SDL2: %s.", SDL_GetError());
-  }
-  int img_flags = IMG_INIT_JPG | IMG_INIT_PNG | IMG_INIT_TIF;
-  if ((IMG_Init(img_flags) & img_flags) != img_flags) {
-    err_exit("SDL2_image: %s.", IMG_GetError());
+  if (AU_AR_Setup(&arena, ARENA_BLOCK_SIZE, AU_ARENA_HUGE_PAGES) < 0) {
+    err_exit("Out of memory.");
   }
 }
 
@@ -376,48 +981,1037 @@ regions_csv_output(void) {
   if (!csvf) {
     err_exit("libc: %s.", strerror(errno));
   }
-  // We're going to sort the regions info so we can get them in an order
-  // which reflects the input order.
-
-  qsort(bp2d.regions, num_imgs, sizeof (struct RegionInfo),
-        cmp_region_info_by_named_surface_index);
 
   // check for errors, use ferror
   for (int i = 0; i < num_imgs; i++) {
     struct RegionInfo *reg = bp2d.regions+i;
-    fprintf(csvf, "%s,%d,%d,%d,%d\n", reg->img->name, reg->rect.x,
+    fprintf(csvf, "%s,%d,%d,%d,%d", reg->img->name, reg->rect.x,
       reg->rect.y, reg->rect.w, reg->rect.h);
+    if (CONFIG_DEDUPS(cfg)) {
+      fprintf(csvf, ",%d", reg->flip);
+    }
+    putc('\n', csvf);
   }
   fclose(csvf);
 }
 
+static const int bc_qualities[] = {
+  [CONFIG_TEX_QUALITY_FAST] = BC_QUALITY_FAST,
+  [CONFIG_TEX_QUALITY_NORMAL] = BC_QUALITY_NORMAL,
+  [CONFIG_TEX_QUALITY_HIGH] = BC_QUALITY_HIGH
+};
+
+static int
+config_bc_format(void) {
+  return cfg.tex_format == CONFIG_TEX_BC1 ? BC_FORMAT_BC1 : BC_FORMAT_BC3;
+}
+
 static void
-output(void) {
-  int res = xpng_save_surface(cfg.png_out, bp2d.img);
+ktx_output(void) {
+  const struct RegionInfo *embedded =
+    CONFIG_EMBEDS_REGIONS(cfg) ? bp2d.regions : 0;
+  struct XKTXLevel levels[MIP_MAX_LEVELS];
+  struct XKTXImage ktx = {
+    X_KTX_FORMAT_RGBA8, bp2d.img->w, bp2d.img->h, num_mips, levels
+  };
+  void *blocks = 0;
+
+  if (!CONFIG_IS_BLOCK_COMPRESSED(cfg)) {
+    for (int l = 0; l < num_mips; l++) {
+      levels[l] = (struct XKTXLevel) {
+        mips[l]->pixels, mips[l]->pitch, (size_t) mips[l]->w * 4, mips[l]->h
+      };
+    }
+  }
+  else {
+    int bc_format = config_bc_format();
+    ktx.format = bc_format == BC_FORMAT_BC1
+                 ? X_KTX_FORMAT_BC1
+                 : X_KTX_FORMAT_BC3;
+
+    // All levels share a single allocation.
+    size_t offsets[MIP_MAX_LEVELS];
+    size_t total_size = 0;
+    for (int l = 0; l < num_mips; l++) {
+      size_t row_size = bc_row_size(bc_format, mips[l]->w);
+      int rows = (mips[l]->h + BC_BLOCK_DIM - 1)/BC_BLOCK_DIM;
+      levels[l] = (struct XKTXLevel) {0, row_size, row_size, rows};
+      offsets[l] = total_size;
+      total_size += row_size * rows;
+    }
+    blocks = malloc(total_size);
+    if (!blocks) {
+      err_exit("libc: %s.", strerror(errno));
+    }
+
+    vlog("Encoding %s.\n", cfg.png_out);
+    for (int l = 0; l < num_mips; l++) {
+      char *level_blocks = (char*) blocks + offsets[l];
+      levels[l].data = level_blocks;
+      bc_encode(bc_format, bc_qualities[cfg.tex_quality], mips[l]->pixels,
+                mips[l]->w, mips[l]->h, mips[l]->pitch, level_blocks);
+    }
+  }
+
+  uint64_t t = trace_begin();
+  int res = xktx_save(cfg.png_out, &ktx, embedded, num_imgs);
+  trace_end("write", cfg.png_out, t);
+  free(blocks);
   if (res < 0) {
-    err_exit("xPNG: %s.", xpng_strerror(res));
+    err_exit("xKTX: %s.", xktx_strerror(res));
+  }
+  stats_add_written(STATS_PHASE_IMAGE_OUT, cfg.png_out);
+}
+
+/**
+ * The name with infix, formatted with n, put before its extension: with
+ * ".%d" (a mip level), "out.png" becomes "out.1.png" for level 1, and with
+ * "@%dx" (a scale, see -s), "Atlas" becomes "Atlas@2x" for scale 2. It lives
+ * in the arena, so traces can refer to it.
+ */
+static char *
+infixed_file_name(const char *name, const char *infix, int n) {
+  const char *dot = strrchr(name, '.');
+  const char *slash = strrchr(name, '/');
+  if (!dot || (slash && dot < slash)) {
+    dot = name + strlen(name);
+  }
+  char num[32];
+  snprintf(num, sizeof num, infix, n);
+  size_t size = strlen(name) + strlen(num) + 1;
+  char *str = AU_AR_Alloc(&arena, size);
+  if (!str) {
+    err_exit("Out of memory.");
+  }
+  snprintf(str, size, "%.*s%s%s", (int) (dot - name), name, num, dot);
+  return str;
+}
+
+static void
+set_scale_names(const struct Config *names, int scale) {
+  cfg.png_out = infixed_file_name(names->png_out, "@%dx", scale);
+  cfg.csv_out = infixed_file_name(names->csv_out, "@%dx", scale);
+  if (names->bin_out) {
+    cfg.bin_out = infixed_file_name(names->bin_out, "@%dx", scale);
+  }
+  if (names->code_out) {
+    cfg.code_out = infixed_file_name(names->code_out, "@%dx", scale);
+  }
+}
+
+/**
+ * Writes the levels as PNG files, or QOI files if the image output ends in
+ * '.qoi'.
+ */
+static void
+png_output(void) {
+  int qoi = has_extension(cfg.png_out, ".qoi");
+  for (int l = 0; l < num_mips; l++) {
+    const char *name = l == 0 ? cfg.png_out
+                              : infixed_file_name(cfg.png_out, ".%d", l);
+    uint64_t t = trace_begin();
+    int res = qoi ? xqoi_save_surface(name, mips[l])
+                  : xpng_save_surface(name, mips[l]);
+    trace_end("write", name, t);
+    if (res >= 0) {
+      stats_add_written(STATS_PHASE_IMAGE_OUT, name);
+    }
+    if (res < 0) {
+      err_exit("%s: %s.", qoi ? "xQOI" : "xPNG",
+               qoi ? xqoi_strerror(res) : xpng_strerror(res));
+    }
+  }
+}
+
+static void
+image_output(void) {
+  stats_begin(STATS_PHASE_IMAGE_OUT);
+  for (int l = 0; l < num_mips; l++) {
+    stats_add_pixels(STATS_PHASE_IMAGE_OUT, (uint64_t) mips[l]->w*mips[l]->h);
+  }
+  if (has_extension(cfg.png_out, ".ktx2")) {
+    ktx_output();
+  }
+  else {
+    png_output();
+  }
+  stats_end(STATS_PHASE_IMAGE_OUT);
+}
+
+static void
+output(void) {
+  if (!image_written) {
+    image_output();
   }
+  image_written = 0;
+
+  stats_begin(STATS_PHASE_CSV_OUT);
+  uint64_t t = trace_begin();
   regions_csv_output();
+  trace_end("write", cfg.csv_out, t);
+  stats_add_written(STATS_PHASE_CSV_OUT, cfg.csv_out);
+  stats_end(STATS_PHASE_CSV_OUT);
+
+  if (cfg.bin_out) {
+    stats_begin(STATS_PHASE_BIN_OUT);
+    t = trace_begin();
+    int res = regtab_save(cfg.bin_out, bp2d.regions, num_imgs);
+    trace_end("write", cfg.bin_out, t);
+    if (res < 0) {
+      err_exit("RegionTable: %s.", regtab_strerror(res));
+    }
+    stats_add_written(STATS_PHASE_BIN_OUT, cfg.bin_out);
+    stats_end(STATS_PHASE_BIN_OUT);
+  }
+  if (cfg.code_out) {
+    stats_begin(STATS_PHASE_CODE_OUT);
+    t = trace_begin();
+    int res = cgen_save(cfg.code_out, cfg.code_prefix, bp2d.regions,
+                        num_imgs);
+    trace_end("write", cfg.code_out, t);
+    if (res < 0) {
+      err_exit("CodeGen: %s.", cgen_strerror(res));
+    }
+    char *path = malloc(strlen(cfg.code_out) + 3);
+    if (!path) {
+      err_exit("libc: %s.", strerror(errno));
+    }
+    sprintf(path, "%s.h", cfg.code_out);
+    stats_add_written(STATS_PHASE_CODE_OUT, path);
+    sprintf(path, "%s.c", cfg.code_out);
+    stats_add_written(STATS_PHASE_CODE_OUT, path);
+    free(path);
+    stats_end(STATS_PHASE_CODE_OUT);
+  }
+}
+
+static void
+decode_into_atlas(void) {
+  stats_begin(STATS_PHASE_DECODE);
+  for (int i = 0; i < num_packed; i++) {
+    const struct RegionInfo *reg = bp2d.regions + i;
+    continue_if(reg->img->surf || !reg->img->data);
+    stats_add_pixels(STATS_PHASE_DECODE, (uint64_t) reg->rect.w*reg->rect.h);
+  }
+
+  struct DecodeError err;
+  if (decode_regions(bp2d.img, bp2d.regions, num_packed, DECODE_FREE_DATA,
+                     &err) < 0)
+  {
+    const struct NamedSurface *img = bp2d.regions[err.region].img;
+    err_exit("Decoding file: %s: %s.", inputs.paths[img->index], err.msg);
+  }
+  stats_end(STATS_PHASE_DECODE);
+}
+
+static int
+cmp_region_info_by_y(const void *a, const void *b) {
+  const struct RegionInfo *r1 = a;
+  const struct RegionInfo *r2 = b;
+  return (r1->rect.y > r2->rect.y) - (r1->rect.y < r2->rect.y);
+}
+
+static int
+wait_decoded_rows(void *ctx, int rows) {
+  return decode_stream_wait_rows(ctx, rows);
+}
+
+/**
+ * decode_into_atlas and png_output at once, for a single level PNG (or QOI)
+ * output: each strip of rows is compressed and written as soon as the images
+ * over it are decoded, so the slower of the two sets the pace rather than
+ * their sum.
+ * The decode and image_out phases overlap.
+ */
+static void
+decode_and_write_png(void) {
+  // Regions are decoded from the top of the atlas down.
+  qsort(bp2d.regions, num_packed, sizeof (struct RegionInfo),
+        cmp_region_info_by_y);
+
+  stats_begin(STATS_PHASE_DECODE);
+  for (int i = 0; i < num_packed; i++) {
+    const struct RegionInfo *reg = bp2d.regions + i;
+    continue_if(reg->img->surf || !reg->img->data);
+    stats_add_pixels(STATS_PHASE_DECODE, (uint64_t) reg->rect.w*reg->rect.h);
+  }
+  stats_begin(STATS_PHASE_IMAGE_OUT);
+  stats_add_pixels(STATS_PHASE_IMAGE_OUT, (uint64_t) bp2d.img->w*bp2d.img->h);
+
+  struct DecodeStream ds;
+  decode_stream_start(&ds, bp2d.img, bp2d.regions, num_packed,
+                      DECODE_FREE_DATA);
+  int qoi = has_extension(cfg.png_out, ".qoi");
+  uint64_t t = trace_begin();
+  int res = qoi ? xqoi_save_surface_rows(cfg.png_out, bp2d.img,
+                                         wait_decoded_rows, &ds)
+                : xpng_save_surface_rows(cfg.png_out, bp2d.img,
+                                         wait_decoded_rows, &ds);
+  trace_end("write", cfg.png_out, t);
+  struct DecodeError err;
+  if (decode_stream_finish(&ds, &err) < 0) {
+    const struct NamedSurface *img = bp2d.regions[err.region].img;
+    err_exit("Decoding file: %s: %s.", inputs.paths[img->index], err.msg);
+  }
+  stats_end(STATS_PHASE_DECODE);
+  if (res < 0) {
+    err_exit("%s: %s.", qoi ? "xQOI" : "xPNG",
+             qoi ? xqoi_strerror(res) : xpng_strerror(res));
+  }
+  stats_add_written(STATS_PHASE_IMAGE_OUT, cfg.png_out);
+  stats_end(STATS_PHASE_IMAGE_OUT);
+  image_written = 1;
+}
+
+/**
+ * Frees the levels built before, if any, and builds them again for bp2d.img.
+ */
+static void
+build_mipmaps(void) {
+  for (int l = 1; l < num_mips; l++) {
+    SDL_FreeSurface(mips[l]);
+    mips[l] = 0;
+  }
+  mips[0] = bp2d.img;
+  num_mips = 1;
+  if (CONFIG_HAS_MIPMAPS(cfg)) {
+    vlog("Building mipmaps.\n");
+    stats_begin(STATS_PHASE_MIPMAPS);
+    int levels = mip_count_levels(bp2d.img->w, bp2d.img->h);
+    if (mip_build_chain(mips, levels, bp2d.regions, num_imgs) < 0) {
+      err_exit("Mipmap: %s.", SDL_GetError());
+    }
+    num_mips = levels;
+    for (int l = 1; l < num_mips; l++) {
+      stats_add_pixels(STATS_PHASE_MIPMAPS, (uint64_t) mips[l]->w*mips[l]->h);
+    }
+    stats_end(STATS_PHASE_MIPMAPS);
+  }
+}
+
+static int
+cmp_named_surface_ptr_by_size(const void *a, const void *b) {
+  const struct NamedSurface *i1 = *(struct NamedSurface * const*) a;
+  const struct NamedSurface *i2 = *(struct NamedSurface * const*) b;
+  if (i1->w != i2->w) {
+    return (i1->w > i2->w) - (i1->w < i2->w);
+  }
+  return (i1->h > i2->h) - (i1->h < i2->h);
+}
+
+/**
+ * Makes the images that may be copies of others (those sharing their size
+ * with another one) 32 bits RGBA surfaces, as dedup_find compares them.
+ * Returns how many there are, with pointers to them in cands. The other
+ * images are left to be decoded into the atlas.
+ */
+static int
+decode_dedup_candidates(struct NamedSurface **cands) {
+  for (int i = 0; i < num_imgs; i++) {
+    cands[i] = imgs + i;
+  }
+  qsort(cands, num_imgs, sizeof *cands, cmp_named_surface_ptr_by_size);
+
+  // The arena copes with large allocations, and these are small anyway.
+  struct RegionInfo *regs = AU_AR_Alloc(&arena, num_imgs * sizeof *regs);
+  SDL_Surface **surfs = AU_AR_Alloc(&arena, num_imgs * sizeof *surfs);
+  if (!regs || !surfs) {
+    err_exit("Out of memory.");
+  }
+  int num_cands = 0, num_decoded = 0;
+  for (int first = 0, end; first < num_imgs; first = end) {
+    for (end = first + 1;
+         end < num_imgs && !cmp_named_surface_ptr_by_size(cands + first,
+                                                           cands + end);
+         end++)
+    {
+    }
+    continue_if(end - first == 1);
+    for (int c = first; c < end; c++) {
+      struct NamedSurface *img = cands[c];
+      cands[num_cands++] = img;
+      stats_add_pixels(STATS_PHASE_DEDUP, (uint64_t) img->w*img->h);
+      if (!img->surf) {
+        SDL_Surface *surf = SDL_CreateRGBSurfaceWithFormat(
+          0, img->w, img->h, 32, SDL_PIXELFORMAT_RGBA32);
+        if (!surf) {
+          err_exit("SDL2: %s.", SDL_GetError());
+        }
+        regs[num_decoded] = (struct RegionInfo) {
+          {0, 0, img->w, img->h}, img, REGION_FLIP_NONE
+        };
+        surfs[num_decoded++] = surf;
+      }
+      else if (img->surf->format->format != SDL_PIXELFORMAT_RGBA32) {
+        SDL_Surface *surf = SDL_ConvertSurfaceFormat(img->surf,
+                                                     SDL_PIXELFORMAT_RGBA32,
+                                                     0);
+        if (!surf) {
+          err_exit("SDL2: %s.", SDL_GetError());
+        }
+        if (!borrows_surf(img)) {
+          atlas_release(img->surf);
+        }
+        img->surf = surf;
+      }
+    }
+  }
+
+  struct DecodeError err;
+  int res = decode_into_surfaces(surfs, regs, num_decoded, DECODE_FREE_DATA,
+                                 &err);
+  for (int i = 0; i < num_decoded; i++) {
+    regs[i].img->surf = surfs[i];
+  }
+  if (res < 0) {
+    const struct NamedSurface *img = regs[err.region].img;
+    err_exit("Decoding file: %s: %s.", inputs.paths[img->index], err.msg);
+  }
+  return num_cands;
+}
+
+/**
+ * With -u, finds the images that are copies of others, and moves them after
+ * the others, into copies (see num_packed).
+ */
+static void
+dedup_imgs(void) {
+  num_packed = num_imgs;
+  copies = 0;
+  if (!CONFIG_DEDUPS(cfg)) {
+    return;
+  }
+  vlog("Looking for copies.\n");
+  stats_begin(STATS_PHASE_DEDUP);
+  struct NamedSurface **cands = AU_AR_Alloc(&arena, num_imgs * sizeof *cands);
+  struct DedupMatch *matches = AU_AR_Alloc(&arena,
+                                           num_imgs * sizeof *matches);
+  struct DedupMatch *by_img = AU_AR_Alloc(&arena, num_imgs * sizeof *by_img);
+  struct NamedSurface *moved = AU_AR_Alloc(&arena, num_imgs * sizeof *moved);
+  if (!cands || !matches || !by_img || !moved) {
+    err_exit("Out of memory.");
+  }
+  int num_cands = decode_dedup_candidates(cands);
+  if (num_cands > 0) {
+    int res = dedup_find(cands, num_cands, matches);
+    if (res < 0) {
+      err_exit("Dedup: %s.", dedup_strerror(res));
+    }
+  }
+
+  // The same, by position in imgs, with the input index of the image copied.
+  int num_copies = 0, flipped = 0;
+  for (int i = 0; i < num_imgs; i++) {
+    by_img[i] = (struct DedupMatch) {-1, REGION_FLIP_NONE};
+  }
+  for (int c = 0; c < num_cands; c++) {
+    continue_if(matches[c].of < 0);
+    by_img[cands[c] - imgs] = (struct DedupMatch) {
+      cands[matches[c].of]->index, matches[c].flip
+    };
+    num_copies++;
+    flipped += matches[c].flip != REGION_FLIP_NONE;
+  }
+
+  // Copies keep their order, and their surfaces go: they're never drawn.
+  copies = matches;
+  num_packed = num_imgs - num_copies;
+  int packed = 0, copied = num_packed;
+  for (int i = 0; i < num_imgs; i++) {
+    if (by_img[i].of < 0) {
+      moved[packed++] = imgs[i];
+      continue;
+    }
+    if (!borrows_surf(imgs + i)) {
+      atlas_release(imgs[i].surf);
+      imgs[i].surf = 0;
+    }
+    copies[copied - num_packed] = by_img[i];
+    moved[copied++] = imgs[i];
+  }
+  memcpy(imgs, moved, num_imgs * sizeof *imgs);
+  vlog("%d images are copies of others, %d of them flipped.\n", num_copies,
+       flipped);
+  stats_end(STATS_PHASE_DEDUP);
+}
+
+/**
+ * Gives the copies left out of the packing the regions of the images they're
+ * copies of.
+ */
+static void
+add_copies(void) {
+  if (num_packed == num_imgs) {
+    return;
+  }
+  struct RegionInfo *regions = AU_AR_Alloc(&arena,
+                                           num_imgs * sizeof *regions);
+  int *region_of = AU_AR_Alloc(&arena, num_imgs * sizeof *region_of);
+  if (!regions || !region_of) {
+    err_exit("Out of memory.");
+  }
+  memcpy(regions, bp2d.regions, num_packed * sizeof *regions);
+  for (int i = 0; i < num_packed; i++) {
+    region_of[regions[i].img->index] = i;
+  }
+  for (int i = num_packed; i < num_imgs; i++) {
+    const struct DedupMatch *copy = copies + (i - num_packed);
+    regions[i] = (struct RegionInfo) {
+      regions[region_of[copy->of]].rect, imgs + i, copy->flip
+    };
+  }
+  bp2d.regions = regions;
 }
 
 static void
 imgpack(void) {
+  dedup_imgs();
   vlog("Packing images.\n");
-  bp2d = bin_pack_2d(imgs, num_imgs, (struct BinPack2DOptions)
-    {cfg.w, cfg.h});
+  bp2d = bin_pack_2d(imgs, num_packed, (struct BinPack2DOptions)
+    {cfg.w, cfg.h, cfg.align, &arena, cfg.shards});
   if (bp2d.attempt < 0) {
     err_exit("BinPack2D: %s.", bp2d_strerror(bp2d.attempt));
   }
+  if (!CONFIG_HAS_MIPMAPS(cfg) && !has_extension(cfg.png_out, ".ktx2")) {
+    decode_and_write_png();
+  }
+  else {
+    decode_into_atlas();
+  }
+
+  uint64_t image_pixels = 0;
+  for (int i = 0; i < num_packed; i++) {
+    image_pixels += (uint64_t) bp2d.regions[i].rect.w*bp2d.regions[i].rect.h;
+  }
+  stats_set_atlas(bp2d.img->w, bp2d.img->h, image_pixels, cfg.shards);
+  vlog("Atlas: %dx%d, %.1f%% occupied.\n", bp2d.img->w, bp2d.img->h,
+       100.0*image_pixels/((double) bp2d.img->w*bp2d.img->h));
+
+  // From here on, regions are in input order, which is the order of the
+  // outputs. Mipmaps depend on it too, where regions share texels.
+  add_copies();
+  qsort(bp2d.regions, num_imgs, sizeof (struct RegionInfo),
+        cmp_region_info_by_named_surface_index);
+
+  build_mipmaps();
   vlog("Done.\n");
 }
 
+/**
+ * Writes every output again for the atlas scaled down by factor, along with
+ * its regions (their ends rounded up).
+ */
+static void
+scaled_output(int factor) {
+  vlog("Scaling down by %d.\n", factor);
+  stats_begin(STATS_PHASE_SCALES);
+  SDL_Surface *img = mip_scale_down(bp2d.img, factor, bp2d.regions, num_imgs);
+  if (!img) {
+    err_exit("Mipmap: %s.", SDL_GetError());
+  }
+  stats_add_pixels(STATS_PHASE_SCALES, (uint64_t) img->w*img->h);
+  SDL_Rect *rects = malloc(num_imgs * sizeof *rects);
+  if (!rects) {
+    err_exit("Out of memory.");
+  }
+  for (int i = 0; i < num_imgs; i++) {
+    SDL_Rect *rect = &bp2d.regions[i].rect;
+    rects[i] = *rect;
+    rect->x /= factor;
+    rect->y /= factor;
+    rect->w = (rects[i].x + rects[i].w + factor - 1)/factor - rect->x;
+    rect->h = (rects[i].y + rects[i].h + factor - 1)/factor - rect->y;
+  }
+  stats_end(STATS_PHASE_SCALES);
+
+  SDL_Surface *atlas = bp2d.img;
+  bp2d.img = mips[0] = img;
+  output();
+  bp2d.img = mips[0] = atlas;
+  for (int i = 0; i < num_imgs; i++) {
+    bp2d.regions[i].rect = rects[i];
+  }
+  free(rects);
+  atlas_free(img);
+}
+
+/**
+ * imgpack and output. With -s, that's for the largest scale, and the atlas is
+ * then scaled down for the other ones: images are decoded and packed once.
+ */
+static void
+pack_and_output(void) {
+  const struct Config names = cfg;
+  int top = top_scale(cfg.scales);
+  if (cfg.scales) {
+    set_scale_names(&names, top);
+  }
+  imgpack();
+  output();
+  for (int s = top - 1; s > 0; s--) {
+    continue_if(!(cfg.scales & 1u << s));
+    set_scale_names(&names, s);
+    scaled_output(top/s);
+  }
+  cfg = names;
+}
+
+/**
+ * Only prints something when AU is built with AU_STATS.
+ */
+static void
+log_alloc_stats(void) {
+  struct AU_Stats stats[AU_NUM_KINDS];
+  if (!CONFIG_IS_VERBOSE(cfg) || AU_GetStats(stats) < 0) {
+    return;
+  }
+  vlog("Allocation statistics:\n");
+  for (int i = 0; i < AU_NUM_KINDS; i++) {
+    const struct AU_Stats *st = stats + i;
+    continue_if(st->setups == 0);
+    vlog("  %s: %lu set up, %lu grown, largest %zu bytes", AU_KindName(i),
+         st->setups, st->grows, st->max_cap);
+    if (st->allocs > 0) {
+      vlog(", %lu allocs, %lu frees, %zu bytes live, %zu bytes peak",
+           st->allocs, st->frees, st->bytes_live, st->bytes_peak);
+    }
+    vlog(".\n");
+  }
+}
+
+/*
+ * Watch mode. Once the first outputs are written, the atlas itself holds
+ * every image: an image has a surface or data only while it waits to be
+ * drawn into it. A changed image goes back into its region when it fits, and
+ * only the rows it touched are written again when the output allows it (an
+ * uncompressed or single level KTX2 file). Otherwise everything is repacked,
+ * taking the unchanged images from the atlas rather than from their files.
+ */
+
+static void *
+read_file(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  return_if(!fp, 0);
+  char *data = 0;
+  long len;
+  goto_if(fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0, end);
+  rewind(fp);
+  data = malloc(len ? len : 1);
+  goto_if(!data, end);
+  if (fread(data, 1, len, fp) != (size_t) len) {
+    free(data);
+    data = 0;
+    goto end;
+  }
+  *size = len;
+end:
+  fclose(fp);
+  return data;
+}
+
+static void
+clear_rect(SDL_Surface *surf, SDL_Rect r) {
+  for (int y = 0; y < r.h; y++) {
+    char *row = (char*) surf->pixels + (size_t) (r.y + y)*surf->pitch +
+                (size_t) r.x*4;
+    memset(row, 0, (size_t) r.w*4);
+  }
+}
+
+static SDL_Surface *
+copy_rect(SDL_Surface *surf, SDL_Rect r) {
+  const SDL_PixelFormat *f = surf->format;
+  SDL_Surface *copy = SDL_CreateRGBSurface(0, r.w, r.h, 32, f->Rmask,
+                                           f->Gmask, f->Bmask, f->Amask);
+  return_if(!copy, 0);
+  for (int y = 0; y < r.h; y++) {
+    const char *row = (const char*) surf->pixels +
+                      (size_t) (r.y + y)*surf->pitch + (size_t) r.x*4;
+    memcpy((char*) copy->pixels + (size_t) y*copy->pitch, row,
+           (size_t) r.w*4);
+  }
+  return copy;
+}
+
+/**
+ * Draws a reloaded image into its region, and drops its surface or data.
+ */
+static void
+draw_img(struct RegionInfo *reg) {
+  struct NamedSurface *img = reg->img;
+  if (img->data) {
+    struct DecodeError err;
+    if (decode_regions(bp2d.img, reg, 1, DECODE_FREE_DATA, &err) < 0) {
+      report_err("Decoding file: %s: %s.", inputs.paths[img->index], err.msg);
+    }
+  }
+  else if (img->surf) {
+    if (atlas_blit(img->surf, bp2d.img, &reg->rect) < 0) {
+      err_exit("SDL2: %s.", SDL_GetError());
+    }
+    atlas_release(img->surf);
+    img->surf = 0;
+  }
+}
+
+/**
+ * Reloads the i-th input into its image. Returns 0 if it couldn't be loaded,
+ * in which case the image is left as it was.
+ */
+static int
+reload_img(int i) {
+  struct NamedSurface *img = bp2d.regions[i].img;
+  const char *file = inputs.paths[i];
+  assert(img->index == i);
+
+  size_t size;
+  void *data = read_file(file, &size);
+  if (!data) {
+    report_err("Loading file: %s: %s.", file, strerror(errno));
+    return 0;
+  }
+  struct NamedSurface next = {0, 0, 0, img->name, i, 0, 0};
+  int res = setup_img(&next, data, size);
+  if (res < 0) {
+    report_err("Loading file: %s: %s.", file, setup_img_strerror(res));
+    free(data);
+    return 0;
+  }
+  if (res == SETUP_IMG_KEEP_DATA) {
+    next.data = data;
+    next.size = size;
+  }
+  else {
+    free(data);
+  }
+  atlas_release(img->surf);
+  free(img->data);
+  *img = next;
+  vlog("Reloaded %s.\n", file);
+  return 1;
+}
+
+static void
+save_slots(void) {
+  for (int i = 0; i < num_imgs; i++) {
+    slots[i] = bp2d.regions[i].rect;
+  }
+}
+
+static void
+repack(void) {
+  vlog("Repacking images.\n");
+  for (int i = 0; i < num_imgs; i++) {
+    struct RegionInfo *reg = bp2d.regions + i;
+    continue_if(reg->img->surf || reg->img->data);
+    reg->img->surf = copy_rect(bp2d.img, reg->rect);
+    if (!reg->img->surf) {
+      err_exit("SDL2: %s.", SDL_GetError());
+    }
+  }
+
+  // The old regions stay in the arena, they're small.
+  struct BinPack2DResult next = bin_pack_2d(imgs, num_imgs,
+    (struct BinPack2DOptions) {cfg.w, cfg.h, cfg.align, &arena, cfg.shards});
+  if (next.attempt < 0) {
+    err_exit("BinPack2D: %s.", bp2d_strerror(next.attempt));
+  }
+  atlas_free(bp2d.img);
+  bp2d = next;
+  qsort(bp2d.regions, num_imgs, sizeof (struct RegionInfo),
+        cmp_region_info_by_named_surface_index);
+  for (int i = 0; i < num_imgs; i++) {
+    struct RegionInfo *reg = bp2d.regions + i;
+    if (reg->img->data) {
+      draw_img(reg);
+    }
+    atlas_release(reg->img->surf);
+    reg->img->surf = 0;
+  }
+  save_slots();
+}
+
+/**
+ * Writes rows [y0, y1) of the atlas over the KTX2 output, which must have a
+ * single level.
+ */
+static void
+ktx_patch_output(int y0, int y1) {
+  SDL_Surface *atlas = bp2d.img;
+  struct XKTXLevel level = {
+    atlas->pixels, atlas->pitch, (size_t) atlas->w*4, atlas->h
+  };
+  struct XKTXImage ktx = {
+    X_KTX_FORMAT_RGBA8, atlas->w, atlas->h, 1, &level
+  };
+  int embeds = CONFIG_EMBEDS_REGIONS(cfg);
+  int res;
+  uint64_t t = trace_begin();
+  if (!CONFIG_IS_BLOCK_COMPRESSED(cfg)) {
+    res = xktx_patch_rows(cfg.png_out, &ktx, embeds, 0, y0, y1 - y0,
+                          (char*) atlas->pixels + (size_t) y0*atlas->pitch,
+                          atlas->pitch);
+  }
+  else {
+    // Only the rows of blocks the dirty rows are in get encoded again.
+    int bc_format = config_bc_format();
+    size_t row_size = bc_row_size(bc_format, atlas->w);
+    int b0 = y0/BC_BLOCK_DIM;
+    int b1 = (y1 + BC_BLOCK_DIM - 1)/BC_BLOCK_DIM;
+    int h = b1*BC_BLOCK_DIM < atlas->h ? b1*BC_BLOCK_DIM : atlas->h;
+    ktx.format = bc_format == BC_FORMAT_BC1
+                 ? X_KTX_FORMAT_BC1
+                 : X_KTX_FORMAT_BC3;
+    level = (struct XKTXLevel) {
+      0, row_size, row_size, (atlas->h + BC_BLOCK_DIM - 1)/BC_BLOCK_DIM
+    };
+    void *blocks = malloc(row_size*(b1 - b0));
+    if (!blocks) {
+      err_exit("libc: %s.", strerror(errno));
+    }
+    bc_encode(bc_format, bc_qualities[cfg.tex_quality],
+              (char*) atlas->pixels + (size_t) b0*BC_BLOCK_DIM*atlas->pitch,
+              atlas->w, h - b0*BC_BLOCK_DIM, atlas->pitch, blocks);
+    res = xktx_patch_rows(cfg.png_out, &ktx, embeds, 0, b0, b1 - b0, blocks,
+                          row_size);
+    free(blocks);
+  }
+  trace_end("write", cfg.png_out, t);
+  if (res < 0) {
+    err_exit("xKTX: %s.", xktx_strerror(res));
+  }
+}
+
+static void
+watch_update(const unsigned char *changed) {
+  int y0 = INT_MAX, y1 = 0;
+  int moved = 0;
+  int must_repack = 0;
+  for (int i = 0; i < num_imgs; i++) {
+    continue_if(!changed[i] || !reload_img(i));
+    struct RegionInfo *reg = bp2d.regions + i;
+    const SDL_Rect slot = slots[i];
+    continue_if(must_repack);
+    if (reg->img->w > slot.w || reg->img->h > slot.h) {
+      must_repack = 1;
+      continue;
+    }
+    // The image drawn before may be larger than the new one.
+    clear_rect(bp2d.img, reg->rect);
+    y0 = slot.y < y0 ? slot.y : y0;
+    y1 = slot.y + slot.h > y1 ? slot.y + slot.h : y1;
+    moved |= reg->img->w != reg->rect.w || reg->img->h != reg->rect.h;
+    reg->rect.w = reg->img->w;
+    reg->rect.h = reg->img->h;
+    draw_img(reg);
+  }
+  if (must_repack) {
+    repack();
+    moved = 1;
+  }
+  if (!moved && y0 >= y1) {
+    return;
+  }
+  build_mipmaps();
+
+  if (moved) {
+    output();
+  }
+  else if (num_mips == 1 && has_extension(cfg.png_out, ".ktx2")) {
+    ktx_patch_output(y0, y1);
+  }
+  else {
+    image_output();
+  }
+}
+
+static void
+watch_inputs(void) {
+  int res = watch_start(&watch, &inputs);
+  if (res < 0) {
+    err_exit("Watch: %s.", watch_strerror(res));
+  }
+  unsigned char *changed = AU_AR_Alloc(&arena, num_imgs);
+  slots = AU_AR_Alloc(&arena, num_imgs * sizeof *slots);
+  if (!changed || !slots) {
+    err_exit("Out of memory.");
+  }
+  save_slots();
+  for (int i = 0; i < num_imgs; i++) {
+    atlas_release(imgs[i].surf);
+    imgs[i].surf = 0;
+  }
+
+  vlog("Watching %d files.\n", num_imgs);
+  for (;;) {
+    int num_changed = watch_wait(&watch, changed);
+    if (num_changed < 0) {
+      err_exit("Watch: %s.", watch_strerror(num_changed));
+    }
+    uint64_t t = trace_now();
+    watch_update(changed);
+    vlog("Updated %d file(s) in %.1f ms.\n", num_changed,
+         (trace_now() - t)/1e6);
+  }
+}
+
+/*
+ * Batch mode. The atlases of a manifest are built one after the other, so
+ * SDL, SDL2_image and the worker threads are set up once for all of them.
+ */
+
+/**
+ * Finds the files used more than once across the atlases. Files that
+ * couldn't be stat'ed are left out: loading them fails anyway.
+ */
+static void
+find_shared_imgs(void) {
+  size_t total = 0;
+  for (int i = 0; i < num_atlases; i++) {
+    total += atlases[i].inputs.num;
+  }
+  struct SharedImg *files = malloc(total * sizeof *files);
+  shared = malloc((total/2 + 1) * sizeof *shared);
+  if (!files || !shared) {
+    free(files);
+    err_exit("Out of memory.");
+  }
+  size_t n = 0;
+  for (int i = 0; i < num_atlases; i++) {
+    const struct InputList *list = &atlases[i].inputs;
+    for (int j = 0; j < list->num; j++) {
+      continue_if(list->stats[j].size < 0);
+      files[n++] = (struct SharedImg) {
+        list->stats[j].dev, list->stats[j].ino, 1, 0
+      };
+    }
+  }
+  qsort(files, n, sizeof *files, cmp_shared_img);
+
+  for (size_t i = 0, run; i < n; i += run) {
+    for (run = 1; i + run < n && !cmp_shared_img(files + i, files + i + run);
+         run++)
+    {
+    }
+    continue_if(run == 1);
+    shared[num_shared] = files[i];
+    shared[num_shared++].refs = run;
+  }
+  free(files);
+  vlog("%d files are used by several atlases.\n", num_shared);
+}
+
+/**
+ * Frees what the i-th atlas built, so the next one starts afresh.
+ */
+static void
+reset_atlas(int i) {
+  detach_shared();
+  for (int j = 0; j < loaded; j++) {
+    atlas_release(imgs[j].surf);
+    free(imgs[j].data);
+  }
+  loaded = 0;
+  imgs = 0;
+  for (int l = 1; l < num_mips; l++) {
+    SDL_FreeSurface(mips[l]);
+    mips[l] = 0;
+  }
+  num_mips = 0;
+  atlas_free(bp2d.img);
+  memset(&bp2d, 0, sizeof bp2d);
+  if (trace_on) {
+    // Spans refer to the paths and names until trace_save.
+    atlases[i].inputs = inputs;
+    memset(&inputs, 0, sizeof inputs);
+    return;
+  }
+  inputs_free(&inputs);
+  AU_AR_Destroy(&arena);
+  if (AU_AR_Setup(&arena, ARENA_BLOCK_SIZE, AU_ARENA_HUGE_PAGES) < 0) {
+    err_exit("Out of memory.");
+  }
+}
+
+static void
+run_batch(void) {
+  int res = batch_read(&batch, cfg.batch_in);
+  if (res < 0) {
+    err_exit("Batch: %s: %s.", cfg.batch_in, batch_strerror(res));
+  }
+  atlases = calloc(batch.num_blocks, sizeof *atlases);
+  if (!atlases) {
+    err_exit("Out of memory.");
+  }
+
+  // Every block starts from the options of the command line.
+  const struct Config base = cfg;
+  for (int i = 0; i < batch.num_blocks; i++) {
+    block = batch.blocks + i;
+    cfg = base;
+    char **args = parse_opts(block->argv);
+    finish_cfg(block->argc - (args - block->argv), args);
+    atlases[num_atlases++] = (struct BatchAtlas) {cfg, inputs};
+    memset(&inputs, 0, sizeof inputs);
+  }
+  block = 0;
+  cfg = base;
+  find_shared_imgs();
+
+  int total_imgs = 0;
+  for (int i = 0; i < num_atlases; i++) {
+    block = batch.blocks + i;
+    cfg = atlases[i].cfg;
+    inputs = atlases[i].inputs;
+    memset(&atlases[i].inputs, 0, sizeof inputs);
+    num_imgs = inputs.num;
+    total_imgs += num_imgs;
+    workers_set_count(cfg.threads);
+    vlog("Atlas %d of %d: %s.\n", i + 1, num_atlases, cfg.png_out);
+    load_imgs();
+    pack_and_output();
+    reset_atlas(i);
+  }
+  block = 0;
+  cfg = base;
+  stats_set_counts(total_imgs, workers_get_count());
+}
+
 int
 main(int argc, char *argv[]) {
   init();
   build_cfg(argc, argv);
-  load_imgs();
-  imgpack();
-  output();
+  if (cfg.max_memory) {
+    // Half for the atlas, a quarter for the decoded images waiting to be
+    // drawn into it, and a quarter for the files read ahead (see load_imgs).
+    int res = atlas_set_budget(cfg.max_memory/2, cfg.max_memory/4);
+    if (res < 0) {
+      err_exit("--max-memory: %s.", atlas_strerror(res));
+    }
+  }
+  if (cfg.batch_in) {
+    run_batch();
+  }
+  else {
+    load_imgs();
+    pack_and_output();
+  }
+  log_alloc_stats();
+  if (cfg.stats_out) {
+    int res = stats_save(cfg.stats_out);
+    if (res < 0) {
+      err_exit("Stats: %s.", stats_strerror(res));
+    }
+  }
+  if (cfg.trace_out) {
+    int res = trace_save(cfg.trace_out);
+    if (res < 0) {
+      err_exit("Trace: %s.", trace_strerror(res));
+    }
+  }
+  if (CONFIG_WATCHES(cfg)) {
+    watch_inputs();
+  }
   cleanup();
   return 0;
 }
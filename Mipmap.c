@@ -0,0 +1,269 @@
+#include <assert.h>
+
+#include <SDL2/SDL.h>
+
+#include "XFlow.h"
+#include "RegionInfo.h"
+#include "Mipmap.h"
+#include "Workers.h"
+#include "Atlas.h"
+
+enum {
+  BAND_ROWS = 32,
+
+  // Atlas surfaces keep their bytes in R, G, B, A order on any endianness.
+  ALPHA_BYTE = 3
+};
+
+struct LevelJob {
+  SDL_Surface *src, *dst;
+  int level;
+  const struct RegionInfo *regions;
+  int num_regions;
+};
+
+struct ScaleJob {
+  SDL_Surface *src, *dst;
+  int factor;
+  const struct RegionInfo *regions;
+  int num_regions;
+};
+
+static inline int
+imin(int a, int b) {
+  return a < b ? a : b;
+}
+
+static inline int
+imax(int a, int b) {
+  return a > b ? a : b;
+}
+
+/**
+ * First texel covered at the given level by something starting at v on the
+ * base level.
+ */
+static inline int
+shrink_lo(int v, int level) {
+  return v >> level;
+}
+
+/**
+ * One past the last texel covered at the given level by something ending
+ * right before v on the base level.
+ */
+static inline int
+shrink_hi(int v, int level) {
+  return (int) (((long long) v + (1LL << level) - 1) >> level);
+}
+
+static void
+downsample_region(const struct LevelJob *job,
+                  const SDL_Rect *rect,
+                  int band_y0,
+                  int band_y1)
+{
+  const int l = job->level;
+  const int sx0 = imin(shrink_lo(rect->x, l-1), job->src->w - 1);
+  const int sy0 = imin(shrink_lo(rect->y, l-1), job->src->h - 1);
+  const int sx1 = imin(shrink_hi(rect->x + rect->w, l-1), job->src->w) - 1;
+  const int sy1 = imin(shrink_hi(rect->y + rect->h, l-1), job->src->h) - 1;
+  const int dx0 = shrink_lo(rect->x, l);
+  const int dx1 = imin(shrink_hi(rect->x + rect->w, l), job->dst->w);
+  const int dy0 = imax(shrink_lo(rect->y, l), band_y0);
+  const int dy1 = imin(shrink_hi(rect->y + rect->h, l), band_y1);
+
+  const Uint8 *src = job->src->pixels;
+  Uint8 *dst = job->dst->pixels;
+  const int src_pitch = job->src->pitch;
+  const int dst_pitch = job->dst->pitch;
+
+  for (int dy = dy0; dy < dy1; dy++) {
+    const Uint8 *row0 = src + (size_t) imax(2*dy, sy0)*src_pitch;
+    const Uint8 *row1 = src + (size_t) imin(2*dy + 1, sy1)*src_pitch;
+    Uint8 *out = dst + (size_t) dy*dst_pitch + (size_t) dx0*4;
+    for (int dx = dx0; dx < dx1; dx++, out += 4) {
+      const int x0 = imax(2*dx, sx0)*4;
+      const int x1 = imin(2*dx + 1, sx1)*4;
+      const Uint8 *s[4] = {row0 + x0, row0 + x1, row1 + x0, row1 + x1};
+      unsigned a_sum = 0;
+      unsigned sum[4] = {0, 0, 0, 0};
+      unsigned wsum[4] = {0, 0, 0, 0};
+      for (int k = 0; k < 4; k++) {
+        unsigned a = s[k][ALPHA_BYTE];
+        a_sum += a;
+        for (int c = 0; c < 4; c++) {
+          sum[c] += s[k][c];
+          wsum[c] += s[k][c]*a;
+        }
+      }
+      for (int c = 0; c < 4; c++) {
+        if (c == ALPHA_BYTE) {
+          out[c] = (a_sum + 2)/4;
+        }
+        else {
+          out[c] = a_sum ? (wsum[c] + a_sum/2)/a_sum : (sum[c] + 2)/4;
+        }
+      }
+    }
+  }
+}
+
+static void
+downsample_bands(void *ctx, size_t begin, size_t end) {
+  const struct LevelJob *job = ctx;
+  const int y0 = begin*BAND_ROWS;
+  const int y1 = imin(end*BAND_ROWS, job->dst->h);
+  const int l = job->level;
+
+  for (int i = 0; i < job->num_regions; i++) {
+    const SDL_Rect *rect = &job->regions[i].rect;
+    continue_if(shrink_hi(rect->y + rect->h, l) <= y0);
+    continue_if(shrink_lo(rect->y, l) >= y1);
+    downsample_region(job, rect, y0, y1);
+  }
+}
+
+static inline int
+div_up(int v, int d) {
+  return (int) (((long long) v + d - 1)/d);
+}
+
+static void
+scale_region(const struct ScaleJob *job,
+             const SDL_Rect *rect,
+             int band_y0,
+             int band_y1)
+{
+  const int f = job->factor;
+  const int sx1 = imin(rect->x + rect->w, job->src->w);
+  const int sy1 = imin(rect->y + rect->h, job->src->h);
+  const int dx0 = rect->x/f;
+  const int dx1 = imin(div_up(rect->x + rect->w, f), job->dst->w);
+  const int dy0 = imax(rect->y/f, band_y0);
+  const int dy1 = imin(div_up(rect->y + rect->h, f), band_y1);
+
+  const Uint8 *src = job->src->pixels;
+  Uint8 *dst = job->dst->pixels;
+  const int src_pitch = job->src->pitch;
+  const int dst_pitch = job->dst->pitch;
+
+  for (int dy = dy0; dy < dy1; dy++) {
+    const int y0 = imax(dy*f, rect->y);
+    const int y1 = imin(dy*f + f, sy1);
+    Uint8 *out = dst + (size_t) dy*dst_pitch + (size_t) dx0*4;
+    for (int dx = dx0; dx < dx1; dx++, out += 4) {
+      const int x0 = imax(dx*f, rect->x);
+      const int x1 = imin(dx*f + f, sx1);
+      unsigned a_sum = 0;
+      unsigned sum[4] = {0, 0, 0, 0};
+      unsigned wsum[4] = {0, 0, 0, 0};
+      for (int y = y0; y < y1; y++) {
+        const Uint8 *s = src + (size_t) y*src_pitch + (size_t) x0*4;
+        for (int x = x0; x < x1; x++, s += 4) {
+          unsigned a = s[ALPHA_BYTE];
+          a_sum += a;
+          for (int c = 0; c < 4; c++) {
+            sum[c] += s[c];
+            wsum[c] += s[c]*a;
+          }
+        }
+      }
+      const unsigned n = (unsigned) (y1 - y0)*(x1 - x0);
+      for (int c = 0; c < 4; c++) {
+        if (c == ALPHA_BYTE) {
+          out[c] = (a_sum + n/2)/n;
+        }
+        else {
+          out[c] = a_sum ? (wsum[c] + a_sum/2)/a_sum : (sum[c] + n/2)/n;
+        }
+      }
+    }
+  }
+}
+
+static void
+scale_bands(void *ctx, size_t begin, size_t end) {
+  const struct ScaleJob *job = ctx;
+  const int y0 = begin*BAND_ROWS;
+  const int y1 = imin(end*BAND_ROWS, job->dst->h);
+  const int f = job->factor;
+
+  for (int i = 0; i < job->num_regions; i++) {
+    const SDL_Rect *rect = &job->regions[i].rect;
+    continue_if(div_up(rect->y + rect->h, f) <= y0);
+    continue_if(rect->y/f >= y1);
+    scale_region(job, rect, y0, y1);
+  }
+}
+
+int
+mip_count_levels(int w, int h) {
+  assert(w > 0);
+  assert(h > 0);
+
+  int n = 1;
+  while (w > 1 || h > 1) {
+    w = imax(w/2, 1);
+    h = imax(h/2, 1);
+    n++;
+  }
+  return n;
+}
+
+int
+mip_build_chain(SDL_Surface **levels,
+                int num_levels,
+                const struct RegionInfo *regions,
+                int num_regions)
+{
+  assert(levels);
+  assert(levels[0]);
+  assert(levels[0]->format->BytesPerPixel == 4);
+  assert(num_levels > 0);
+  assert(num_levels <= mip_count_levels(levels[0]->w, levels[0]->h));
+
+  const SDL_PixelFormat *fmt = levels[0]->format;
+  for (int l = 1; l < num_levels; l++) {
+    SDL_Surface *src = levels[l-1];
+    levels[l] = SDL_CreateRGBSurface(0,
+                                     imax(src->w/2, 1),
+                                     imax(src->h/2, 1),
+                                     32,
+                                     fmt->Rmask,
+                                     fmt->Gmask,
+                                     fmt->Bmask,
+                                     fmt->Amask);
+    if (!levels[l]) {
+      for (int i = 1; i < l; i++) {
+        SDL_FreeSurface(levels[i]);
+        levels[i] = 0;
+      }
+      return MIP_FAIL_NO_SURFACE;
+    }
+
+    struct LevelJob job = {src, levels[l], l, regions, num_regions};
+    size_t num_bands = (levels[l]->h + BAND_ROWS - 1)/BAND_ROWS;
+    workers_parallel_for(num_bands, 1, downsample_bands, &job);
+  }
+  return MIP_OK;
+}
+
+SDL_Surface *
+mip_scale_down(SDL_Surface *atlas,
+               int factor,
+               const struct RegionInfo *regions,
+               int num_regions)
+{
+  assert(atlas);
+  assert(atlas->format->BytesPerPixel == 4);
+  assert(factor > 0 && factor <= MIP_MAX_SCALE_FACTOR);
+
+  SDL_Surface *dst = atlas_create(div_up(atlas->w, factor),
+                                  div_up(atlas->h, factor));
+  return_if(!dst, 0);
+  struct ScaleJob job = {atlas, dst, factor, regions, num_regions};
+  size_t num_bands = (dst->h + BAND_ROWS - 1)/BAND_ROWS;
+  workers_parallel_for(num_bands, 1, scale_bands, &job);
+  return dst;
+}
@@ -0,0 +1,63 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <SDL2/SDL.h>
+
+#include "RegionInfo.h"
+
+enum {
+  MIP_OK = 0,
+  MIP_FAIL_NO_SURFACE = -1
+};
+
+enum {
+  MIP_MAX_LEVELS = 32,
+
+  // So the sums of mip_scale_down fit 32 bits.
+  MIP_MAX_SCALE_FACTOR = 256
+};
+
+/**
+ * Number of levels in the full mip chain of a w by h image, down to 1x1,
+ * counting the base level.
+ */
+int
+mip_count_levels(int w, int h);
+
+/**
+ * Builds levels 1 to num_levels-1 of the mip chain of the atlas in levels[0]
+ * (a 32 bits RGBA surface, as bin_pack_2d makes), storing the new surfaces in
+ * levels[1] to levels[num_levels-1].
+ *
+ * Each level is a 2x2 box filter of the previous one, with colors weighted by
+ * alpha. Samples are clamped to the rectangle of the region being filtered,
+ * so images never bleed into their neighbours. Texels not covered by any
+ * region are left transparent. Rows are processed in parallel bands (see
+ * Workers.h).
+ *
+ * On failure, the levels built so far are freed and set to null, and
+ * SDL_GetError tells what happened.
+ */
+int
+mip_build_chain(SDL_Surface **levels,
+                int num_levels,
+                const struct RegionInfo *regions,
+                int num_regions);
+
+/**
+ * Makes a copy of atlas (as in mip_build_chain) factor times smaller, rounding
+ * up, to be freed with atlas_free. factor is at most MIP_MAX_SCALE_FACTOR.
+ *
+ * Each texel is the alpha weighted average of the factor by factor box above
+ * it, clamped to the rectangle of its region like mip levels are. Regions
+ * should start at multiples of factor, or their first texels overlap those
+ * of their neighbours. Returns null on failure, with SDL_GetError telling
+ * what happened.
+ */
+SDL_Surface *
+mip_scale_down(SDL_Surface *atlas,
+               int factor,
+               const struct RegionInfo *regions,
+               int num_regions);
+
+#endif
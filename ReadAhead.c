@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "XFlow.h"
+#include "ReadAhead.h"
+#include "Workers.h"
+#include "Trace.h"
+
+enum {
+  // Reads mostly wait on the device, so there can be more of them in flight
+  // than there are CPUs.
+  RDA_MIN_THREADS = 4,
+  RDA_MAX_THREADS = 16,
+  RDA_PENDING = 1
+};
+
+static int
+read_file(const char *path, struct RDAFile *file) {
+  uint64_t t = trace_begin();
+  int res = RDA_FAIL_LIBC;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  goto_if(fd < 0, end);
+  struct stat st;
+  goto_if(fstat(fd, &st) < 0, end);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  size_t size = st.st_size;
+  char *data = malloc(size ? size : 1);
+  res = RDA_FAIL_NO_MEM;
+  goto_if(!data, end);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, data + done, size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      free(data);
+      res = RDA_FAIL_LIBC;
+      goto end;
+    }
+    // The file got shorter since fstat.
+    break_if(n == 0);
+    done += n;
+  }
+  file->data = data;
+  file->size = done;
+  res = RDA_OK;
+end:
+  file->err = errno;
+  if (fd >= 0) {
+    close(fd);
+  }
+  trace_end("read", path, t);
+  return res;
+}
+
+static size_t
+expected_size(const struct ReadAhead *rda, int k) {
+  const struct InputList *list = rda->list;
+  int64_t size = list->stats ? list->stats[list->order[k]].size : 0;
+  return size > 0 ? (size_t) size : 0;
+}
+
+static void *
+run_reads(void *arg) {
+  struct ReadAhead *rda = arg;
+  pthread_mutex_lock(&rda->mutex);
+  for (;;) {
+    // The oldest unreleased file is always allowed, so a single file larger
+    // than max_bytes doesn't stall everything.
+    while (!rda->stop && rda->next < rda->list->num &&
+           (rda->next - rda->released >= rda->window ||
+            (rda->next > rda->released &&
+             rda->bytes + expected_size(rda, rda->next) > rda->max_bytes)))
+    {
+      pthread_cond_wait(&rda->cond, &rda->mutex);
+    }
+    break_if(rda->stop || rda->next >= rda->list->num);
+
+    int k = rda->next++;
+    size_t expected = expected_size(rda, k);
+    rda->bytes += expected;
+    pthread_mutex_unlock(&rda->mutex);
+
+    struct RDAFile file = {0, 0, RDA_OK, 0};
+    file.res = read_file(rda->list->paths[rda->list->order[k]], &file);
+
+    pthread_mutex_lock(&rda->mutex);
+    rda->bytes += file.size - expected;
+    rda->files[k] = file;
+    pthread_cond_broadcast(&rda->cond);
+  }
+  pthread_mutex_unlock(&rda->mutex);
+  return 0;
+}
+
+int
+rda_start(struct ReadAhead *rda,
+          const struct InputList *list,
+          int window,
+          size_t max_bytes)
+{
+  assert(rda);
+  assert(list);
+  assert(list->order);
+  assert(window > 0);
+
+  memset(rda, 0, sizeof *rda);
+  rda->list = list;
+  rda->window = window;
+  rda->max_bytes = max_bytes;
+
+  rda->files = malloc(list->num * sizeof *rda->files);
+  return_if(!rda->files, RDA_FAIL_NO_MEM);
+  for (int i = 0; i < list->num; i++) {
+    rda->files[i] = (struct RDAFile) {0, 0, RDA_PENDING, 0};
+  }
+
+  int num_threads = workers_get_count();
+  num_threads = num_threads < RDA_MIN_THREADS ? RDA_MIN_THREADS
+              : num_threads > RDA_MAX_THREADS ? RDA_MAX_THREADS
+              : num_threads;
+  num_threads = num_threads > window ? window : num_threads;
+  num_threads = num_threads > list->num ? list->num : num_threads;
+  rda->threads = malloc(num_threads * sizeof *rda->threads);
+  if (!rda->threads) {
+    free(rda->files);
+    rda->files = 0;
+    return RDA_FAIL_NO_MEM;
+  }
+
+  pthread_mutex_init(&rda->mutex, 0);
+  pthread_cond_init(&rda->cond, 0);
+  while (rda->num_threads < num_threads) {
+    break_if(pthread_create(rda->threads + rda->num_threads, 0, run_reads,
+                            rda) != 0);
+    rda->num_threads++;
+  }
+  // Without any I/O thread, rda_wait reads the files itself.
+  return RDA_OK;
+}
+
+const struct RDAFile *
+rda_wait(struct ReadAhead *rda, int k) {
+  assert(rda);
+  assert(k >= 0 && k < rda->list->num);
+
+  struct RDAFile *file = rda->files + k;
+  if (rda->num_threads == 0) {
+    file->res = read_file(rda->list->paths[rda->list->order[k]], file);
+  }
+  else {
+    uint64_t t = trace_begin();
+    pthread_mutex_lock(&rda->mutex);
+    while (file->res == RDA_PENDING) {
+      pthread_cond_wait(&rda->cond, &rda->mutex);
+    }
+    pthread_mutex_unlock(&rda->mutex);
+    trace_end("wait_read", 0, t);
+  }
+  errno = file->err;
+  return file;
+}
+
+void *
+rda_take(struct ReadAhead *rda, int k) {
+  assert(rda);
+  assert(k >= 0 && k < rda->list->num);
+  assert(rda->files[k].res == RDA_OK);
+
+  // The size stays, so rda_release still accounts for it.
+  void *data = rda->files[k].data;
+  rda->files[k].data = 0;
+  return data;
+}
+
+void
+rda_release(struct ReadAhead *rda, int k) {
+  assert(rda);
+  assert(k == rda->released);
+
+  pthread_mutex_lock(&rda->mutex);
+  free(rda->files[k].data);
+  rda->bytes -= rda->files[k].size;
+  rda->files[k] = (struct RDAFile) {0, 0, RDA_OK, 0};
+  rda->released++;
+  pthread_cond_broadcast(&rda->cond);
+  pthread_mutex_unlock(&rda->mutex);
+}
+
+void
+rda_stop(struct ReadAhead *rda) {
+  assert(rda);
+  if (!rda->files) {
+    return;
+  }
+
+  pthread_mutex_lock(&rda->mutex);
+  rda->stop = 1;
+  pthread_cond_broadcast(&rda->cond);
+  pthread_mutex_unlock(&rda->mutex);
+  for (int i = 0; i < rda->num_threads; i++) {
+    pthread_join(rda->threads[i], 0);
+  }
+  for (int i = rda->released; i < rda->list->num; i++) {
+    free(rda->files[i].data);
+  }
+  pthread_mutex_destroy(&rda->mutex);
+  pthread_cond_destroy(&rda->cond);
+  free(rda->threads);
+  free(rda->files);
+  memset(rda, 0, sizeof *rda);
+}
+
+const char *
+rda_strerror(int code) {
+  switch (code) {
+    case RDA_FAIL_LIBC:
+      return strerror(errno);
+    case RDA_FAIL_NO_MEM:
+      return "Out of memory";
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "Inputs.h"
+
+enum {
+  RDA_OK = 0,
+  RDA_FAIL_LIBC = -1,
+  RDA_FAIL_NO_MEM = -2
+};
+
+struct RDAFile {
+  void *data;
+  size_t size;
+
+  // One of the RDA_* codes once the file has been read, 1 before that.
+  int res;
+  int err;
+};
+
+/**
+ * Reads whole input files into memory ahead of their use, on a few I/O
+ * threads, so reading the next files overlaps with decoding the current one.
+ *
+ * Files are read in the list's order (see inputs_plan) and handed out in that
+ * same order. At most window files and about max_bytes bytes are held at any
+ * time, counting the ones waiting to be released.
+ */
+struct ReadAhead {
+  const struct InputList *list;
+  struct RDAFile *files;
+  int next, released, stop;
+  size_t bytes;
+  size_t max_bytes;
+  int window;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int num_threads;
+  pthread_t *threads;
+};
+
+int
+rda_start(struct ReadAhead *rda,
+          const struct InputList *list,
+          int window,
+          size_t max_bytes);
+
+/**
+ * Waits for the k-th file (in read order) and returns it. On failure,
+ * file->res is negative and errno is set to the error of the read.
+ */
+const struct RDAFile *
+rda_wait(struct ReadAhead *rda, int k);
+
+/**
+ * Hands the k-th file's data over to the caller, who must free it. The file
+ * still has to be released.
+ */
+void *
+rda_take(struct ReadAhead *rda, int k);
+
+/**
+ * Frees the k-th file's data. Files are expected to be released in order.
+ */
+void
+rda_release(struct ReadAhead *rda, int k);
+
+/**
+ * Stops the I/O threads and frees everything. Can be called at any point
+ * after rda_start, even if some files were never waited for.
+ */
+void
+rda_stop(struct ReadAhead *rda);
+
+const char *
+rda_strerror(int code);
+
+#endif
@@ -4,14 +4,34 @@
 #include <SDL2/SDL.h>
 
 struct NamedSurface {
+  // Null for images decoded straight into the atlas, once it's packed. Their
+  // encoded file is kept in data until then.
   SDL_Surface *surf;
+  void *data;
+  size_t size;
+
   const char *name;
   int index;
+  int w, h;
+};
+
+/**
+ * How an image is flipped relative to the pixels of its region: left to
+ * right, top to bottom, or both (a 180 degrees rotation).
+ */
+enum {
+  REGION_FLIP_NONE = 0,
+  REGION_FLIP_H = 1,
+  REGION_FLIP_V = 2
 };
 
 struct RegionInfo {
   SDL_Rect rect;
   struct NamedSurface *img;
+
+  // REGION_FLIP_* flags. bin_pack_2d never flips images, but imgpacker -u
+  // draws copies of an image from its region (see Dedup.h).
+  int flip;
 };
 
 #endif
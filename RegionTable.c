@@ -0,0 +1,171 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "XFlow.h"
+#include "RegionInfo.h"
+#include "RegionTable.h"
+#include "AU.h"
+
+static inline void
+store_u32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+static inline uint32_t
+load_u32(const unsigned char *p) {
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+         (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+uint32_t
+regtab_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int
+regtab_build(AU_ByteBuilder *b1,
+             const struct RegionInfo *regions,
+             int num_regions)
+{
+  assert(regions);
+  assert(num_regions > 0);
+
+  uint64_t pool_size = 0;
+  for (int i = 0; i < num_regions; i++) {
+    pool_size += strlen(regions[i].img->name) + 1;
+  }
+
+  uint32_t num_slots = 1;
+  while (num_slots < 2*(uint64_t) num_regions) {
+    return_if(num_slots > UINT32_MAX/2, REGTAB_FAIL_TOO_LARGE);
+    num_slots *= 2;
+  }
+
+  const uint64_t records_offset = REGTAB_HEADER_SIZE;
+  const uint64_t slots_offset = records_offset +
+                                (uint64_t) num_regions*REGTAB_RECORD_SIZE;
+  const uint64_t pool_offset = slots_offset +
+                               (uint64_t) num_slots*REGTAB_SLOT_SIZE;
+  const uint64_t size = pool_offset + pool_size;
+  return_if(size > UINT32_MAX, REGTAB_FAIL_TOO_LARGE);
+
+  unsigned char *table = AU_B1_AppendForSetup(b1, size);
+  return_if(!table, REGTAB_FAIL_NO_MEM);
+
+  memcpy(table, "IPRT", 4);
+  store_u32(table+4, REGTAB_VERSION);
+  store_u32(table+8, num_regions);
+  store_u32(table+12, num_slots);
+  store_u32(table+16, records_offset);
+  store_u32(table+20, slots_offset);
+  store_u32(table+24, pool_offset);
+  store_u32(table+28, pool_size);
+
+  unsigned char *slots = table + slots_offset;
+  memset(slots, 0, (size_t) num_slots*REGTAB_SLOT_SIZE);
+
+  unsigned char *rec = table + records_offset;
+  char *pool = (char*) table + pool_offset;
+  uint32_t name_offset = 0;
+  for (int i = 0; i < num_regions; i++) {
+    const struct RegionInfo *reg = regions + i;
+    size_t name_len = strlen(reg->img->name);
+    store_u32(rec, reg->rect.x);
+    store_u32(rec+4, reg->rect.y);
+    store_u32(rec+8, reg->rect.w);
+    store_u32(rec+12, reg->rect.h);
+    store_u32(rec+16, name_offset);
+    store_u32(rec+20, name_len);
+    memcpy(pool + name_offset, reg->img->name, name_len + 1);
+    name_offset += name_len + 1;
+    rec += REGTAB_RECORD_SIZE;
+
+    uint32_t hash = regtab_hash(reg->img->name, name_len);
+    uint32_t slot = hash & (num_slots - 1);
+    while (load_u32(slots + slot*REGTAB_SLOT_SIZE + 4) != 0) {
+      slot = (slot + 1) & (num_slots - 1);
+    }
+    store_u32(slots + slot*REGTAB_SLOT_SIZE, hash);
+    store_u32(slots + slot*REGTAB_SLOT_SIZE + 4, i + 1);
+  }
+
+  return REGTAB_OK;
+}
+
+int
+regtab_save(const char *filename,
+            const struct RegionInfo *regions,
+            int num_regions)
+{
+  assert(filename);
+  assert(*filename);
+
+  AU_ByteBuilder b1;
+  return_if(AU_B1_Setup(&b1, REGTAB_HEADER_SIZE) < 0, REGTAB_FAIL_NO_MEM);
+
+  int res = regtab_build(&b1, regions, num_regions);
+  if (res == REGTAB_OK) {
+    size_t size = AU_B1_GetUsedCount(&b1);
+    FILE *fp = fopen(filename, "wb");
+    res = REGTAB_FAIL_LIBC;
+    if (fp) {
+      int ok = fwrite(AU_B1_GetMemory(&b1), 1, size, fp) == size;
+      if (fclose(fp) == 0 && ok) {
+        res = REGTAB_OK;
+      }
+    }
+  }
+  free(AU_B1_GetMemory(&b1));
+  return res;
+}
+
+long
+regtab_lookup(const void *table, const char *name) {
+  assert(table);
+  assert(name);
+
+  const unsigned char *t = table;
+  const uint32_t num_slots = load_u32(t+12);
+  const unsigned char *recs = t + load_u32(t+16);
+  const unsigned char *slots = t + load_u32(t+20);
+  const char *pool = (const char*) t + load_u32(t+24);
+  const size_t len = strlen(name);
+  const uint32_t hash = regtab_hash(name, len);
+
+  for (uint32_t slot = hash & (num_slots - 1);;
+       slot = (slot + 1) & (num_slots - 1))
+  {
+    const unsigned char *s = slots + (size_t) slot*REGTAB_SLOT_SIZE;
+    uint32_t index = load_u32(s+4);
+    return_if(index == 0, -1);
+    continue_if(load_u32(s) != hash);
+    const unsigned char *rec = recs + (size_t) (index-1)*REGTAB_RECORD_SIZE;
+    continue_if(load_u32(rec+20) != len);
+    return_if(!memcmp(pool + load_u32(rec+16), name, len), index - 1);
+  }
+}
+
+const char *
+regtab_strerror(int code) {
+  switch (code) {
+    case REGTAB_FAIL_LIBC:
+      return strerror(errno);
+    case REGTAB_FAIL_NO_MEM:
+      return "Out of memory";
+    case REGTAB_FAIL_TOO_LARGE:
+      return "Regions table too large";
+  }
+  return 0;
+}
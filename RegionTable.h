@@ -0,0 +1,71 @@
+#ifndef REGION_TABLE_H
+#define REGION_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "RegionInfo.h"
+#include "AU.h"
+
+/*
+ * Binary regions table, meant to be mmap'd and used in place. All integers
+ * are little endian.
+ *
+ *   header (8 x u32):
+ *     magic "IPRT", version, number of regions, number of hash slots
+ *     (a power of two), records offset, hash slots offset, string pool
+ *     offset, string pool size
+ *   records (6 x u32 each, in input order):
+ *     x, y, w, h (signed), name offset (into the pool), name length
+ *   hash slots (2 x u32 each):
+ *     hash of the name, record index + 1 (0 for an empty slot)
+ *   string pool:
+ *     NUL terminated names
+ *
+ * Names are hashed with 32 bits FNV-1a (regtab_hash) and the slots are
+ * probed linearly, starting at hash & (number of slots - 1). At most half
+ * the slots are used.
+ */
+
+enum {
+  REGTAB_OK = 0,
+  REGTAB_FAIL_LIBC = -1,
+  REGTAB_FAIL_NO_MEM = -2,
+  REGTAB_FAIL_TOO_LARGE = -3
+};
+
+enum {
+  REGTAB_VERSION = 1,
+  REGTAB_HEADER_SIZE = 32,
+  REGTAB_RECORD_SIZE = 24,
+  REGTAB_SLOT_SIZE = 8
+};
+
+uint32_t
+regtab_hash(const char *name, size_t len);
+
+/**
+ * Appends the table for the regions to b1.
+ */
+int
+regtab_build(AU_ByteBuilder *b1,
+             const struct RegionInfo *regions,
+             int num_regions);
+
+int
+regtab_save(const char *filename,
+            const struct RegionInfo *regions,
+            int num_regions);
+
+/**
+ * Looks name up in a table made by regtab_build. Returns the record index,
+ * or -1 if there's no such name. With duplicated names, the first one in
+ * input order is found.
+ */
+long
+regtab_lookup(const void *table, const char *name);
+
+const char *
+regtab_strerror(int code);
+
+#endif
@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "XFlow.h"
+#include "Stats.h"
+#include "Trace.h"
+
+struct Phase {
+  int ran;
+  uint64_t start_ns, total_ns;
+  uint64_t bytes_read, bytes_written;
+  uint64_t pixels;
+};
+
+static const char *phase_names[STATS_NUM_PHASES] = {
+  [STATS_PHASE_INPUTS] = "inputs",
+  [STATS_PHASE_LOAD] = "load",
+  [STATS_PHASE_DEDUP] = "dedup",
+  [STATS_PHASE_PACK] = "pack",
+  [STATS_PHASE_BLIT] = "blit",
+  [STATS_PHASE_DECODE] = "decode",
+  [STATS_PHASE_MIPMAPS] = "mipmaps",
+  [STATS_PHASE_SCALES] = "scales",
+  [STATS_PHASE_IMAGE_OUT] = "image_out",
+  [STATS_PHASE_CSV_OUT] = "csv_out",
+  [STATS_PHASE_BIN_OUT] = "bin_out",
+  [STATS_PHASE_CODE_OUT] = "code_out"
+};
+
+static struct Phase phases[STATS_NUM_PHASES];
+static uint64_t first_ns;
+static int num_images, num_threads;
+static int atlas_w, atlas_h, atlas_shards;
+static uint64_t image_pixels;
+
+void
+stats_begin(int phase) {
+  assert(phase >= 0 && phase < STATS_NUM_PHASES);
+
+  phases[phase].start_ns = trace_now();
+  phases[phase].ran = 1;
+  if (!first_ns) {
+    first_ns = phases[phase].start_ns;
+  }
+}
+
+void
+stats_end(int phase) {
+  assert(phase >= 0 && phase < STATS_NUM_PHASES);
+  assert(phases[phase].ran);
+
+  phases[phase].total_ns += trace_now() - phases[phase].start_ns;
+  trace_end(phase_names[phase], 0, phases[phase].start_ns);
+}
+
+void
+stats_add_read(int phase, uint64_t bytes) {
+  phases[phase].bytes_read += bytes;
+}
+
+void
+stats_add_written(int phase, const char *filename) {
+  struct stat st;
+  if (stat(filename, &st) == 0) {
+    phases[phase].bytes_written += st.st_size;
+  }
+}
+
+void
+stats_add_pixels(int phase, uint64_t pixels) {
+  phases[phase].pixels += pixels;
+}
+
+void
+stats_set_counts(int images, int threads) {
+  num_images = images;
+  num_threads = threads;
+}
+
+void
+stats_set_atlas(int w, int h, uint64_t pixels, int shards) {
+  atlas_w = w;
+  atlas_h = h;
+  image_pixels = pixels;
+  atlas_shards = shards;
+}
+
+static uint64_t
+peak_rss(void) {
+  struct rusage ru;
+  return_if(getrusage(RUSAGE_SELF, &ru) < 0, 0);
+#ifdef __APPLE__
+  return ru.ru_maxrss;
+#else
+  // Kilobytes everywhere else that matters.
+  return (uint64_t) ru.ru_maxrss * 1024;
+#endif
+}
+
+int
+stats_save(const char *filename) {
+  assert(filename);
+  assert(*filename);
+
+  FILE *fp = fopen(filename, "w");
+  return_if(!fp, STATS_FAIL_LIBC);
+
+  uint64_t total_ns = first_ns ? trace_now() - first_ns : 0;
+  uint64_t atlas_pixels = (uint64_t) atlas_w * atlas_h;
+  double occupancy = atlas_pixels ? (double) image_pixels/atlas_pixels : 0;
+
+  fprintf(fp, "{\n"
+              "  \"version\": 1,\n"
+              "  \"images\": %d,\n"
+              "  \"threads\": %d,\n"
+              "  \"total_seconds\": %.6f,\n"
+              "  \"peak_rss_bytes\": %llu,\n"
+              "  \"atlas\": {\"width\": %d, \"height\": %d, "
+              "\"image_pixels\": %llu, \"occupancy\": %.6f, "
+              "\"shards\": %d},\n"
+              "  \"phases\": [",
+          num_images, num_threads, total_ns/1e9,
+          (unsigned long long) peak_rss(), atlas_w, atlas_h,
+          (unsigned long long) image_pixels, occupancy, atlas_shards);
+
+  const char *sep = "\n";
+  for (int i = 0; i < STATS_NUM_PHASES; i++) {
+    const struct Phase *ph = phases + i;
+    continue_if(!ph->ran);
+    fprintf(fp, "%s    {\"name\": \"%s\", \"seconds\": %.6f, "
+                "\"bytes_read\": %llu, \"bytes_written\": %llu, "
+                "\"pixels\": %llu}",
+            sep, phase_names[i], ph->total_ns/1e9,
+            (unsigned long long) ph->bytes_read,
+            (unsigned long long) ph->bytes_written,
+            (unsigned long long) ph->pixels);
+    sep = ",\n";
+  }
+  fputs("\n  ]\n}\n", fp);
+
+  int ok = !ferror(fp);
+  return_if(fclose(fp) != 0 || !ok, STATS_FAIL_LIBC);
+  return STATS_OK;
+}
+
+const char *
+stats_strerror(int code) {
+  switch (code) {
+    case STATS_FAIL_LIBC:
+      return strerror(errno);
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+enum {
+  STATS_OK = 0,
+  STATS_FAIL_LIBC = -1
+};
+
+enum {
+  STATS_PHASE_INPUTS,
+  STATS_PHASE_LOAD,
+  STATS_PHASE_DEDUP,
+  STATS_PHASE_PACK,
+  STATS_PHASE_BLIT,
+  STATS_PHASE_DECODE,
+  STATS_PHASE_MIPMAPS,
+  STATS_PHASE_SCALES,
+  STATS_PHASE_IMAGE_OUT,
+  STATS_PHASE_CSV_OUT,
+  STATS_PHASE_BIN_OUT,
+  STATS_PHASE_CODE_OUT,
+  STATS_NUM_PHASES
+};
+
+/**
+ * Phase statistics for the run. They're cheap enough to always be gathered:
+ * a couple of clock readings per phase, and counters. Only the thread
+ * running the phases is meant to call these.
+ *
+ * A phase can begin and end several times; its durations add up.
+ */
+void
+stats_begin(int phase);
+
+void
+stats_end(int phase);
+
+void
+stats_add_read(int phase, uint64_t bytes);
+
+/**
+ * Adds the size of filename, once written, to the phase's bytes written.
+ */
+void
+stats_add_written(int phase, const char *filename);
+
+void
+stats_add_pixels(int phase, uint64_t pixels);
+
+void
+stats_set_counts(int num_images, int num_threads);
+
+/**
+ * image_pixels is the sum of the areas of the images in the atlas, packed in
+ * that many shards (see BinPack2D.h).
+ */
+void
+stats_set_atlas(int w, int h, uint64_t image_pixels, int shards);
+
+/**
+ * Writes everything as a JSON object: the phases that ran (with their
+ * seconds, bytes read and written and pixels), the atlas size and occupancy,
+ * the total run time and the peak resident set size.
+ */
+int
+stats_save(const char *filename);
+
+const char *
+stats_strerror(int code);
+
+#endif
@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "XFlow.h"
+#include "Trace.h"
+
+struct Span {
+  const char *name;
+  const char *detail;
+  uint64_t begin, end;
+};
+
+struct Ring {
+  struct Ring *next;
+  int tid;
+  uint64_t count;
+  struct Span spans[TRACE_RING_SIZE];
+};
+
+int trace_on;
+
+// Every ring ever created, pushed with a CAS. Rings outlive their threads.
+static struct Ring *rings;
+static int next_tid;
+static __thread struct Ring *local;
+
+uint64_t
+trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+static struct Ring *
+new_ring(void) {
+  struct Ring *ring = malloc(sizeof *ring);
+  return_if(!ring, 0);
+  ring->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+  ring->count = 0;
+  ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+  {
+  }
+  return ring;
+}
+
+void
+trace_enable(void) {
+  // The calling thread gets the first ring, and shows up as "main".
+  local = new_ring();
+  trace_on = 1;
+}
+
+void
+trace_add(const char *name, const char *detail, uint64_t begin) {
+  assert(name);
+
+  if (!local) {
+    local = new_ring();
+    // Without memory, spans are dropped rather than failing the run.
+    if (!local) {
+      return;
+    }
+  }
+  struct Span *span = local->spans + local->count % TRACE_RING_SIZE;
+  *span = (struct Span) {name, detail, begin, trace_now()};
+  __atomic_store_n(&local->count, local->count + 1, __ATOMIC_RELEASE);
+}
+
+static void
+write_json_string(FILE *fp, const char *str) {
+  putc('"', fp);
+  for (const unsigned char *c = (const unsigned char*) str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(fp, "\\%c", *c);
+    }
+    else if (*c < 0x20) {
+      fprintf(fp, "\\u%04x", *c);
+    }
+    else {
+      putc(*c, fp);
+    }
+  }
+  putc('"', fp);
+}
+
+int
+trace_save(const char *filename) {
+  assert(filename);
+  assert(*filename);
+
+  FILE *fp = fopen(filename, "w");
+  return_if(!fp, TRACE_FAIL_LIBC);
+
+  // Timestamps are relative to the earliest span, in microseconds.
+  struct Ring *head = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  uint64_t origin = UINT64_MAX;
+  for (struct Ring *ring = head; ring; ring = ring->next) {
+    uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+    uint64_t first = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+    for (uint64_t i = first; i < count; i++) {
+      const struct Span *span = ring->spans + i % TRACE_RING_SIZE;
+      if (span->begin < origin) {
+        origin = span->begin;
+      }
+    }
+  }
+
+  fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", fp);
+  const char *sep = "\n";
+  for (struct Ring *ring = head; ring; ring = ring->next) {
+    fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                "\"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+            sep, ring->tid, ring->tid == 1 ? "main" : "thread", ring->tid);
+    sep = ",\n";
+
+    uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+    uint64_t first = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+    for (uint64_t i = first; i < count; i++) {
+      const struct Span *span = ring->spans + i % TRACE_RING_SIZE;
+      fputs(sep, fp);
+      fputs("{\"name\": ", fp);
+      write_json_string(fp, span->name);
+      fprintf(fp, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                  "\"ts\": %.3f, \"dur\": %.3f",
+              ring->tid, (span->begin - origin)/1e3,
+              (span->end - span->begin)/1e3);
+      if (span->detail) {
+        fputs(", \"args\": {\"detail\": ", fp);
+        write_json_string(fp, span->detail);
+        putc('}', fp);
+      }
+      putc('}', fp);
+    }
+  }
+  fputs("\n]}\n", fp);
+
+  int ok = !ferror(fp);
+  return_if(fclose(fp) != 0 || !ok, TRACE_FAIL_LIBC);
+  return TRACE_OK;
+}
+
+void
+trace_free(void) {
+  struct Ring *ring = __atomic_exchange_n(&rings, 0, __ATOMIC_ACQUIRE);
+  while (ring) {
+    struct Ring *next = ring->next;
+    free(ring);
+    ring = next;
+  }
+  local = 0;
+}
+
+const char *
+trace_strerror(int code) {
+  switch (code) {
+    case TRACE_FAIL_LIBC:
+      return strerror(errno);
+  }
+  return 0;
+}
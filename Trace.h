@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+enum {
+  TRACE_OK = 0,
+  TRACE_FAIL_LIBC = -1
+};
+
+/**
+ * Spans of work on every thread, written out in the Chrome trace event
+ * format (chrome://tracing, Perfetto).
+ *
+ * Each thread appends to its own ring buffer, so appending takes no lock.
+ * When a thread records more than TRACE_RING_SIZE spans, its oldest ones are
+ * overwritten.
+ *
+ * Tracing is off unless trace_enable is called, and then a span costs a
+ * branch:
+ *
+ *   uint64_t t = trace_begin();
+ *   ...
+ *   trace_end("blit", name, t);
+ *
+ * Span names and details aren't copied, so they must stay valid until
+ * trace_save.
+ */
+enum {
+  TRACE_RING_SIZE = 1 << 14
+};
+
+extern int trace_on;
+
+/**
+ * Must be called from the main thread, before the threads to be traced are
+ * started.
+ */
+void
+trace_enable(void);
+
+uint64_t
+trace_now(void);
+
+void
+trace_add(const char *name, const char *detail, uint64_t begin);
+
+static inline uint64_t
+trace_begin(void) {
+  return trace_on ? trace_now() : 0;
+}
+
+/**
+ * detail can be null. It's shown as the span's "detail" argument, usually
+ * the file the span worked on.
+ */
+static inline void
+trace_end(const char *name, const char *detail, uint64_t begin) {
+  if (trace_on) {
+    trace_add(name, detail, begin);
+  }
+}
+
+/**
+ * Only to be called when the traced threads are done.
+ */
+int
+trace_save(const char *filename);
+
+void
+trace_free(void);
+
+const char *
+trace_strerror(int code);
+
+#endif
@@ -0,0 +1,171 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "XFlow.h"
+#include "Watch.h"
+
+enum {
+  // How long no event must come for a batch of changes to be over.
+  WATCH_SETTLE_MS = 20,
+  WATCH_BUFFER_SIZE = 16 << 10
+};
+
+#ifdef __linux__
+
+int
+watch_start(struct Watch *watch, const struct InputList *list) {
+  assert(watch);
+  assert(list);
+
+  memset(watch, 0, sizeof *watch);
+  watch->list = list;
+  watch->fd = inotify_init1(IN_CLOEXEC);
+  return_if(watch->fd < 0, WATCH_FAIL_LIBC);
+
+  int res = WATCH_FAIL_NO_MEM;
+  watch->wds = malloc(list->num * sizeof *watch->wds);
+  watch->names = malloc(list->num * sizeof *watch->names);
+  goto_if(!watch->wds || !watch->names, err);
+
+  /*
+   * Adding the same directory again gives back the same watch, so there's no
+   * need to dedup them here.
+   */
+  for (int i = 0; i < list->num; i++) {
+    const char *path = list->paths[i];
+    const char *slash = strrchr(path, '/');
+    watch->names[i] = slash ? slash + 1 : path;
+
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path)
+                      : strdup(".");
+    res = WATCH_FAIL_NO_MEM;
+    goto_if(!dir, err);
+    watch->wds[i] = inotify_add_watch(watch->fd, dir,
+                                      IN_CLOSE_WRITE | IN_MOVED_TO);
+    free(dir);
+    res = WATCH_FAIL_LIBC;
+    goto_if(watch->wds[i] < 0, err);
+  }
+  return WATCH_OK;
+
+err:
+  watch_stop(watch);
+  return res;
+}
+
+static int
+read_events(struct Watch *watch, unsigned char *changed) {
+  char buf[WATCH_BUFFER_SIZE]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t n = read(watch->fd, buf, sizeof buf);
+  if (n < 0) {
+    return_if(errno == EINTR, WATCH_OK);
+    return WATCH_FAIL_LIBC;
+  }
+
+  const struct InputList *list = watch->list;
+  for (char *p = buf; p < buf + n;) {
+    const struct inotify_event *ev = (const struct inotify_event*) p;
+    p += sizeof *ev + ev->len;
+    if (ev->mask & IN_Q_OVERFLOW) {
+      // Events were lost, so anything could have changed.
+      memset(changed, 1, list->num);
+      continue;
+    }
+    continue_if(!ev->len);
+    for (int i = 0; i < list->num; i++) {
+      if (watch->wds[i] == ev->wd && !strcmp(watch->names[i], ev->name)) {
+        changed[i] = 1;
+      }
+    }
+  }
+  return WATCH_OK;
+}
+
+int
+watch_wait(struct Watch *watch, unsigned char *changed) {
+  assert(watch);
+  assert(changed);
+
+  const struct InputList *list = watch->list;
+  memset(changed, 0, list->num);
+  int num_changed = 0;
+  while (num_changed == 0) {
+    struct pollfd pfd = {watch->fd, POLLIN, 0};
+    int timeout = -1;
+    for (;;) {
+      int ready = poll(&pfd, 1, timeout);
+      if (ready < 0 && errno == EINTR) {
+        continue;
+      }
+      return_if(ready < 0, WATCH_FAIL_LIBC);
+      break_if(ready == 0);
+      int res = read_events(watch, changed);
+      return_if(res < 0, res);
+      timeout = WATCH_SETTLE_MS;
+    }
+    for (int i = 0; i < list->num; i++) {
+      num_changed += changed[i];
+    }
+  }
+  return num_changed;
+}
+
+void
+watch_stop(struct Watch *watch) {
+  assert(watch);
+  if (watch->fd > 0) {
+    close(watch->fd);
+  }
+  free(watch->wds);
+  free(watch->names);
+  memset(watch, 0, sizeof *watch);
+}
+
+#else
+
+int
+watch_start(struct Watch *watch, const struct InputList *list) {
+  assert(watch);
+  assert(list);
+  memset(watch, 0, sizeof *watch);
+  return WATCH_FAIL_UNSUPPORTED;
+}
+
+int
+watch_wait(struct Watch *watch, unsigned char *changed) {
+  (void) watch;
+  (void) changed;
+  return WATCH_FAIL_UNSUPPORTED;
+}
+
+void
+watch_stop(struct Watch *watch) {
+  assert(watch);
+  memset(watch, 0, sizeof *watch);
+}
+
+#endif
+
+const char *
+watch_strerror(int code) {
+  switch (code) {
+    case WATCH_FAIL_LIBC:
+      return strerror(errno);
+    case WATCH_FAIL_NO_MEM:
+      return "Out of memory";
+    case WATCH_FAIL_UNSUPPORTED:
+      return "Watching files is only supported on Linux";
+  }
+  return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "Inputs.h"
+
+enum {
+  WATCH_OK = 0,
+  WATCH_FAIL_LIBC = -1,
+  WATCH_FAIL_NO_MEM = -2,
+  WATCH_FAIL_UNSUPPORTED = -3
+};
+
+/**
+ * Watches the input files for changes, through inotify (Linux only).
+ *
+ * The directories holding the files are watched rather than the files, so
+ * editors that save by writing a new file and renaming it over the old one
+ * are seen too. Only files in the list are reported; files created later are
+ * ignored.
+ */
+struct Watch {
+  int fd;
+  const struct InputList *list;
+
+  // Indexed like list->paths: the watch of each file's directory and the
+  // file's name in it.
+  int *wds;
+  const char **names;
+};
+
+int
+watch_start(struct Watch *watch, const struct InputList *list);
+
+/**
+ * Blocks until some files change, then keeps collecting changes until none
+ * came for a short while, so a save touching a file several times (or
+ * several files) is seen once. changed (indexed like list->paths) is set to
+ * 1 for the files that changed and 0 for the others.
+ *
+ * Returns how many files changed, or a negative code.
+ */
+int
+watch_wait(struct Watch *watch, unsigned char *changed);
+
+void
+watch_stop(struct Watch *watch);
+
+const char *
+watch_strerror(int code);
+
+#endif
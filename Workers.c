@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "XFlow.h"
+#include "Workers.h"
+
+enum {
+  WORKERS_MAX_THREADS = 256
+};
+
+struct ParallelFor {
+  size_t n, grain;
+  size_t next; // Only accessed through __atomic builtins.
+  void (*fn)(void *ctx, size_t begin, size_t end);
+  void *ctx;
+
+  // The rest is under the pool's mutex. How many more workers may join the
+  // loop, how many are running chunks of it, and the next loop in the pool.
+  size_t slots;
+  size_t running;
+  struct ParallelFor *next_loop;
+};
+
+static int num_workers;
+
+/*
+ * The pool. Its threads are started by the first loops that need them, and
+ * then wait for loops until the process exits. Several loops can run at
+ * once (from different threads, or from inside a chunk), each taking the
+ * idle threads it's allowed to.
+ */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loop_added = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t loop_left = PTHREAD_COND_INITIALIZER;
+static struct ParallelFor *loops;
+static size_t num_threads;
+
+void
+workers_set_count(int n) {
+  num_workers = n;
+}
+
+int
+workers_get_count(void) {
+  if (num_workers < 1) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = ncpus < 1 ? 1 : ncpus;
+  }
+  return num_workers < WORKERS_MAX_THREADS
+         ? num_workers
+         : WORKERS_MAX_THREADS;
+}
+
+static void
+run_chunks(struct ParallelFor *pf) {
+  for (;;) {
+    size_t begin = __atomic_fetch_add(&pf->next, pf->grain, __ATOMIC_RELAXED);
+    break_if(begin >= pf->n);
+    size_t end = pf->n - begin < pf->grain ? pf->n : begin + pf->grain;
+    pf->fn(pf->ctx, begin, end);
+  }
+}
+
+/**
+ * A loop with chunks left that can take one more thread, if any.
+ */
+static struct ParallelFor *
+find_loop(void) {
+  for (struct ParallelFor *pf = loops; pf; pf = pf->next_loop) {
+    return_if(pf->slots > 0 &&
+              __atomic_load_n(&pf->next, __ATOMIC_RELAXED) < pf->n, pf);
+  }
+  return 0;
+}
+
+static void *
+run_worker(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&mutex);
+  for (;;) {
+    struct ParallelFor *pf = find_loop();
+    if (!pf) {
+      pthread_cond_wait(&loop_added, &mutex);
+      continue;
+    }
+    pf->slots--;
+    pf->running++;
+    pthread_mutex_unlock(&mutex);
+    run_chunks(pf);
+    pthread_mutex_lock(&mutex);
+    if (--pf->running == 0) {
+      pthread_cond_broadcast(&loop_left);
+    }
+  }
+  return 0;
+}
+
+void
+workers_parallel_for(size_t n,
+                     size_t grain,
+                     void (*fn)(void *ctx, size_t begin, size_t end),
+                     void *ctx)
+{
+  assert(fn);
+  assert(grain > 0);
+
+  struct ParallelFor pf = {n, grain, 0, fn, ctx, 0, 0, 0};
+  size_t num_chunks = n/grain + (n % grain != 0);
+  size_t helpers = workers_get_count() - 1;
+  if (helpers >= num_chunks) {
+    helpers = num_chunks ? num_chunks - 1 : 0;
+  }
+  if (helpers == 0) {
+    run_chunks(&pf);
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  while (num_threads < helpers) {
+    pthread_t thread;
+    break_if(pthread_create(&thread, 0, run_worker, 0) != 0);
+    pthread_detach(thread);
+    num_threads++;
+  }
+  pf.slots = helpers;
+  pf.next_loop = loops;
+  loops = &pf;
+  pthread_cond_broadcast(&loop_added);
+  pthread_mutex_unlock(&mutex);
+
+  run_chunks(&pf);
+
+  pthread_mutex_lock(&mutex);
+  struct ParallelFor **link = &loops;
+  while (*link != &pf) {
+    link = &(*link)->next_loop;
+  }
+  *link = pf.next_loop;
+  while (pf.running > 0) {
+    pthread_cond_wait(&loop_left, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,34 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stddef.h>
+
+/**
+ * Sets how many threads (counting the calling one) the parallel loops are
+ * allowed to use. A value smaller than 1 means one thread per online CPU.
+ */
+void
+workers_set_count(int n);
+
+int
+workers_get_count(void);
+
+/**
+ * Calls fn over the [0, n) range split in chunks of at most grain elements.
+ * Chunks are handed out dynamically to the worker threads and to the calling
+ * thread, and this function returns once every chunk has been processed.
+ *
+ * The worker threads are a process-wide pool, started by the first loops
+ * that need them and kept for the next ones. Loops can run concurrently, and
+ * fn can start loops of its own.
+ *
+ * If threads can't be created, the calling thread processes the remaining
+ * chunks by itself, so the loop never fails.
+ */
+void
+workers_parallel_for(size_t n,
+                     size_t grain,
+                     void (*fn)(void *ctx, size_t begin, size_t end),
+                     void *ctx);
+
+#endif
@@ -0,0 +1,175 @@
+#!/bin/sh
+#
+# bench_e2e.sh IMGPACKER BENCHGEN BASELINE
+#
+# Runs IMGPACKER over the synthetic corpus written by BENCHGEN (reading the
+# image list, loading, packing, and writing the PNG and CSV outputs), several
+# times, and compares the medians of the wall time, the time of each phase
+# (from --stats), the peak RSS and the output sizes to those in BASELINE.
+# Exits with 1 if any of them went up by more than its tolerance. Run by
+# 'make bench-e2e'.
+#
+# The results are written to bench_output.txt, in the same format as
+# BASELINE: one 'metric value' per line, '#' starting comments. Timings and
+# memory use depend on the machine and the build flags, so BASELINE is only
+# meaningful on the machine it was recorded on. BENCH_UPDATE=1 records it
+# again from this run instead of comparing.
+#
+# Environment:
+#   BENCH_RUNS            Runs, of which the medians are taken (5).
+#   BENCH_COUNT           Images in the corpus (2000).
+#   BENCH_SEED            Seed of the corpus (1).
+#   BENCH_DIR             Where the corpus and outputs go (bench_corpus).
+#   BENCH_TIME_TOLERANCE  Allowed slowdown, in percent (20).
+#   BENCH_TIME_SLACK      Allowed slowdown in seconds, whatever the percent,
+#                         for phases too short to time reliably (0.02).
+#   BENCH_RSS_TOLERANCE   Allowed peak RSS growth, in percent (15).
+#   BENCH_SIZE_TOLERANCE  Allowed output growth, in percent (1).
+#   BENCH_UPDATE          Set to 1 to write BASELINE from this run.
+#   BENCH_FLAGS           The build flags, recorded with the results (set by
+#                         make). A warning is printed if BASELINE was
+#                         recorded with other ones.
+#
+# Wall times need a date(1) that prints nanoseconds with %N, which POSIX
+# doesn't have: GNU date, or gdate from coreutils on BSD and macOS.
+
+set -e
+
+if [ $# -ne 3 ]; then
+  echo "Usage: $0 IMGPACKER BENCHGEN BASELINE" >&2
+  exit 2
+fi
+imgpacker=$1
+benchgen=$2
+baseline=$3
+
+runs=${BENCH_RUNS:-5}
+count=${BENCH_COUNT:-2000}
+seed=${BENCH_SEED:-1}
+dir=${BENCH_DIR:-bench_corpus}
+output=bench_output.txt
+flags=${BENCH_FLAGS:-unknown}
+
+for date in date gdate; do
+  case $("$date" +%s%N 2>/dev/null) in
+    *[!0-9]* | '') date= ;;
+    *) break ;;
+  esac
+done
+if [ -z "$date" ]; then
+  echo "$0: needs a date (or gdate) supporting %N, like GNU date." >&2
+  exit 2
+fi
+
+# The corpus is only generated again when its parameters change.
+mkdir -p "$dir/out"
+if [ "$(cat "$dir/stamp" 2>/dev/null)" != "$count $seed" ]; then
+  echo "Generating $count images in $dir (seed $seed)."
+  rm -f "$dir/stamp" "$dir"/img*.*
+  "$benchgen" "$dir" "$count" "$seed"
+  echo "$count $seed" > "$dir/stamp"
+fi
+
+samples=$dir/out/samples
+: > "$samples"
+i=1
+while [ $i -le "$runs" ]; do
+  stats=$dir/out/stats.json
+  start=$("$date" +%s%N)
+  "$imgpacker" -o "$dir/out/atlas.png" -c "$dir/out/atlas.csv" \
+               --stats "$stats" -f "$dir/list.txt"
+  end=$("$date" +%s%N)
+  awk -v ns=$((end - start)) \
+      'BEGIN { printf "wall_seconds %.6f\n", ns/1e9 }' >> "$samples"
+
+  # --stats writes one field or one phase per line, so no JSON parser is
+  # needed.
+  awk '
+    /"total_seconds"/ { gsub(/[^0-9.]/, "", $2); print "total_seconds", $2 }
+    /"peak_rss_bytes"/ { gsub(/[^0-9]/, "", $2); print "peak_rss_bytes", $2 }
+    /"atlas"/ {
+      for (f = 1; f < NF; f++) {
+        if ($f == "{\"width\":" || $f == "\"height\":") {
+          v = $(f + 1); gsub(/[^0-9]/, "", v)
+          print "atlas_" ($f ~ /width/ ? "width" : "height"), v
+        }
+      }
+    }
+    /"name":/ {
+      name = $2; gsub(/[",]/, "", name)
+      secs = $4; gsub(/[^0-9.]/, "", secs)
+      written = $8; gsub(/[^0-9]/, "", written)
+      print "phase_" name "_seconds", secs
+      if (name ~ /_out$/) print name "_bytes", written
+    }' "$stats" >> "$samples"
+  i=$((i + 1))
+done
+
+# Medians, by metric.
+{
+  echo "# imgpacker end to end benchmark: $count images (seed $seed)," \
+       "median of $runs runs."
+  echo "# Only comparable to runs on the same machine, with the same flags."
+  echo "# Flags: $flags"
+  sort -k1,1 -k2,2n "$samples" | awk '
+    function flush() {
+      if (!n) return
+      m = n % 2 ? v[(n + 1)/2] : (v[n/2] + v[n/2 + 1])/2
+      printf key ~ /_seconds$/ ? "%s %.6f\n" : "%s %.0f\n", key, m
+    }
+    $1 != key { flush(); key = $1; n = 0 }
+    { v[++n] = $2 }
+    END { flush() }'
+} > "$output"
+cat "$output"
+
+if [ "${BENCH_UPDATE:-0}" = 1 ]; then
+  cp "$output" "$baseline"
+  echo "Baseline written to $baseline."
+  exit 0
+fi
+if [ ! -f "$baseline" ]; then
+  echo "No baseline in $baseline: run with BENCH_UPDATE=1 to record one." >&2
+  exit 1
+fi
+
+base_flags=$(sed -n 's/^# Flags: //p' "$baseline")
+if [ "$base_flags" != "$flags" ]; then
+  echo "Warning: $baseline was recorded with flags '$base_flags'," \
+       "not '$flags'." >&2
+fi
+
+# Only increases count as regressions. Metrics missing from either file are
+# reported but don't fail the comparison, so phases can be added.
+awk -v time_tol="${BENCH_TIME_TOLERANCE:-20}" \
+    -v time_slack="${BENCH_TIME_SLACK:-0.02}" \
+    -v rss_tol="${BENCH_RSS_TOLERANCE:-15}" \
+    -v size_tol="${BENCH_SIZE_TOLERANCE:-1}" '
+  /^#/ || NF < 2 { next }
+  FNR == NR { base[$1] = $2; next }
+  {
+    cur[$1] = $2
+    if (!($1 in base)) {
+      printf "%-28s %14s %14s  new\n", $1, "-", $2
+      next
+    }
+    b = base[$1]
+    if ($1 ~ /_seconds$/) { tol = time_tol; slack = time_slack }
+    else if ($1 == "peak_rss_bytes") { tol = rss_tol; slack = 0 }
+    else { tol = size_tol; slack = 0 }
+    change = b > 0 ? ($2 - b)*100/b : 0
+    bad = $2 > b*(1 + tol/100) && $2 - b > slack
+    printf "%-28s %14s %14s  %+7.1f%%%s\n", $1, b, $2, change,
+           bad ? "  REGRESSION (over " tol "%)" : ""
+    failed += bad
+  }
+  END {
+    for (m in base) {
+      if (!(m in cur)) printf "%-28s %14s %14s  gone\n", m, base[m], "-"
+    }
+    if (failed) {
+      printf "%d regression(s) against the baseline.\n", failed
+      exit 1
+    }
+    print "No regressions against the baseline."
+  }' "$baseline" "$output"
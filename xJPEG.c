@@ -0,0 +1,150 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+
+#include "xJPEG.h"
+
+/*
+ * libjpeg's default error handler exits the program, so errors longjmp back
+ * to the caller instead, with the message saved in the caller's buffer.
+ */
+struct ErrorMgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf env;
+  char *msg;
+};
+
+static void
+xjpeg_error_exit(j_common_ptr cinfo) {
+  struct ErrorMgr *err = (struct ErrorMgr*) cinfo->err;
+  char buf[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, buf);
+  if (err->msg) {
+    snprintf(err->msg, X_JPEG_MESSAGE_SIZE, "%s", buf);
+  }
+  longjmp(err->env, 1);
+}
+
+static void
+xjpeg_output_message(j_common_ptr cinfo) {
+  // Warnings are ignored.
+  (void) cinfo;
+}
+
+static int
+is_jpeg(const void *data, size_t size) {
+  const unsigned char *p = data;
+  return size >= 3 && p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF;
+}
+
+static int
+is_supported(const struct jpeg_decompress_struct *cinfo) {
+  return cinfo->jpeg_color_space != JCS_CMYK &&
+         cinfo->jpeg_color_space != JCS_YCCK &&
+         cinfo->image_width > 0 && cinfo->image_width <= INT_MAX &&
+         cinfo->image_height > 0 && cinfo->image_height <= INT_MAX;
+}
+
+int
+xjpeg_read_size(const void *data, size_t size, int *w, int *h) {
+  assert(data);
+  assert(w);
+  assert(h);
+
+  if (!is_jpeg(data, size) || size > ULONG_MAX) {
+    return X_JPEG_FAIL;
+  }
+
+  struct jpeg_decompress_struct cinfo;
+  struct ErrorMgr err;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = xjpeg_error_exit;
+  err.pub.output_message = xjpeg_output_message;
+  err.msg = 0;
+  if (setjmp(err.env)) {
+    jpeg_destroy_decompress(&cinfo);
+    return X_JPEG_FAIL;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (const unsigned char*) data, size);
+  jpeg_read_header(&cinfo, TRUE);
+  int res = X_JPEG_FAIL;
+  if (is_supported(&cinfo)) {
+    *w = cinfo.image_width;
+    *h = cinfo.image_height;
+    res = X_JPEG_OK;
+  }
+  jpeg_destroy_decompress(&cinfo);
+  return res;
+}
+
+int
+xjpeg_decode_rgba(const void *data,
+                  size_t size,
+                  void *pixels,
+                  size_t pitch,
+                  char *msg)
+{
+  assert(data);
+  assert(pixels);
+  assert(msg);
+
+  if (!is_jpeg(data, size) || size > ULONG_MAX) {
+    snprintf(msg, X_JPEG_MESSAGE_SIZE, "Not a JPEG file.");
+    return X_JPEG_FAIL;
+  }
+
+  struct jpeg_decompress_struct cinfo;
+  struct ErrorMgr err;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = xjpeg_error_exit;
+  err.pub.output_message = xjpeg_output_message;
+  err.msg = msg;
+  if (setjmp(err.env)) {
+    jpeg_destroy_decompress(&cinfo);
+    return X_JPEG_FAIL;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (const unsigned char*) data, size);
+  jpeg_read_header(&cinfo, TRUE);
+  if (!is_supported(&cinfo)) {
+    jpeg_destroy_decompress(&cinfo);
+    snprintf(msg, X_JPEG_MESSAGE_SIZE, "Unsupported JPEG color space.");
+    return X_JPEG_FAIL;
+  }
+
+#ifdef JCS_EXTENSIONS
+  // libjpeg-turbo writes the alpha channel itself.
+  cinfo.out_color_space = JCS_EXT_RGBA;
+#else
+  cinfo.out_color_space = JCS_RGB;
+#endif
+  jpeg_start_decompress(&cinfo);
+
+  unsigned char *row = pixels;
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW rows[1] = {row};
+    jpeg_read_scanlines(&cinfo, rows, 1);
+#ifndef JCS_EXTENSIONS
+    // RGB to RGBA in place, from the end so nothing is overwritten early.
+    for (size_t x = cinfo.output_width; x-- > 0;) {
+      row[4*x+3] = 0xFF;
+      row[4*x+2] = row[3*x+2];
+      row[4*x+1] = row[3*x+1];
+      row[4*x] = row[3*x];
+    }
+#endif
+    row += pitch;
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return X_JPEG_OK;
+}
@@ -0,0 +1,38 @@
+#ifndef X_JPEG_H
+#define X_JPEG_H
+
+#include <stddef.h>
+
+enum {
+  X_JPEG_FAIL = -1,
+  X_JPEG_OK = 0
+};
+
+enum {
+  X_JPEG_MESSAGE_SIZE = 200
+};
+
+/**
+ * Returns X_JPEG_OK and the image dimensions if data holds a JPEG file that
+ * xjpeg_decode_rgba can decode, X_JPEG_FAIL otherwise (CMYK files, for
+ * instance, are left to other decoders).
+ */
+int
+xjpeg_read_size(const void *data, size_t size, int *w, int *h);
+
+/**
+ * Decodes the JPEG file in data as 8 bits RGBA (in that byte order, with
+ * opaque alpha) into pixels, whose rows are pitch bytes apart.
+ *
+ * Can be called from several threads at once. On X_JPEG_FAIL, the error
+ * message is written to msg, which must have room for X_JPEG_MESSAGE_SIZE
+ * chars.
+ */
+int
+xjpeg_decode_rgba(const void *data,
+                  size_t size,
+                  void *pixels,
+                  size_t pitch,
+                  char *msg);
+
+#endif
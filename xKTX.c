@@ -0,0 +1,389 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "XFlow.h"
+#include "RegionInfo.h"
+#include "xKTX.h"
+#include "RegionTable.h"
+#include "AU.h"
+
+/*
+ * KTX2 layout written here (all integers are little endian):
+ *
+ *   identifier, header and index           80 bytes
+ *   level index                            24 bytes per level
+ *   data format descriptor                 dfd_size bytes
+ *   key/value data                         kvd_size bytes
+ *   for each level, from the smallest one to level 0:
+ *     zero padding up to the next page boundary
+ *     level pixel data
+ *   zero padding up to an 8 bytes boundary
+ *   regions table (optional, see RegionTable.h)
+ */
+
+enum {
+  KTX_PAGE_ALIGN = 4096,
+  KTX_HEADER_SIZE = 80,
+  KTX_LEVEL_INDEX_ENTRY_SIZE = 24,
+  KTX_MAX_LEVELS = 32,
+  KTX_VK_FORMAT_R8G8B8A8_UNORM = 37,
+  KTX_VK_FORMAT_BC1_RGBA_UNORM_BLOCK = 133,
+  KTX_VK_FORMAT_BC3_UNORM_BLOCK = 137,
+  KTX_DFD_SAMPLE_SIZE = 16,
+  KTX_DFD_BLOCK_HEADER_SIZE = 24,
+  KTX_DFD_MAX_SAMPLES = 4,
+  KTX_KHR_DF_MODEL_RGBSDA = 1,
+  KTX_KHR_DF_MODEL_BC1A = 128,
+  KTX_KHR_DF_MODEL_BC3 = 130,
+  KTX_KHR_DF_PRIMARIES_BT709 = 1,
+  KTX_KHR_DF_TRANSFER_LINEAR = 1,
+  KTX_KHR_DF_CHANNEL_BC1A_ALPHAPRESENT = 1,
+  KTX_KHR_DF_CHANNEL_ALPHA = 15
+};
+
+struct DFDSample {
+  int bit_offset, bit_length, channel;
+  uint32_t upper;
+};
+
+struct FormatInfo {
+  int vk_format, color_model, block_dim, block_bytes, num_samples;
+  struct DFDSample samples[KTX_DFD_MAX_SAMPLES];
+};
+
+/**
+ * Indexed by the X_KTX_FORMAT_* constants.
+ */
+static const struct FormatInfo format_info[] = {
+  {KTX_VK_FORMAT_R8G8B8A8_UNORM, KTX_KHR_DF_MODEL_RGBSDA, 1, 4, 4, {
+    {0, 8, 0, 255},
+    {8, 8, 1, 255},
+    {16, 8, 2, 255},
+    {24, 8, KTX_KHR_DF_CHANNEL_ALPHA, 255}}},
+  {KTX_VK_FORMAT_BC1_RGBA_UNORM_BLOCK, KTX_KHR_DF_MODEL_BC1A, 4, 8, 1, {
+    {0, 64, KTX_KHR_DF_CHANNEL_BC1A_ALPHAPRESENT, UINT32_MAX}}},
+  {KTX_VK_FORMAT_BC3_UNORM_BLOCK, KTX_KHR_DF_MODEL_BC3, 4, 16, 2, {
+    {0, 64, KTX_KHR_DF_CHANNEL_ALPHA, UINT32_MAX},
+    {64, 64, 0, UINT32_MAX}}}
+};
+
+static const unsigned char ktx2_identifier[12] = {
+  0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'
+};
+
+static const char kv_orientation_key[] = "KTXorientation";
+static const char kv_orientation_val[] = "rd";
+static const char kv_writer_key[] = "KTXwriter";
+static const char kv_writer_val[] = "imgpacker";
+static const char kv_regions_key[] = "imgpacker.regions";
+
+static inline uint64_t
+align_u64(uint64_t n, uint64_t boundary) {
+  return (n + boundary - 1)/boundary*boundary;
+}
+
+static inline void
+store_u32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+static inline void
+store_u64(unsigned char *p, uint64_t v) {
+  store_u32(p, v & 0xFFFFFFFF);
+  store_u32(p+4, v >> 32);
+}
+
+/**
+ * Size of a key/value entry, including the trailing padding.
+ */
+static inline uint64_t
+kv_entry_size(size_t key_size, size_t val_size) {
+  return align_u64(4 + key_size + val_size, 4);
+}
+
+static unsigned char *
+store_kv_entry(unsigned char *p,
+               const char *key, size_t key_size,
+               const void *val, size_t val_size)
+{
+  store_u32(p, key_size + val_size);
+  memcpy(p+4, key, key_size);
+  memcpy(p+4+key_size, val, val_size);
+  return p + kv_entry_size(key_size, val_size);
+}
+
+static void
+store_dfd_sample(unsigned char *p, int bit_offset, int bit_length,
+                 int channel, uint32_t upper)
+{
+  p[0] = bit_offset & 0xFF;
+  p[1] = (bit_offset >> 8) & 0xFF;
+  p[2] = bit_length - 1;
+  p[3] = channel;
+  store_u32(p+4, 0); // Sample position.
+  store_u32(p+8, 0); // Sample lower.
+  store_u32(p+12, upper);
+}
+
+static void
+store_dfd(unsigned char *p, const struct FormatInfo *fi) {
+  uint32_t size = 4 + KTX_DFD_BLOCK_HEADER_SIZE +
+                  KTX_DFD_SAMPLE_SIZE*fi->num_samples;
+  store_u32(p, size);
+  p += 4;
+  store_u32(p, 0); // Vendor id and descriptor type (Khronos, basic).
+  store_u32(p+4, 2 | (size - 4) << 16); // Version, block size.
+  p[8] = fi->color_model;
+  p[9] = KTX_KHR_DF_PRIMARIES_BT709;
+  p[10] = KTX_KHR_DF_TRANSFER_LINEAR;
+  p[11] = 0; // Flags: straight alpha.
+  p[12] = fi->block_dim - 1; // Texel block dimensions.
+  p[13] = fi->block_dim - 1;
+  p[14] = 0;
+  p[15] = 0;
+  memset(p+16, 0, 8);
+  p[16] = fi->block_bytes; // Bytes in plane 0.
+  p += KTX_DFD_BLOCK_HEADER_SIZE;
+  for (int i = 0; i < fi->num_samples; i++) {
+    const struct DFDSample *s = fi->samples + i;
+    store_dfd_sample(p, s->bit_offset, s->bit_length, s->channel, s->upper);
+    p += KTX_DFD_SAMPLE_SIZE;
+  }
+}
+
+static int
+write_zeros(FILE *fp, uint64_t n) {
+  static const unsigned char zeros[64];
+  while (n > 0) {
+    size_t chunk = n < sizeof zeros ? n : sizeof zeros;
+    return_if(fwrite(zeros, 1, chunk, fp) != chunk, X_KTX_FAIL_LIBC);
+    n -= chunk;
+  }
+  return X_KTX_OK;
+}
+
+struct Layout {
+  uint64_t dfd_offset, dfd_size;
+  uint64_t kvd_offset, kvd_size;
+  uint64_t data_offset;
+  uint64_t level_offsets[KTX_MAX_LEVELS];
+  uint64_t regions_offset;
+};
+
+static void
+compute_layout(const struct XKTXImage *img,
+               int has_regions,
+               struct Layout *lt)
+{
+  const struct FormatInfo *fi = format_info + img->format;
+  lt->dfd_offset = KTX_HEADER_SIZE + KTX_LEVEL_INDEX_ENTRY_SIZE*img->num_levels;
+  lt->dfd_size = 4 + KTX_DFD_BLOCK_HEADER_SIZE +
+                 KTX_DFD_SAMPLE_SIZE*fi->num_samples;
+  lt->kvd_offset = lt->dfd_offset + lt->dfd_size;
+  lt->kvd_size =
+    kv_entry_size(sizeof kv_orientation_key, sizeof kv_orientation_val) +
+    kv_entry_size(sizeof kv_writer_key, sizeof kv_writer_val);
+  if (has_regions) {
+    lt->kvd_size += kv_entry_size(sizeof kv_regions_key, 16);
+  }
+  lt->data_offset = align_u64(lt->kvd_offset + lt->kvd_size, KTX_PAGE_ALIGN);
+
+  // Levels are laid out from the smallest to the largest one.
+  uint64_t offset = lt->data_offset;
+  for (int i = img->num_levels - 1; i >= 0; i--) {
+    const struct XKTXLevel *lvl = img->levels + i;
+    lt->level_offsets[i] = offset;
+    offset = align_u64(offset + (uint64_t) lvl->row_size*lvl->rows,
+                       i > 0 ? KTX_PAGE_ALIGN : 8);
+  }
+  lt->regions_offset = offset;
+}
+
+int
+xktx_save(const char *filename,
+          const struct XKTXImage *img,
+          const struct RegionInfo *regions,
+          int num_regions)
+{
+  assert(img);
+  assert(filename);
+  assert(*filename);
+  assert(img->num_levels > 0);
+  assert(img->num_levels <= KTX_MAX_LEVELS);
+  assert(!regions || num_regions > 0);
+
+  const struct FormatInfo *fi = format_info + img->format;
+  int res = X_KTX_OK;
+  unsigned char *hdr = 0;
+  FILE *fp = 0;
+  AU_ByteBuilder regions_b1;
+  int has_regions = regions != 0;
+
+  if (has_regions) {
+    return_if(AU_B1_Setup(&regions_b1, REGTAB_HEADER_SIZE) < 0,
+              X_KTX_FAIL_NO_MEM);
+    int regtab_res = regtab_build(&regions_b1, regions, num_regions);
+    res = regtab_res == REGTAB_FAIL_TOO_LARGE
+          ? X_KTX_FAIL_TOO_LARGE
+          : X_KTX_FAIL_NO_MEM;
+    goto_if(regtab_res < 0, end);
+    res = X_KTX_OK;
+  }
+
+  struct Layout lt;
+  compute_layout(img, has_regions, &lt);
+  const uint64_t dfd_offset = lt.dfd_offset;
+  const uint64_t dfd_size = lt.dfd_size;
+  const uint64_t kvd_offset = lt.kvd_offset;
+  const uint64_t kvd_size = lt.kvd_size;
+  const uint64_t data_offset = lt.data_offset;
+  const uint64_t *level_offsets = lt.level_offsets;
+  const uint64_t regions_offset = lt.regions_offset;
+  uint64_t offset;
+
+  res = X_KTX_FAIL_NO_MEM;
+  hdr = calloc(data_offset, 1);
+  goto_if(!hdr, end);
+
+  memcpy(hdr, ktx2_identifier, sizeof ktx2_identifier);
+  store_u32(hdr+12, fi->vk_format);
+  store_u32(hdr+16, 1); // Type size.
+  store_u32(hdr+20, img->w);
+  store_u32(hdr+24, img->h);
+  store_u32(hdr+28, 0); // Depth.
+  store_u32(hdr+32, 0); // Layer count.
+  store_u32(hdr+36, 1); // Face count.
+  store_u32(hdr+40, img->num_levels);
+  store_u32(hdr+44, 0); // No supercompression.
+  store_u32(hdr+48, dfd_offset);
+  store_u32(hdr+52, dfd_size);
+  store_u32(hdr+56, kvd_offset);
+  store_u32(hdr+60, kvd_size);
+  store_u64(hdr+64, 0); // No supercompression global data.
+  store_u64(hdr+72, 0);
+
+  for (int i = 0; i < img->num_levels; i++) {
+    const struct XKTXLevel *lvl = img->levels + i;
+    uint64_t size = (uint64_t) lvl->row_size*lvl->rows;
+    unsigned char *entry = hdr + KTX_HEADER_SIZE +
+                           KTX_LEVEL_INDEX_ENTRY_SIZE*i;
+    store_u64(entry, level_offsets[i]);
+    store_u64(entry+8, size);
+    store_u64(entry+16, size);
+  }
+
+  store_dfd(hdr + dfd_offset, fi);
+
+  // Keys must be sorted by their byte values.
+  unsigned char *kv = hdr + kvd_offset;
+  kv = store_kv_entry(kv, kv_orientation_key, sizeof kv_orientation_key,
+                      kv_orientation_val, sizeof kv_orientation_val);
+  kv = store_kv_entry(kv, kv_writer_key, sizeof kv_writer_key,
+                      kv_writer_val, sizeof kv_writer_val);
+  if (has_regions) {
+    unsigned char val[16];
+    store_u64(val, regions_offset);
+    store_u64(val+8, AU_B1_GetUsedCount(&regions_b1));
+    kv = store_kv_entry(kv, kv_regions_key, sizeof kv_regions_key,
+                        val, sizeof val);
+  }
+  assert(kv == hdr + kvd_offset + kvd_size);
+
+  res = X_KTX_FAIL_LIBC;
+  fp = fopen(filename, "wb");
+  goto_if(!fp, end);
+  goto_if(fwrite(hdr, 1, data_offset, fp) != data_offset, end);
+
+  offset = data_offset;
+  for (int i = img->num_levels - 1; i >= 0; i--) {
+    const struct XKTXLevel *lvl = img->levels + i;
+    goto_if(write_zeros(fp, level_offsets[i] - offset) < 0, end);
+    for (int y = 0; y < lvl->rows; y++) {
+      const char *row = (const char*) lvl->data + (size_t) y*lvl->pitch;
+      goto_if(fwrite(row, 1, lvl->row_size, fp) != lvl->row_size, end);
+    }
+    offset = level_offsets[i] + (uint64_t) lvl->row_size*lvl->rows;
+  }
+
+  if (has_regions) {
+    size_t size = AU_B1_GetUsedCount(&regions_b1);
+    goto_if(write_zeros(fp, regions_offset - offset) < 0, end);
+    goto_if(fwrite(AU_B1_GetMemory(&regions_b1), 1, size, fp) != size, end);
+  }
+
+  res = X_KTX_OK;
+
+end:
+  if (fp && fclose(fp) != 0 && res == X_KTX_OK) {
+    res = X_KTX_FAIL_LIBC;
+  }
+  free(hdr);
+  if (has_regions) {
+    free(AU_B1_GetMemory(&regions_b1));
+  }
+  return res;
+}
+
+int
+xktx_patch_rows(const char *filename,
+                const struct XKTXImage *img,
+                int has_regions,
+                int level,
+                int first_row,
+                int num_rows,
+                const void *rows,
+                size_t pitch)
+{
+  assert(img);
+  assert(filename);
+  assert(*filename);
+  assert(rows);
+  assert(level >= 0 && level < img->num_levels);
+
+  const struct XKTXLevel *lvl = img->levels + level;
+  assert(first_row >= 0 && num_rows >= 0);
+  assert(first_row + num_rows <= lvl->rows);
+
+  struct Layout lt;
+  compute_layout(img, has_regions, &lt);
+  uint64_t offset = lt.level_offsets[level] +
+                    (uint64_t) lvl->row_size*first_row;
+  return_if(offset > LONG_MAX, X_KTX_FAIL_TOO_LARGE);
+
+  FILE *fp = fopen(filename, "r+b");
+  return_if(!fp, X_KTX_FAIL_LIBC);
+  int res = X_KTX_FAIL_LIBC;
+  goto_if(fseek(fp, offset, SEEK_SET) != 0, end);
+  for (int y = 0; y < num_rows; y++) {
+    const char *row = (const char*) rows + (size_t) y*pitch;
+    goto_if(fwrite(row, 1, lvl->row_size, fp) != lvl->row_size, end);
+  }
+  res = X_KTX_OK;
+
+end:
+  if (fclose(fp) != 0 && res == X_KTX_OK) {
+    res = X_KTX_FAIL_LIBC;
+  }
+  return res;
+}
+
+const char *
+xktx_strerror(int code) {
+  switch (code) {
+    case X_KTX_FAIL_LIBC:
+      return strerror(errno);
+    case X_KTX_FAIL_TOO_LARGE:
+      return "Atlas too large for the KTX2 container";
+    case X_KTX_FAIL_NO_MEM:
+      return "Out of memory";
+  }
+  return 0;
+}
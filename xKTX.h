@@ -0,0 +1,76 @@
+#ifndef X_KTX_H
+#define X_KTX_H
+
+#include <stddef.h>
+
+#include "RegionInfo.h"
+
+enum {
+  X_KTX_FAIL_LIBC = -1,
+  X_KTX_FAIL_TOO_LARGE = -2,
+  X_KTX_FAIL_NO_MEM = -3,
+  X_KTX_OK = 0
+};
+
+enum {
+  X_KTX_FORMAT_RGBA8,
+  X_KTX_FORMAT_BC1,
+  X_KTX_FORMAT_BC3
+};
+
+/**
+ * One mip level of the image: rows rows of row_size bytes each, pitch bytes
+ * apart in data. For block compressed formats, a row is a row of blocks.
+ */
+struct XKTXLevel {
+  const void *data;
+  size_t pitch, row_size;
+  int rows;
+};
+
+struct XKTXImage {
+  int format;
+  int w, h;
+  int num_levels;
+
+  // levels[0] is the full resolution level.
+  const struct XKTXLevel *levels;
+};
+
+/**
+ * Saves the image as a KTX2 container. Every level starts at a page boundary
+ * and its rows are tightly packed, so the file can be mmap'd and handed to
+ * the GPU as is.
+ *
+ * If regions is not null, the regions table (see RegionTable.h) is written in
+ * a section trailing the pixel data. Its offset and size are stored in the
+ * "imgpacker.regions" key/value entry as two little endian 64 bits integers.
+ */
+int
+xktx_save(const char *filename,
+          const struct XKTXImage *img,
+          const struct RegionInfo *regions,
+          int num_regions);
+
+/**
+ * Overwrites num_rows rows of a level, from first_row on, in a file saved by
+ * xktx_save for an image of the same format, size and levels, with regions
+ * embedded or not as has_regions says. The rest of the file is left as is.
+ *
+ * The rows are taken from rows, pitch bytes apart, rather than from the
+ * level's data. For block compressed formats, rows are rows of blocks.
+ */
+int
+xktx_patch_rows(const char *filename,
+                const struct XKTXImage *img,
+                int has_regions,
+                int level,
+                int first_row,
+                int num_rows,
+                const void *rows,
+                size_t pitch);
+
+const char *
+xktx_strerror(int code);
+
+#endif
@@ -2,11 +2,18 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include <png.h>
 #include <SDL2/SDL.h>
 
 #include "xPNG.h"
+#include "Trace.h"
+
+enum {
+  // Rows written per png_write_rows call, each traced as a span.
+  X_PNG_STRIP_ROWS = 64
+};
 
 static const char *e_msg = "";
 
@@ -38,6 +45,15 @@ xpng_user_error(png_structp ctx, png_const_charp str) {
 
 int
 xpng_save_surface(const char *filename, SDL_Surface *surf) {
+  return xpng_save_surface_rows(filename, surf, 0, 0);
+}
+
+int
+xpng_save_surface_rows(const char *filename,
+                       SDL_Surface *surf,
+                       int (*wait_rows)(void *ctx, int rows),
+                       void *ctx)
+{
   assert(surf);
   assert(filename);
   assert(*filename);
@@ -86,9 +102,21 @@ xpng_save_surface(const char *filename, SDL_Surface *surf) {
 
   row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * (size_t) surf->h);
   for (i = 0; i < surf->h; i++) {
-    row_pointers[i] = (png_bytep)(Uint8 *)surf->pixels + i*surf->pitch;
+    row_pointers[i] = (png_bytep)(Uint8 *)surf->pixels + (size_t) i*surf->pitch;
+  }
+  for (i = 0; i < surf->h; i += X_PNG_STRIP_ROWS) {
+    int rows = surf->h - i < X_PNG_STRIP_ROWS ? surf->h - i : X_PNG_STRIP_ROWS;
+    if (wait_rows && wait_rows(ctx, i + rows) < 0) {
+      free(row_pointers);
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      fclose(fp);
+      remove(filename);
+      return X_PNG_FAIL_ABORTED;
+    }
+    uint64_t t = trace_begin();
+    png_write_rows(png_ptr, row_pointers + i, rows);
+    trace_end("png_strip", 0, t);
   }
-  png_write_image(png_ptr, row_pointers);
   png_write_end(png_ptr, info_ptr);
 
   /* Cleaning out... */
@@ -99,6 +127,60 @@ xpng_save_surface(const char *filename, SDL_Surface *surf) {
   return X_PNG_OK;
 }
 
+int
+xpng_read_size(const void *data, size_t size, int *w, int *h) {
+  assert(data);
+  assert(w);
+  assert(h);
+
+  const unsigned char *p = data;
+  if (size < 24 || png_sig_cmp(p, 0, 8) != 0 || memcmp(p+12, "IHDR", 4)) {
+    return X_PNG_FAIL;
+  }
+  png_uint_32 pw = png_get_uint_32(p+16);
+  png_uint_32 ph = png_get_uint_32(p+20);
+  if (pw == 0 || ph == 0 || pw > PNG_UINT_31_MAX || ph > PNG_UINT_31_MAX) {
+    return X_PNG_FAIL;
+  }
+  *w = pw;
+  *h = ph;
+  return X_PNG_OK;
+}
+
+int
+xpng_decode_rgba(const void *data,
+                 size_t size,
+                 void *pixels,
+                 size_t pitch,
+                 char *msg)
+{
+  assert(data);
+  assert(pixels);
+  assert(msg);
+
+  /*
+   * The simplified API keeps its state, error message included, in the
+   * png_image, so there's no shared state between calls.
+   */
+  png_image img;
+  memset(&img, 0, sizeof img);
+  img.version = PNG_IMAGE_VERSION;
+  // The row stride is counted in components, which are bytes here.
+  if (pitch > PNG_UINT_31_MAX) {
+    strcpy(msg, "Row stride too large.");
+    return X_PNG_FAIL;
+  }
+  if (png_image_begin_read_from_memory(&img, data, size)) {
+    img.format = PNG_FORMAT_RGBA;
+    if (png_image_finish_read(&img, 0, pixels, pitch, 0)) {
+      return X_PNG_OK;
+    }
+  }
+  snprintf(msg, X_PNG_MESSAGE_SIZE, "%s", img.message);
+  png_image_free(&img);
+  return X_PNG_FAIL;
+}
+
 const char *
 xpng_strerror(int code) {
   switch (code) {
@@ -107,6 +189,8 @@ xpng_strerror(int code) {
       return e_msg;
     case X_PNG_FAIL_LIBC:
       return strerror(errno);
+    case X_PNG_FAIL_ABORTED:
+      return "Aborted";
   }
   return 0;
 }
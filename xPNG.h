@@ -1,17 +1,58 @@
 #ifndef X_PNG_H
 #define X_PNG_H
 
+#include <stddef.h>
+
 #include <SDL/SDL.h>
 
 enum {
   X_PNG_FAIL_LIBC = -1,
   X_PNG_FAIL = -2,
+  X_PNG_FAIL_ABORTED = -3,
   X_PNG_OK = 0
 };
 
+enum {
+  X_PNG_MESSAGE_SIZE = 64
+};
+
 int
 xpng_save_surface(const char *filename, SDL_Surface *surf);
 
+/**
+ * Like xpng_save_surface, for a surface still being drawn: before rows are
+ * written, wait_rows(ctx, n) is called, and must return once rows [0, n) are
+ * final. If it returns something negative instead, the file is removed and
+ * X_PNG_FAIL_ABORTED is returned.
+ */
+int
+xpng_save_surface_rows(const char *filename,
+                       SDL_Surface *surf,
+                       int (*wait_rows)(void *ctx, int rows),
+                       void *ctx);
+
+/**
+ * Returns X_PNG_OK and the image dimensions if data starts like a PNG file,
+ * X_PNG_FAIL otherwise. Only the signature and the header chunk are looked at.
+ */
+int
+xpng_read_size(const void *data, size_t size, int *w, int *h);
+
+/**
+ * Decodes the PNG file in data as 8 bits RGBA (in that byte order) into
+ * pixels, whose rows are pitch bytes apart.
+ *
+ * Unlike the other functions here, this one can be called from several
+ * threads at once: on X_PNG_FAIL, the error message is written to msg, which
+ * must have room for X_PNG_MESSAGE_SIZE chars.
+ */
+int
+xpng_decode_rgba(const void *data,
+                 size_t size,
+                 void *pixels,
+                 size_t pitch,
+                 char *msg);
+
 const char *
 xpng_strerror(int code);
 
@@ -0,0 +1,324 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <SDL2/SDL.h>
+
+#include "XFlow.h"
+#include "xQOI.h"
+#include "Trace.h"
+
+/*
+ * The format, from the specification at https://qoiformat.org: a 14 bytes
+ * header, then chunks for the pixels in row order, then 7 zeros and a one.
+ * Each chunk is one of the operations below, relative to the previous pixel
+ * (opaque black at first) or to an index of the 64 pixels seen last, by
+ * hash. Runs go on from one row to the next.
+ */
+enum {
+  QOI_HEADER_SIZE = 14,
+  QOI_PADDING_SIZE = 8,
+  QOI_OP_INDEX = 0x00,
+  QOI_OP_DIFF = 0x40,
+  QOI_OP_LUMA = 0x80,
+  QOI_OP_RUN = 0xc0,
+  QOI_OP_RGB = 0xfe,
+  QOI_OP_RGBA = 0xff,
+  QOI_MASK_2 = 0xc0,
+  QOI_MAX_RUN = 62,
+
+  // Bytes taken by a pixel at worst (QOI_OP_RGBA).
+  QOI_MAX_PIXEL_SIZE = 5,
+
+  // Rows encoded between wait_rows calls, each traced as a span.
+  X_QOI_STRIP_ROWS = 64
+};
+
+static const unsigned char padding[QOI_PADDING_SIZE] = {
+  0, 0, 0, 0, 0, 0, 0, 1
+};
+
+static const char *e_msg = "";
+
+#define QOI_HASH(px) (((px)[0]*3 + (px)[1]*5 + (px)[2]*7 + (px)[3]*11) % 64)
+
+static void
+write_u32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint32_t
+read_u32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+         (uint32_t) p[2] << 8 | p[3];
+}
+
+/**
+ * The encoding state, carried from one row to the next.
+ */
+struct Encoder {
+  unsigned char index[64][4];
+  unsigned char prev[4];
+  int run;
+};
+
+/**
+ * Encodes the w pixels at px into out, which must have room for
+ * w*QOI_MAX_PIXEL_SIZE bytes. Returns the end of the bytes written.
+ */
+static unsigned char *
+encode_row(struct Encoder *enc, const unsigned char *px, int w,
+           unsigned char *out)
+{
+  unsigned char *prev = enc->prev;
+  for (int x = 0; x < w; x++, px += 4) {
+    if (!memcmp(px, prev, 4)) {
+      if (++enc->run == QOI_MAX_RUN) {
+        *out++ = QOI_OP_RUN | (enc->run - 1);
+        enc->run = 0;
+      }
+      continue;
+    }
+    if (enc->run) {
+      *out++ = QOI_OP_RUN | (enc->run - 1);
+      enc->run = 0;
+    }
+
+    int h = QOI_HASH(px);
+    if (!memcmp(enc->index[h], px, 4)) {
+      *out++ = QOI_OP_INDEX | h;
+    }
+    else if (px[3] == prev[3]) {
+      memcpy(enc->index[h], px, 4);
+      signed char vr = px[0] - prev[0];
+      signed char vg = px[1] - prev[1];
+      signed char vb = px[2] - prev[2];
+      signed char vg_r = vr - vg;
+      signed char vg_b = vb - vg;
+      if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+        *out++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+      }
+      else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+               vg_b > -9 && vg_b < 8)
+      {
+        *out++ = QOI_OP_LUMA | (vg + 32);
+        *out++ = (vg_r + 8) << 4 | (vg_b + 8);
+      }
+      else {
+        *out++ = QOI_OP_RGB;
+        memcpy(out, px, 3);
+        out += 3;
+      }
+    }
+    else {
+      memcpy(enc->index[h], px, 4);
+      *out++ = QOI_OP_RGBA;
+      memcpy(out, px, 4);
+      out += 4;
+    }
+    memcpy(prev, px, 4);
+  }
+  return out;
+}
+
+int
+xqoi_save_surface(const char *filename, SDL_Surface *surf) {
+  return xqoi_save_surface_rows(filename, surf, 0, 0);
+}
+
+int
+xqoi_save_surface_rows(const char *filename,
+                       SDL_Surface *surf,
+                       int (*wait_rows)(void *ctx, int rows),
+                       void *ctx)
+{
+  assert(surf);
+  assert(filename);
+  assert(*filename);
+
+  // Other formats are converted first, which takes every row at once.
+  SDL_Surface *conv = 0;
+  if (surf->format->format != SDL_PIXELFORMAT_RGBA32) {
+    if (wait_rows && wait_rows(ctx, surf->h) < 0) {
+      return X_QOI_FAIL_ABORTED;
+    }
+    wait_rows = 0;
+    conv = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA32, 0);
+    if (!conv) {
+      e_msg = SDL_GetError();
+      return X_QOI_FAIL;
+    }
+    surf = conv;
+  }
+
+  int res = X_QOI_FAIL_LIBC;
+  unsigned char *buf = malloc((size_t) surf->w*QOI_MAX_PIXEL_SIZE);
+  FILE *fp = buf ? fopen(filename, "wb") : 0;
+  if (!fp) {
+    free(buf);
+    SDL_FreeSurface(conv);
+    return X_QOI_FAIL_LIBC;
+  }
+
+  unsigned char header[QOI_HEADER_SIZE] = {'q', 'o', 'i', 'f'};
+  write_u32(header + 4, surf->w);
+  write_u32(header + 8, surf->h);
+  header[12] = 4; // RGBA
+  header[13] = 0; // sRGB with linear alpha
+  goto_if(fwrite(header, sizeof header, 1, fp) != 1, end);
+
+  struct Encoder enc;
+  memset(&enc, 0, sizeof enc);
+  enc.prev[3] = 255;
+  for (int y = 0; y < surf->h; y += X_QOI_STRIP_ROWS) {
+    int rows = surf->h - y < X_QOI_STRIP_ROWS ? surf->h - y
+                                              : X_QOI_STRIP_ROWS;
+    if (wait_rows && wait_rows(ctx, y + rows) < 0) {
+      res = X_QOI_FAIL_ABORTED;
+      goto end;
+    }
+    uint64_t t = trace_begin();
+    for (int r = y; r < y + rows; r++) {
+      const unsigned char *px = (const unsigned char*) surf->pixels +
+                                (size_t) r*surf->pitch;
+      unsigned char *out = encode_row(&enc, px, surf->w, buf);
+      goto_if(fwrite(buf, 1, out - buf, fp) != (size_t) (out - buf), end);
+    }
+    trace_end("qoi_strip", 0, t);
+  }
+  if (enc.run) {
+    buf[0] = QOI_OP_RUN | (enc.run - 1);
+    goto_if(fwrite(buf, 1, 1, fp) != 1, end);
+  }
+  goto_if(fwrite(padding, sizeof padding, 1, fp) != 1, end);
+  res = X_QOI_OK;
+
+end:
+  free(buf);
+  SDL_FreeSurface(conv);
+  if (fclose(fp) != 0 && res == X_QOI_OK) {
+    res = X_QOI_FAIL_LIBC;
+  }
+  if (res == X_QOI_FAIL_ABORTED) {
+    remove(filename);
+  }
+  return res;
+}
+
+int
+xqoi_read_size(const void *data, size_t size, int *w, int *h) {
+  assert(data);
+  assert(w);
+  assert(h);
+
+  const unsigned char *p = data;
+  if (size < QOI_HEADER_SIZE + QOI_PADDING_SIZE || memcmp(p, "qoif", 4) ||
+      (p[12] != 3 && p[12] != 4) || p[13] > 1)
+  {
+    return X_QOI_FAIL;
+  }
+  uint32_t qw = read_u32(p + 4);
+  uint32_t qh = read_u32(p + 8);
+  if (qw == 0 || qh == 0 || qw > INT_MAX || qh > INT_MAX) {
+    return X_QOI_FAIL;
+  }
+  *w = qw;
+  *h = qh;
+  return X_QOI_OK;
+}
+
+int
+xqoi_decode_rgba(const void *data,
+                 size_t size,
+                 void *pixels,
+                 size_t pitch,
+                 char *msg)
+{
+  assert(data);
+  assert(pixels);
+  assert(msg);
+
+  int w, h;
+  if (xqoi_read_size(data, size, &w, &h) != X_QOI_OK) {
+    snprintf(msg, X_QOI_MESSAGE_SIZE, "Not a QOI file");
+    return X_QOI_FAIL;
+  }
+
+  const unsigned char *p = (const unsigned char*) data + QOI_HEADER_SIZE;
+  // The padding is never read as chunks.
+  const unsigned char *end = (const unsigned char*) data + size -
+                             QOI_PADDING_SIZE;
+  unsigned char index[64][4];
+  memset(index, 0, sizeof index);
+  unsigned char px[4] = {0, 0, 0, 255};
+  int run = 0;
+  for (int y = 0; y < h; y++) {
+    unsigned char *row = (unsigned char*) pixels + (size_t) y*pitch;
+    for (int x = 0; x < w; x++, row += 4) {
+      if (run > 0) {
+        run--;
+        memcpy(row, px, 4);
+        continue;
+      }
+      goto_if(p >= end, truncated);
+      int b1 = *p++;
+      if (b1 == QOI_OP_RGB) {
+        goto_if(end - p < 3, truncated);
+        memcpy(px, p, 3);
+        p += 3;
+      }
+      else if (b1 == QOI_OP_RGBA) {
+        goto_if(end - p < 4, truncated);
+        memcpy(px, p, 4);
+        p += 4;
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+        memcpy(px, index[b1], 4);
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+        px[0] += ((b1 >> 4) & 3) - 2;
+        px[1] += ((b1 >> 2) & 3) - 2;
+        px[2] += (b1 & 3) - 2;
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+        goto_if(p >= end, truncated);
+        int b2 = *p++;
+        int vg = (b1 & 0x3f) - 32;
+        px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+        px[1] += vg;
+        px[2] += vg - 8 + (b2 & 0x0f);
+      }
+      else {
+        run = b1 & 0x3f;
+      }
+      memcpy(index[QOI_HASH(px)], px, 4);
+      memcpy(row, px, 4);
+    }
+  }
+  return X_QOI_OK;
+
+truncated:
+  snprintf(msg, X_QOI_MESSAGE_SIZE, "Truncated QOI data");
+  return X_QOI_FAIL;
+}
+
+const char *
+xqoi_strerror(int code) {
+  switch (code) {
+    case X_QOI_FAIL:
+      assert(e_msg);
+      return e_msg;
+    case X_QOI_FAIL_LIBC:
+      return strerror(errno);
+    case X_QOI_FAIL_ABORTED:
+      return "Aborted";
+  }
+  return 0;
+}
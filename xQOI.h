@@ -0,0 +1,62 @@
+#ifndef X_QOI_H
+#define X_QOI_H
+
+#include <stddef.h>
+
+#include <SDL2/SDL.h>
+
+enum {
+  X_QOI_FAIL_LIBC = -1,
+  X_QOI_FAIL = -2,
+  X_QOI_FAIL_ABORTED = -3,
+  X_QOI_OK = 0
+};
+
+enum {
+  X_QOI_MESSAGE_SIZE = 64
+};
+
+/**
+ * Writes surf as a QOI file (https://qoiformat.org), with an alpha channel.
+ * QOI compresses a bit less than PNG, but it's several times as fast both
+ * ways, which is what counts for builds made again and again.
+ */
+int
+xqoi_save_surface(const char *filename, SDL_Surface *surf);
+
+/**
+ * Like xqoi_save_surface, for a surface still being drawn (see
+ * xpng_save_surface_rows).
+ */
+int
+xqoi_save_surface_rows(const char *filename,
+                       SDL_Surface *surf,
+                       int (*wait_rows)(void *ctx, int rows),
+                       void *ctx);
+
+/**
+ * Returns X_QOI_OK and the image dimensions if data starts like a QOI file,
+ * X_QOI_FAIL otherwise. Only the header is looked at.
+ */
+int
+xqoi_read_size(const void *data, size_t size, int *w, int *h);
+
+/**
+ * Decodes the QOI file in data as 8 bits RGBA (in that byte order) into
+ * pixels, whose rows are pitch bytes apart.
+ *
+ * Can be called from several threads at once. On X_QOI_FAIL, the error
+ * message is written to msg, which must have room for X_QOI_MESSAGE_SIZE
+ * chars.
+ */
+int
+xqoi_decode_rgba(const void *data,
+                 size_t size,
+                 void *pixels,
+                 size_t pitch,
+                 char *msg);
+
+const char *
+xqoi_strerror(int code);
+
+#endif